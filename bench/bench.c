@@ -0,0 +1,393 @@
+/* MIPS Emulator - throughput benchmarks */
+/* Copyright 2024 Daniil Dunaef */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h> /* POSIX only! */
+#include <sys/resource.h>
+
+#include "../src/mips.h"
+#include "../src/mips_machine.h"
+#include "../src/mips_uart.h"
+#include "../src/mips_gang.h"
+
+/* @note Every guest is an endless loop, a run is a fixed number of
+    retired instructions so all engines do the same work. Loops go
+    backwards through jr because branch offsets are zero-extended, and
+    constants above 0xffff are built with sll because lui loads 0.
+    One process benchmarks one engine, so the peak RSS it reports is the
+    peak of that engine alone; make bench runs one process per engine.
+    The gang runs GANG_LANES guests of every benchmark at once and counts
+    the instructions of all of them. Their code is the same, the seed
+    register starts at lane << 16 and the first instructions or into it.
+    Idle loop skipping is off, a loop that settles into a fixed point
+    would otherwise be skipped and the engine not measured. Before the
+    runs a loop of print syscalls, which is such a fixed point, runs with
+    idle skipping on and off and must print the same, a skipped syscall
+    loses its output.
+*/
+
+#define BENCH_BUDGET 50000000 /* instructions per guest */
+#define BENCH_UART 0x3f000000
+#define BENCH_PRINTS 1000000 /* instructions of the print syscall loop */
+
+const unsigned int bench_alu[] = {
+    0x34040004, /* ori a0, zero, 4 */
+    0x40806000, /* mtc0 zero, 12 */
+    0x35290001, /* ori t1, t1, 1 */
+    0x340f0010, /* ori t7, zero, loop */
+    0x01094021, /* loop: addu t0, t0, t1 */
+    0x01284826, /* xor t1, t1, t0 */
+    0x000850c0, /* sll t2, t0, 3 */
+    0x00095942, /* srl t3, t1, 5 */
+    0x014b6025, /* or t4, t2, t3 */
+    0x01886823, /* subu t5, t4, t0 */
+    0x01a97024, /* and t6, t5, t1 */
+    0x01ca8027, /* nor s0, t6, t2 */
+    0x0109882a, /* slt s1, t0, t1 */
+    0x25290007, /* addiu t1, t1, 7 */
+    0x01e00008  /* jr t7 */
+};
+
+const unsigned int bench_memcpy[] = {
+    0x34040004, /* ori a0, zero, 4 */
+    0x40806000, /* mtc0 zero, 12 */
+    0x34080010, /* ori t0, zero, 0x10 */
+    0x00084400, /* sll t0, t0, 16 */
+    0x34090020, /* ori t1, zero, 0x20 */
+    0x00094c00, /* sll t1, t1, 16 */
+    0x340a4000, /* ori t2, zero, 0x4000 */
+    0x340e0030, /* ori t6, zero, copy */
+    0x340f0024, /* ori t7, zero, outer */
+    0x01008025, /* outer: or s0, t0, zero */
+    0x01208825, /* or s1, t1, zero */
+    0x010a9021, /* addu s2, t0, t2 */
+    0x8e130000, /* copy: lw s3, 0(s0) */
+    0x8e140004, /* lw s4, 4(s0) */
+    0xae330000, /* sw s3, 0(s1) */
+    0xae340004, /* sw s4, 4(s1) */
+    0x26100008, /* addiu s0, s0, 8 */
+    0x26310008, /* addiu s1, s1, 8 */
+    0x12120002, /* beq s0, s2, swap */
+    0x01c00008, /* jr t6 */
+    0x0100a825, /* swap: or s5, t0, zero */
+    0x01204025, /* or t0, t1, zero */
+    0x02a04825, /* or t1, s5, zero */
+    0x26d60001, /* addiu s6, s6, 1 */
+    0x01e00008  /* jr t7 */
+};
+
+const unsigned int bench_branch[] = {
+    0x34040004, /* ori a0, zero, 4 */
+    0x40806000, /* mtc0 zero, 12 */
+    0x35080001, /* ori t0, t0, 1 */
+    0x340f0010, /* ori t7, zero, loop */
+    0x00088340, /* loop: sll s0, t0, 13 */
+    0x01104026, /* xor t0, t0, s0 */
+    0x00088442, /* srl s0, t0, 17 */
+    0x01104026, /* xor t0, t0, s0 */
+    0x00088140, /* sll s0, t0, 5 */
+    0x01104026, /* xor t0, t0, s0 */
+    0x31110001, /* andi s1, t0, 1 */
+    0x12200002, /* beq s1, zero, a */
+    0x25290001, /* addiu t1, t1, 1 */
+    0x31110002, /* a: andi s1, t0, 2 */
+    0x16200002, /* bne s1, zero, b */
+    0x254a0001, /* addiu t2, t2, 1 */
+    0x31110004, /* b: andi s1, t0, 4 */
+    0x12200002, /* beq s1, zero, c */
+    0x01685821, /* addu t3, t3, t0 */
+    0x012a902a, /* c: slt s2, t1, t2 */
+    0x16400002, /* bne s2, zero, d */
+    0x258c0001, /* addiu t4, t4, 1 */
+    0x01e00008  /* d: jr t7 */
+};
+
+const unsigned int bench_muldiv[] = {
+    0x34040004, /* ori a0, zero, 4 */
+    0x40806000, /* mtc0 zero, 12 */
+    0x35083039, /* ori t0, t0, 12345 */
+    0x34090309, /* ori t1, zero, 777 */
+    0x340f0014, /* ori t7, zero, loop */
+    0x01090019, /* loop: multu t0, t1 */
+    0x00008012, /* mflo s0 */
+    0x00008810, /* mfhi s1 */
+    0x01104021, /* addu t0, t0, s0 */
+    0x352a0001, /* ori t2, t1, 1 */
+    0x020a001b, /* divu s0, t2 */
+    0x00009012, /* mflo s2 */
+    0x00009810, /* mfhi s3 */
+    0x02530018, /* mult s2, s3 */
+    0x0000a012, /* mflo s4 */
+    0x010a001a, /* div t0, t2 */
+    0x0000a810, /* mfhi s5 */
+    0x01344821, /* addu t1, t1, s4 */
+    0x01354826, /* xor t1, t1, s5 */
+    0x25080003, /* addiu t0, t0, 3 */
+    0x01e00008  /* jr t7 */
+};
+
+const unsigned int bench_uart[] = {
+    0x34040004, /* ori a0, zero, 4 */
+    0x40806000, /* mtc0 zero, 12 */
+    0x340b3f00, /* ori t3, zero, 0x3f00 */
+    0x000b5c00, /* sll t3, t3, 16 */
+    0x340f0014, /* ori t7, zero, loop */
+    0x91700005, /* loop: lbu s0, 5(t3) */
+    0x32100020, /* andi s0, s0, 0x20 */
+    0x12000002, /* beq s0, zero, busy */
+    0xa1680000, /* sb t0, 0(t3) */
+    0x25080001, /* busy: addiu t0, t0, 1 */
+    0x3108007f, /* andi t0, t0, 0x7f */
+    0x01e00008  /* jr t7 */
+};
+
+const unsigned int bench_timer[] = {
+    0x34040004, /* ori a0, zero, 4 */
+    0x340803e8, /* ori t0, zero, 1000 */
+    0x40885800, /* mtc0 t0, 11 */
+    0x340f0010, /* ori t7, zero, loop */
+    0x25290001, /* loop: addiu t1, t1, 1 */
+    0x01495021, /* addu t2, t2, t1 */
+    0x016a5826, /* xor t3, t3, t2 */
+    0x01e00008  /* jr t7 */
+};
+
+const unsigned int bench_handler[] = {
+    0x00000000, /* sll zero, zero, 0 */
+    0x401a4800, /* mfc0 k0, 9 */
+    0x275a03e8, /* addiu k0, k0, 1000 */
+    0x409a5800, /* mtc0 k0, 11 */
+    0x277b0001, /* addiu k1, k1, 1 */
+    0x60000000  /* eret */
+};
+
+/* a syscall goes on at 0xbfc0380 + 4, the one there prints again */
+const unsigned int bench_print[] = {
+    0x3402000b, /* ori v0, zero, 11 */
+    0x34040041, /* ori a0, zero, 'A' */
+    0x0000000c  /* syscall */
+};
+
+const unsigned int bench_print_loop[] = {
+    0x0000000c  /* syscall */
+};
+
+typedef struct _MIPS_bench
+{
+    const char *name;
+    const unsigned int *code;
+    unsigned int len;
+    int seed; /* register that differs between the guests of a gang, 0 for none */
+} MIPS_bench;
+
+MIPS_bench benches[] = {
+    {"alu", bench_alu, sizeof(bench_alu), 9},
+    {"memcpy", bench_memcpy, sizeof(bench_memcpy), 0},
+    {"branch", bench_branch, sizeof(bench_branch), 8},
+    {"muldiv", bench_muldiv, sizeof(bench_muldiv), 8},
+    {"uart", bench_uart, sizeof(bench_uart), 0},
+    {"timer", bench_timer, sizeof(bench_timer), 0}
+};
+
+void bench_load(MIPS_machine *m, unsigned int address, const unsigned int *code, unsigned int len)
+{
+    unsigned int i;
+
+    for (i = 0; i < len / 4; i++)
+    {
+        unsigned char word[4];
+
+        word[0] = code[i] >> 24;
+        word[1] = code[i] >> 16;
+        word[2] = code[i] >> 8;
+        word[3] = code[i];
+        machine_load(m, address + i * 4, word, 4);
+    }
+}
+
+double bench_now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* returns the seconds it took, -1 if the machine could not be created */
+double bench_run(int engine, MIPS_bench *b, unsigned int budget, unsigned long *retired)
+{
+    MIPS_machine *m = machine_create(engine, NULL);
+    MIPS_uart uart;
+    double start;
+
+    if (m == NULL)
+        return -1;
+
+    /* no console, transmitted characters are dropped */
+    machine_idle(m, 0);
+    uart_init(&uart, &m->state, &m->mem, BENCH_UART);
+    bench_load(m, 0, b->code, b->len);
+    bench_load(m, 0x10000180, bench_handler, sizeof(bench_handler));
+
+    start = bench_now();
+    machine_run(m, budget);
+    start = bench_now() - start;
+
+    *retired = m->retired;
+    machine_destroy(m);
+
+    return start;
+}
+
+int bench_count(void *user, const char *buf, unsigned int len)
+{
+    *(unsigned long *)user += len;
+    return len;
+}
+
+/* characters the print syscall loop puts out, ~0 if the machine could not be created */
+unsigned long bench_prints(int engine, int idle)
+{
+    unsigned long printed = 0;
+    MIPS_io io;
+    MIPS_machine *m;
+
+    memset(&io, 0, sizeof(MIPS_io));
+    io.user = &printed;
+    io.write = bench_count;
+    m = machine_create(engine, &io);
+    if (m == NULL)
+        return ~0UL;
+
+    machine_idle(m, idle);
+    bench_load(m, 0, bench_print, sizeof(bench_print));
+    bench_load(m, 0xbfc0384, bench_print_loop, sizeof(bench_print_loop));
+    machine_run(m, BENCH_PRINTS);
+    machine_destroy(m);
+
+    return printed;
+}
+
+/* the same for a gang of ENGINE_INTERP machines, retired counts all of them */
+double bench_gang(MIPS_bench *b, unsigned int budget, unsigned long *retired)
+{
+    MIPS_machine *m[GANG_LANES];
+    MIPS_uart uart[GANG_LANES];
+    MIPS_gang g;
+    double start;
+    int l;
+
+    gang_init(&g);
+    for (l = 0; l < GANG_LANES; l++)
+    {
+        m[l] = machine_create(ENGINE_INTERP, NULL);
+        if (m[l] == NULL)
+        {
+            while (l-- > 0)
+                machine_destroy(m[l]);
+            return -1;
+        }
+        machine_idle(m[l], 0);
+        uart_init(&uart[l], &m[l]->state, &m[l]->mem, BENCH_UART);
+        bench_load(m[l], 0, b->code, b->len);
+        bench_load(m[l], 0x10000180, bench_handler, sizeof(bench_handler));
+        m[l]->state.regs[b->seed] = b->seed ? l << 16 : 0;
+        gang_add(&g, m[l], budget);
+    }
+
+    start = bench_now();
+    gang_run(&g);
+    start = bench_now() - start;
+
+    *retired = 0;
+    for (l = 0; l < GANG_LANES; l++)
+    {
+        *retired += m[l]->retired;
+        machine_destroy(m[l]);
+    }
+
+    return start;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *names[] = {"interp", "icache", "block", "jit", "gang"};
+    unsigned int budget = BENCH_BUDGET;
+    int engine = ENGINE_ICACHE;
+    unsigned long total = 0;
+    double seconds = 0;
+    struct rusage usage;
+    MIPS_machine *probe;
+    unsigned int i;
+
+    for (i = 1; i < (unsigned int)argc; i++)
+    {
+        if (strcmp(argv[i], "-m") == 0 && i + 1 < (unsigned int)argc)
+        {
+            i++;
+            for (engine = 0; engine < 5; engine++)
+                if (strcmp(argv[i], names[engine]) == 0)
+                    break;
+            if (engine == 5)
+            {
+                printf("Unknown mode: %s\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "-n") == 0 && i + 1 < (unsigned int)argc)
+            budget = strtoul(argv[++i], NULL, 0);
+        else
+        {
+            printf("Usage: %s [-m interp|icache|block|jit|gang] [-n instructions]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    probe = machine_create(engine == ENGINE_GANG ? ENGINE_INTERP : engine, NULL);
+    if (probe == NULL)
+    {
+        printf("Failed to allocate memory\n");
+        return 1;
+    }
+    if (probe->engine != engine && engine != ENGINE_GANG)
+    {
+        printf("%-8s not available on this host\n", names[engine]);
+        machine_destroy(probe);
+        return 0;
+    }
+    machine_destroy(probe);
+
+    if (engine != ENGINE_GANG && bench_prints(engine, 1) != bench_prints(engine, 0))
+    {
+        printf("%-8s idle loop skipping dropped syscalls\n", names[engine]);
+        return 1;
+    }
+
+    for (i = 0; i < sizeof(benches) / sizeof(benches[0]); i++)
+    {
+        unsigned long retired;
+        double s = engine == ENGINE_GANG ? bench_gang(&benches[i], budget, &retired) :
+            bench_run(engine, &benches[i], budget, &retired);
+
+        if (s < 0)
+        {
+            printf("Failed to allocate memory\n");
+            return 1;
+        }
+        if (s <= 0)
+            s = 1e-6;
+
+        printf("%-8s %-8s %10lu inst %8.3f s %9.2f MIPS %8.2f ns/inst\n",
+            names[engine], benches[i].name, retired, s, retired / s / 1e6, s * 1e9 / retired);
+        total += retired;
+        seconds += s;
+    }
+
+    getrusage(RUSAGE_SELF, &usage);
+    printf("%-8s %-8s %10lu inst %8.3f s %9.2f MIPS %8.2f ns/inst, peak RSS %ld KB\n\n",
+        names[engine], "total", total, seconds, total / seconds / 1e6, seconds * 1e9 / total, usage.ru_maxrss);
+
+    return 0;
+}
@@ -1,27 +1,39 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <signal.h> /* POSIX only! */
 #include <sys/time.h> /* Linux only! */
+#include <sys/stat.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/select.h>
 
-unsigned int ldmem(size_t size, unsigned char *m, unsigned int a);
-void stmem(size_t size, unsigned char *m, unsigned int a, unsigned int d);
-
-#define LDMEM(r, s, m, a) r = ldmem(s, m, a)
-#define STMEM(s, m, a, d) stmem(s, m, a, d)
-#define CPRINT(c) printf("%c", c)
-#define SPRINT(s) {int i=0; while (mem[i+s]!='\0') {printf("%c", mem[i+s]); i++;}}
-/* #define SPRINT(s) printf("%x", s) */
-#define IPRINT(i) printf("%u", i)
-#define SREAD(b, l) fread((char *)b, 1, l, stdin)
-#define IREAD(i) scanf("%u", &i)
 #include "mips.h"
-
-MIPS_state state;
-
-unsigned char *mem;
+#include "mips_machine.h"
+#include "mips_batch.h"
+#include "mips_snapshot.h"
+#include "mips_elf.h"
+#include "mips_profile.h"
+#include "mips_lockstep.h"
+#include "mips_trace.h"
+#include "mips_replay.h"
+#include "mips_uart.h"
+#include "mips_disk.h"
+
+#define CONSOLE_UART 0x3f000000
+#define CONSOLE_DISK 0x3f001000
+#define CONSOLE_FILES 256 /* host fds a guest may open */
+#define CONSOLE_WAIT 10 /* milliseconds to wait for input while the guest spins on the UART */
+
+/* only for the SIGINT dump */
+MIPS_machine *machine;
+
+/* host fds opened by guests, the others are not theirs to touch */
+unsigned char guestfiles[CONSOLE_FILES];
 
 const char regname[33][5] = {"pc", "zero", "at", "v0", "v1", "a0", "a1", "a2", "a3", "t0", "t1", "t2", "t3", "t4", "t5", "t6", "t7", "s0", "s1", "s2", "s3", "s4", "s5", "s6", "s7", "t8", "t9", "k0", "k1", "gp", "sp", "fp", "ra"};
-const char cp0regname[32][10] = {"cp0", "cp1", "cp2", "cp3", "cp4", "cp5", "cp6", "cp7", "cp8", "count", "cp10", "compare", "status", "cause", "epc", "cp15", "cp16", "cp17", "cp18", "cp19", "cp20", "cp21", "cp22", "cp23", "cp24", "cp25", "cp26", "cp27", "cp28", "cp29", "cp30", "cp31"};
+const char cp0regname[32][10] = {"cp0", "cp1", "cp2", "cp3", "cp4", "cp5", "cp6", "cp7", "cp8", "count", "cp10", "compare", "status", "cause", "epc", "cp15", "perfinst", "perfbr", "perfld", "perfst", "perfmmio", "perfexc", "perfirq", "cp23", "cp24", "cp25", "cp26", "cp27", "cp28", "cp29", "cp30", "cp31"};
 
 void hexDump(char *desc, void *addr, int len) 
 {
@@ -69,7 +81,7 @@ void hexDump(char *desc, void *addr, int len)
     printf("  %s\n", buff);
 }
 
-void print_state()
+void print_report(MIPS_report *r)
 {
     int i;
 
@@ -77,107 +89,877 @@ void print_state()
 
     printf("--------PROCESSOR REGISTERS--------\n");
     for (i = 0; i < 32; i++)
-        printf("$%s: %u|0x%x\n", regname[i + 1], state.regs[i], state.regs[i]);
-    printf("$%s: %u|0x%x\n\n", regname[0], state.pc, state.pc);
+        printf("$%s: %u|0x%x\n", regname[i + 1], r->regs[i], r->regs[i]);
+    printf("$%s: %u|0x%x\n\n", regname[0], r->pc, r->pc);
     printf("--------COPROCESSOR 0 REGISTERS--------\n");
     for (i = 0; i < 32; i++)
-        printf("$%s: %u|0x%x\n", cp0regname[i], state.cp0regs[i], state.cp0regs[i]);
+        printf("$%s: %u|0x%x\n", cp0regname[i], r->cp0regs[i], r->cp0regs[i]);
+
+    printf("\n--------PERFORMANCE COUNTERS--------\n");
+    printf("retired: %lu\n", r->counters.retired);
+    printf("taken branches: %lu\n", r->counters.branches);
+    printf("loads: %lu\n", r->counters.loads);
+    printf("stores: %lu\n", r->counters.stores);
+    printf("mmio: %lu\n", r->counters.mmio);
+    printf("exceptions: %lu\n", r->counters.exceptions);
+    printf("interrupts: %lu\n", r->counters.interrupts);
     
     printf("\n--------MEMORY--------\n");
-    hexDump((char *)"FIRST KILOBYTE", mem + 0x20000000, 0x400);
+    hexDump((char *)"FIRST KILOBYTE", r->ram, MACHINE_REPORT_SIZE);
+}
+
+void print_state(MIPS_machine *m)
+{
+    MIPS_report r;
+
+    machine_report(m, &r);
+    print_report(&r);
 }
 
 void exit_handler(int sig)
 {
-    print_state();
+    if (machine != NULL)
+        print_state(machine);
 }
 
+int console_write(void *user, const char *buf, unsigned int len);
+int console_read(void *user, char *buf, unsigned int len);
+int console_poll(void *user, char *buf, unsigned int len);
+void console_wait(unsigned int ms);
+int console_file(void *user, int op, int fd, char *buf, unsigned int len);
+unsigned char *read_file(const char *file, unsigned int *size);
+int batch(const char *list, int engine, int workers, unsigned int budget);
+int profile(MIPS_machine *m, unsigned int budget, const char *stacks);
+int load_guest(MIPS_machine *m, MIPS_uart *uart, MIPS_disk *disk, const char *file, const char *restore, int elf, unsigned char *image, unsigned int size);
+int lockstep(MIPS_machine *m, MIPS_machine *ref, unsigned int budget, unsigned int interval);
+int record(MIPS_machine *m, unsigned int budget, unsigned int interval, const char *trace);
+int run_traced(MIPS_machine *m, unsigned int budget, const char *file, unsigned int last);
+int run(MIPS_machine *m, unsigned int budget, unsigned int ms, int playing);
+
 int main(int argc, char *argv[])
 {
     int i;
+    int engine = ENGINE_ICACHE;
+    int workers = 0;
+    unsigned int budget = 0x40000000;
+    char *file = NULL;
+    char *list = NULL;
+    char *save = NULL;
+    char *restore = NULL;
+    char *stacks = NULL;
+    char *trace = NULL;
+    char *check = NULL;
+    unsigned int interval = 0;
+    char *steps = NULL;
+    unsigned int last = 0;
+    char *inputs = NULL;
+    int playing = 0;
+    unsigned int forward = 0;
+    unsigned int ms = 0;
+    MIPS_replay replay;
+    MIPS_uart uart;
+    MIPS_uart refuart;
+    char *diskfile = NULL;
+    int mmu = 0;
+    int idle = 1;
+    int delta = 0;
+    MIPS_disk disk;
+    MIPS_disk refdisk;
+    FILE *log = NULL;
+    int ret = 0;
+
+    for (i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-m") == 0 && i + 1 < argc)
+        {
+            i++;
+            if (strcmp(argv[i], "interp") == 0)
+                engine = ENGINE_INTERP;
+            else if (strcmp(argv[i], "icache") == 0)
+                engine = ENGINE_ICACHE;
+            else if (strcmp(argv[i], "block") == 0)
+                engine = ENGINE_BLOCK;
+            else if (strcmp(argv[i], "jit") == 0)
+                engine = ENGINE_JIT;
+            else if (strcmp(argv[i], "gang") == 0)
+                engine = ENGINE_GANG;
+            else
+            {
+                printf("Unknown mode: %s\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc)
+            list = argv[++i];
+        else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+            workers = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+            budget = strtoul(argv[++i], NULL, 0);
+        else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+            save = argv[++i];
+        else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc)
+            restore = argv[++i];
+        else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc)
+            stacks = argv[++i];
+        else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc)
+            interval = strtoul(argv[++i], NULL, 0);
+        else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc)
+            trace = argv[++i];
+        else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc)
+            check = argv[++i];
+        else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+            steps = argv[++i];
+        else if (strcmp(argv[i], "-k") == 0 && i + 1 < argc)
+            last = strtoul(argv[++i], NULL, 0);
+        else if ((strcmp(argv[i], "-R") == 0 || strcmp(argv[i], "-P") == 0) && i + 1 < argc)
+        {
+            playing = argv[i][1] == 'P';
+            inputs = argv[++i];
+        }
+        else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc)
+            forward = strtoul(argv[++i], NULL, 0);
+        else if (strcmp(argv[i], "-D") == 0 && i + 1 < argc)
+            diskfile = argv[++i];
+        else if (strcmp(argv[i], "-M") == 0)
+            mmu = 1;
+        else if (strcmp(argv[i], "-i") == 0)
+            delta = 1;
+        else if (strcmp(argv[i], "-I") == 0)
+            idle = 0;
+        else if (strcmp(argv[i], "-T") == 0 && i + 1 < argc)
+            ms = strtoul(argv[++i], NULL, 0);
+        else
+            file = argv[i];
+    }
+
+    if (file == NULL && list == NULL && restore == NULL)
+    {
+        printf("Usage: %s [-m interp|icache|block|jit] [-n instructions] [-s snapshot] [-p stacks] <raw image or ELF>\n", argv[0]);
+        printf("       %s [-m interp|icache|block|jit] [-n instructions] [-s snapshot] [-p stacks] -r <snapshot>\n", argv[0]);
+        printf("       %s [-m interp|icache|block|jit|gang] [-n instructions] [-j workers] -b <directory|manifest>\n", argv[0]);
+        printf("       %s [-m icache|block|jit] [-n instructions] -l <interval> <raw image or ELF>\n", argv[0]);
+        printf("       %s [-n instructions] [-l interval] -w <trace> <raw image or ELF>\n", argv[0]);
+        printf("       %s [-m interp|icache|block|jit] -c <trace> <raw image or ELF>\n", argv[0]);
+        printf("       %s [-m interp|icache|block|jit] [-n instructions] [-k last] -t <trace> <raw image or ELF>\n", argv[0]);
+        printf("       -R <log> records console and device input, -P <log> plays it back,\n");
+        printf("       -f <instructions> runs that many before -t/-p start\n");
+        printf("       -D <file> is the disk at 0x3f001000, a playback never writes to it\n");
+        printf("       -M turns on the MMU, raw images then start at the reset vector 0xbfc00000\n");
+        printf("       -i with -r makes -s save only the pages changed since the restore\n");
+        printf("       -T <milliseconds> stops a plain run after that much host time\n");
+        printf("       -I runs idle loops instead of skipping them\n");
+        return 1;
+    }
 
-    if (argc < 2)
+    if (list != NULL)
     {
-        printf("Usage: %s <input file>\n", argv[0]);
+        if (workers <= 0)
+            workers = sysconf(_SC_NPROCESSORS_ONLN);
+        return batch(list, engine, workers, budget);
+    }
+
+    if (engine == ENGINE_GANG)
+    {
+        printf("-m gang runs batches only\n");
+        return 1;
+    }
+
+    if (forward != 0 && (interval != 0 || trace != NULL || check != NULL))
+    {
+        printf("-f can not be combined with -l, -w or -c\n");
         return 1;
     }
 
+    /* traces are written by the reference, it sees every store */
+    if (trace != NULL)
+        engine = ENGINE_INTERP;
+    if (trace != NULL && interval == 0)
+        interval = 1;
+
     signal(SIGINT, exit_handler);
 
-    FILE *fp = fopen(argv[1], "rb");
+    unsigned int size = 0;
+    unsigned char *image = NULL;
+    int elf = 0;
+
+    if (restore == NULL)
+    {
+        unsigned char ident[52];
+        FILE *fp = fopen(file, "rb");
+
+        /* ELF files are mapped, not read */
+        if (fp != NULL)
+        {
+            elf = elf_check(ident, fread(ident, 1, sizeof(ident), fp));
+            fclose(fp);
+        }
+        if (!elf)
+        {
+            image = read_file(file, &size);
+            if (image == NULL)
+                return 1;
+        }
+    }
+
+    MIPS_io io;
+    io.user = NULL;
+    io.write = console_write;
+    io.read = console_read;
+    io.poll = console_poll;
+    io.file = console_file;
+
+    machine = machine_create(engine, &io);
+
+    if (machine == NULL)
+    {
+        printf("Failed to allocate memory\n");
+        free(image);
+        return 1;
+    }
+
+    if (engine == ENGINE_JIT && machine->engine != ENGINE_JIT)
+        printf("JIT is not available on this host, using block mode\n");
+    if (mmu)
+        machine_mmu(machine, 1);
+    if (!idle)
+        machine_idle(machine, 0);
+
+    /* before the UART is mapped, its input is logged as console polls */
+    if (inputs != NULL)
+    {
+        log = fopen(inputs, playing ? "rb" : "wb");
+        if (log == NULL || replay_attach(&replay, &machine->mem, &machine->state, log, playing) != 0)
+        {
+            printf("Failed to open input log: %s\n", inputs);
+            if (log != NULL)
+                fclose(log);
+            machine_destroy(machine);
+            free(image);
+            return 1;
+        }
+    }
+
+    /* a playback must not change the disk it reads */
+    if (diskfile != NULL && disk_open(&disk, diskfile, playing && inputs != NULL) != 0)
+    {
+        printf("Failed to open disk: %s\n", diskfile);
+        if (log != NULL)
+            fclose(log);
+        machine_destroy(machine);
+        free(image);
+        return 1;
+    }
+
+    if (load_guest(machine, &uart, diskfile != NULL ? &disk : NULL, file, restore, elf, image, size) != 0)
+    {
+        if (diskfile != NULL)
+            disk_close(&disk);
+        if (log != NULL)
+            fclose(log);
+        machine_destroy(machine);
+        free(image);
+        return 1;
+    }
+
+    /* skip to the interesting part at full speed */
+    if (forward != 0)
+    {
+        if (machine_run(machine, forward < budget ? forward : budget) == 5)
+            budget = 0;
+        else
+            budget -= machine->retired;
+    }
+
+    if (trace != NULL)
+        ret = record(machine, budget, interval, trace);
+    else if (check != NULL)
+    {
+        FILE *fp = fopen(check, "rb");
+
+        if (fp == NULL)
+        {
+            printf("Failed to open trace: %s\n", check);
+            ret = 1;
+        }
+        else
+        {
+            ret = lockstep_replay(machine, fp, stdout) != 0;
+            fclose(fp);
+        }
+    }
+    else if (interval != 0)
+    {
+        MIPS_machine *ref = machine_create(ENGINE_INTERP, &io);
+        MIPS_disk *refd = NULL;
+
+        /* the reference writes to a private copy, the machine under test to the file */
+        if (diskfile != NULL && disk_open(&refdisk, diskfile, 1) == 0)
+            refd = &refdisk;
+        if (ref != NULL && mmu)
+            machine_mmu(ref, 1);
+        if (ref != NULL && !idle)
+            machine_idle(ref, 0);
+        if (ref == NULL || (diskfile != NULL && refd == NULL) || load_guest(ref, &refuart, refd, file, restore, elf, image, size) != 0)
+            ret = 1;
+        else
+            ret = lockstep(machine, ref, budget, interval);
+        if (ref != NULL)
+            machine_destroy(ref);
+        if (refd != NULL)
+            disk_close(refd);
+    }
+    else if (steps != NULL)
+        ret = run_traced(machine, budget, steps, last);
+    else if (stacks == NULL)
+        ret = run(machine, budget, ms, playing && inputs != NULL);
+    else
+        ret = profile(machine, budget, stacks);
+    free(image);
+    uart_flush(&uart);
+    if (log != NULL)
+        replay_report(&replay, stdout);
+
+    print_state(machine);
+
+    if (save != NULL && (delta && restore != NULL ? snapshot_delta(machine, save, restore) : snapshot_save(machine, save)) != 0)
+        printf("Failed to save snapshot: %s\n", save);
+
+    machine_destroy(machine);
+    if (diskfile != NULL)
+        disk_close(&disk);
+    if (log != NULL)
+        fclose(log);
+
+    return ret;
+}
+
+/* maps the devices and loads a snapshot, an ELF or a raw image */
+int load_guest(MIPS_machine *m, MIPS_uart *uart, MIPS_disk *disk, const char *file, const char *restore, int elf, unsigned char *image, unsigned int size)
+{
+    /* the UART and the disk, everything else above 0x3e000000 reads 0 */
+    uart_init(uart, &m->state, &m->mem, CONSOLE_UART);
+    if (disk != NULL)
+        disk_attach(disk, &m->state, &m->mem, CONSOLE_DISK);
+    machine_map(m, 0x3e000001, 0xc1ffffff, NULL, NULL, NULL);
+
+    if (restore != NULL)
+    {
+        if (snapshot_restore(m, restore) != 0)
+        {
+            printf("Failed to restore snapshot: %s\n", restore);
+            return -1;
+        }
+    }
+    else if (elf)
+    {
+        if (elf_load(m, file) != 0)
+        {
+            printf("Failed to load ELF: %s\n", file);
+            return -1;
+        }
+    }
+    else
+    {
+        /* raw images start at 0 or at the reset vector, pages are allocated on first touch */
+        machine_load(m, m->state.mmu ? MMU_RESET & 0x1fffffff : 0, image, size);
+    }
+
+    /* a restore drops all events */
+    uart_start(uart);
+
+    return 0;
+}
+
+/* runs m against the reference until budget, a stop or a divergence */
+int lockstep(MIPS_machine *m, MIPS_machine *ref, unsigned int budget, unsigned int interval)
+{
+    MIPS_lockstep ls;
+    int ret = 0;
+
+    lockstep_init(&ls, ref, m);
+    while (ret == 0 && m->retired < budget)
+        ret = lockstep_step(&ls, budget - m->retired < interval ? budget - m->retired : interval);
+
+    if (ret != -1 && lockstep_finish(&ls) != 0)
+        ret = -1;
+    if (ret == -1)
+    {
+        lockstep_diff(&ls, stdout);
+        return 1;
+    }
+
+    printf("lockstep matched, %lu steps of %u, %lu instructions\n", ls.steps, interval, m->retired);
+    return 0;
+}
+
+/* runs the guest for budget instructions or ms of host time (0 for no
+   limit), waits for console input whenever it spins on the UART */
+int run(MIPS_machine *m, unsigned int budget, unsigned int ms, int playing)
+{
+    unsigned long deadline = ms != 0 ? machine_now() + ms * 1000UL : 0;
+    unsigned long start = m->retired;
+    int why;
+
+    /* a playback brings its own input */
+    while ((why = machine_slice(m, budget - (unsigned int)(m->retired - start), deadline)) == STOP_WAIT)
+        if (!playing)
+            console_wait(CONSOLE_WAIT);
+
+    printf("\n%s after %lu instructions", machine_why(why), m->retired);
+    if (m->idle.skipped != 0)
+        printf(", %lu more skipped in %lu idle loops", m->idle.skipped, m->idle.loops);
+    printf("\n");
+    return 0;
+}
+
+/* writes an execution trace, of the last instructions only when last is set */
+int run_traced(MIPS_machine *m, unsigned int budget, const char *file, unsigned int last)
+{
+    MIPS_trace *t = (MIPS_trace *)malloc(sizeof(MIPS_trace));
+    FILE *fp = fopen(file, "wb");
+    unsigned int i;
+    int ret = 0;
+
+    if (t == NULL || fp == NULL || trace_open(t, fp, last, m->retired) != 0)
+    {
+        printf("Failed to write trace: %s\n", file);
+        if (fp != NULL)
+            fclose(fp);
+        free(t);
+        return 1;
+    }
+
+    for (i = 0; i < budget; i++)
+        if (trace_step(t, m) == 5)
+            break;
+
+    trace_close(t);
+    if (fclose(fp) != 0)
+    {
+        printf("Failed to write trace: %s\n", file);
+        ret = 1;
+    }
+    free(t);
+
+    return ret;
+}
+
+/* writes a lockstep trace of the reference */
+int record(MIPS_machine *m, unsigned int budget, unsigned int interval, const char *trace)
+{
+    MIPS_lockstep ls;
+    FILE *fp = fopen(trace, "wb");
 
     if (fp == NULL)
     {
-        printf("Failed to open file: %s\n", argv[1]);
+        printf("Failed to write trace: %s\n", trace);
+        return 1;
+    }
+
+    lockstep_init(&ls, m, NULL);
+    lockstep_begin(fp, interval);
+    while (m->retired < budget)
+        if (lockstep_record(&ls, budget - m->retired < interval ? budget - m->retired : interval, fp) == 5)
+            break;
+    lockstep_end(&ls, fp);
+
+    if (fclose(fp) != 0)
+    {
+        printf("Failed to write trace: %s\n", trace);
         return 1;
     }
+    return 0;
+}
+
+unsigned char *read_file(const char *file, unsigned int *size)
+{
+    FILE *fp = fopen(file, "rb");
+
+    if (fp == NULL)
+    {
+        printf("Failed to open file: %s\n", file);
+        return NULL;
+    }
 
     fseek(fp, 0, SEEK_END);
 
-    int size = ftell(fp);
+    *size = ftell(fp);
     fseek(fp, 0, SEEK_SET);
 
-    mem = (unsigned char *)malloc(0x40000000); /* 512MB rom + 512MB ram */
+    /* one spare byte so empty files are not a failed malloc */
+    unsigned char *image = (unsigned char *)malloc(*size + 1);
 
-    if (mem == NULL)
+    if (image == NULL)
     {
         printf("Failed to allocate memory\n");
         fclose(fp);
-        return 1;
+        return NULL;
     }
 
-    fread(mem, 1, size, fp);
+    fread(image, 1, *size, fp);
 
     fclose(fp);
 
-    for (i = 0; i < 32; i++)
-        state.regs[i] = 0;
-    for (i = 0; i < 32; i++)
-        state.cp0regs[i] = 0;
+    return image;
+}
 
-    state.pc = 0;
-    state.regs[29] = (1 << 24) - 4096;
-    state.cp0regs[11] = 0x00ff0000;
-    state.cp0regs[12] = 0x0000ff01;
+/* MMIO of a batch guest, the UART writes to the console kept per guest */
+void batch_setup(MIPS_job *job)
+{
+    MIPS_uart *uart = (MIPS_uart *)malloc(sizeof(MIPS_uart));
 
-    unsigned int instruction = 0;
-    unsigned int count = 0;
+    job->user = uart;
+    if (uart != NULL)
+        uart_init(uart, &job->machine->state, &job->machine->mem, CONSOLE_UART);
+    machine_map(job->machine, 0x3e000001, 0xc1ffffff, NULL, NULL, NULL);
+}
 
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
+/* the UART output still buffered goes to the job before the machine is gone */
+void batch_finish(MIPS_job *job)
+{
+    if (job->user != NULL)
+        uart_flush((MIPS_uart *)job->user);
+}
 
-    count = tv.tv_usec / 1000;
+int compare_names(const void *a, const void *b)
+{
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
 
-    for (i = 0; i < 0x40000000; i++)
+/* appends a copy of name to the list, -1 if out of memory */
+int add_guest(char ***names, unsigned int *n, unsigned int *cap, const char *name)
+{
+    char *copy;
+
+    if (*n == *cap)
     {
-        instruction = loadmemw(mem, state.pc);
+        unsigned int grown = *cap ? *cap * 2 : 64;
+        char **list = (char **)realloc(*names, grown * sizeof(char *));
 
-        if (execute(&state, instruction, mem, count) == 5)
-            break;
+        if (list == NULL)
+            return -1;
+        *names = list;
+        *cap = grown;
+    }
+    copy = (char *)malloc(strlen(name) + 1);
+    if (copy == NULL)
+        return -1;
+    strcpy(copy, name);
+    (*names)[(*n)++] = copy;
 
-        /* synchronize timer */
-        count = tv.tv_usec / 1000;
-        /* printf("%x\n", instruction); */
-        /* printf("$%x: %x%x%x%x\n", state.pc, mem[state.pc], mem[state.pc + 1], mem[state.pc + 2], mem[state.pc + 3]); */
-        /* printf("%x\n", execute(&state, instruction, mem)); */
+    return 0;
+}
+
+/* drops a list cut short by a failed allocation */
+char **free_guests(char **names, unsigned int *n)
+{
+    unsigned int i;
+
+    printf("Failed to allocate memory\n");
+    for (i = 0; i < *n; i++)
+        free(names[i]);
+    free(names);
+    *n = 0;
+
+    return NULL;
+}
+
+/* a directory of guest binaries or a manifest with one path per line */
+char **list_guests(const char *list, unsigned int *n)
+{
+    char **names = NULL;
+    unsigned int cap = 0;
+    char line[4096];
+    struct stat st;
+
+    *n = 0;
+
+    if (stat(list, &st) != 0)
+    {
+        printf("Failed to open file: %s\n", list);
+        return NULL;
     }
 
-    print_state();
+    if (S_ISDIR(st.st_mode))
+    {
+        DIR *dir = opendir(list);
+        struct dirent *e;
 
-    free(mem);
+        if (dir == NULL)
+        {
+            printf("Failed to open directory: %s\n", list);
+            return NULL;
+        }
 
-    return 0;
+        while ((e = readdir(dir)) != NULL)
+        {
+            if (e->d_name[0] == '.')
+                continue;
+            sprintf(line, "%.2000s/%.2000s", list, e->d_name);
+            if (stat(line, &st) != 0 || !S_ISREG(st.st_mode))
+                continue;
+
+            if (add_guest(&names, n, &cap, line) != 0)
+            {
+                closedir(dir);
+                return free_guests(names, n);
+            }
+        }
+        closedir(dir);
+
+        /* readdir() order is arbitrary, reports should not be */
+        qsort(names, *n, sizeof(char *), compare_names);
+    }
+    else
+    {
+        FILE *fp = fopen(list, "r");
+
+        if (fp == NULL)
+        {
+            printf("Failed to open file: %s\n", list);
+            return NULL;
+        }
+
+        while (fgets(line, sizeof(line), fp) != NULL)
+        {
+            line[strcspn(line, "\r\n")] = 0;
+            if (line[0] == 0 || line[0] == '#')
+                continue;
+
+            if (add_guest(&names, n, &cap, line) != 0)
+            {
+                fclose(fp);
+                return free_guests(names, n);
+            }
+        }
+        fclose(fp);
+    }
+
+    return names;
+}
+
+int batch(const char *list, int engine, int workers, unsigned int budget)
+{
+    unsigned int n;
+    unsigned int i;
+    unsigned int loaded = 0;
+    unsigned long total = 0;
+    char **names = list_guests(list, &n);
+
+    if (names == NULL)
+        return 1;
+
+    MIPS_job *jobs = (MIPS_job *)calloc(n ? n : 1, sizeof(MIPS_job));
+
+    if (jobs == NULL)
+    {
+        free_guests(names, &n);
+        return 1;
+    }
+
+    for (i = 0; i < n; i++)
+    {
+        unsigned char *image = read_file(names[i], &jobs[loaded].size);
+
+        if (image == NULL)
+            continue;
+        jobs[loaded].name = names[i];
+        jobs[loaded].image = image;
+        loaded++;
+    }
+
+    MIPS_batch b;
+    batch_init(&b, jobs, loaded, engine, budget, 0);
+    b.setup = batch_setup;
+    b.finish = batch_finish;
+
+    struct timeval start;
+    struct timeval end;
+    gettimeofday(&start, NULL);
+
+    if (batch_run(&b, workers) != 0)
+    {
+        printf("Failed to allocate memory\n");
+        return 1;
+    }
+
+    gettimeofday(&end, NULL);
+
+    for (i = 0; i < loaded; i++)
+    {
+        MIPS_job *job = &jobs[i];
+
+        printf("\n========%s========\n", job->name);
+        if (job->failed)
+        {
+            printf("Failed to allocate memory\n");
+            continue;
+        }
+
+        total += job->report.retired;
+        printf("%s after %lu instructions\n", job->stopped ? "stopped" : "budget exhausted", job->report.retired);
+        if (job->outlen > 0)
+        {
+            printf("--------CONSOLE--------\n");
+            fwrite(job->output, 1, job->outlen, stdout);
+            printf("\n");
+        }
+        print_report(&job->report);
+    }
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+
+    printf("\n--------BATCH--------\n");
+    printf("guests: %u\n", loaded);
+    printf("workers: %d\n", b.nworkers);
+    printf("steals: %u\n", batch_steals(&b));
+    if (engine == ENGINE_GANG)
+        printf("grouped: %.1f%%\n", b.grouped + b.alone > 0 ? 100.0 * b.grouped / (b.grouped + b.alone) : 0.0);
+    printf("instructions: %lu\n", total);
+    printf("seconds: %.3f\n", seconds);
+    printf("MIPS: %.2f\n", seconds > 0 ? total / seconds / 1e6 : 0.0);
+
+    batch_free(&b);
+    for (i = 0; i < loaded; i++)
+    {
+        free((void *)jobs[i].image);
+        free(jobs[i].user);
+    }
+    for (i = 0; i < n; i++)
+        free(names[i]);
+    free(names);
+    free(jobs);
+
+    return loaded == n ? 0 : 1;
 }
 
-unsigned int ldmem(size_t size, unsigned char *m, unsigned int a)
+/* single steps the machine through the profiler, the flat profile goes
+   to stdout and the collapsed call stacks to the stacks file */
+int profile(MIPS_machine *m, unsigned int budget, const char *stacks)
 {
-    if (a == 0x1000000)
-        return getchar();
+    MIPS_profile *p;
+    unsigned int i;
+    FILE *fp;
+
+#ifndef MIPS_PROFILE
+    printf("Memory and interrupt counters need a MIPS_PROFILE build (make profile)\n");
+#endif
+
+    p = profile_create(m->state.pc);
+    if (p == NULL)
+    {
+        printf("Failed to allocate memory\n");
+        return 1;
+    }
+
+    for (i = 0; i < budget; i++)
+    {
+        unsigned int pc = m->state.pc;
+        unsigned int instruction = mem_uncached(&m->mem, pc) ? 0 : mem_fetch(&m->mem, pc);
+        int ret = machine_run(m, 1);
+
+        profile_retire(p, pc, instruction, m->state.pc);
+        if (ret == 5)
+            break;
+    }
+
+    profile_flat(p, &m->state, &m->mem, stdout);
+
+    fp = fopen(stacks, "w");
+    if (fp == NULL)
+        printf("Failed to write call stacks: %s\n", stacks);
+    else
+    {
+        profile_stacks(p, fp);
+        fclose(fp);
+    }
+
+    profile_free(p);
+
     return 0;
 }
 
-void stmem(size_t size, unsigned char *m, unsigned int a, unsigned int d)
+int console_write(void *user, const char *buf, unsigned int len)
 {
-    if (a == 0x1000000)
-        printf("%c", (char)d);
-}
\ No newline at end of file
+    return fwrite(buf, 1, len, stdout);
+}
+
+/* read() and not stdio, console_poll() and console_wait() look at fd 0
+   and would not see what stdio has buffered */
+int console_read(void *user, char *buf, unsigned int len)
+{
+    return (int)read(0, buf, len);
+}
+
+/* only what is there already, the guest keeps running */
+int console_poll(void *user, char *buf, unsigned int len)
+{
+    struct timeval now = {0, 0};
+    fd_set fds;
+    int n;
+
+    FD_ZERO(&fds);
+    FD_SET(0, &fds);
+    if (select(1, &fds, NULL, NULL, &now) <= 0)
+        return 0;
+
+    n = read(0, buf, len);
+    return n > 0 ? n : 0;
+}
+
+/* blocks until the console has input or ms have passed */
+void console_wait(unsigned int ms)
+{
+    struct timeval wait;
+    fd_set fds;
+
+    wait.tv_sec = ms / 1000;
+    wait.tv_usec = ms % 1000 * 1000;
+    FD_ZERO(&fds);
+    FD_SET(0, &fds);
+    select(1, &fds, NULL, NULL, &wait);
+}
+
+/* guest files are host files, the guest gets the host fd */
+int console_file(void *user, int op, int fd, char *buf, unsigned int len)
+{
+    int flags;
+
+    if (op == IO_OPEN)
+    {
+        flags = (fd & IO_ACCMODE) == 1 ? O_WRONLY : (fd & IO_ACCMODE) == 2 ? O_RDWR : O_RDONLY;
+        if (fd & IO_APPEND)
+            flags |= O_APPEND;
+        if (fd & IO_CREAT)
+            flags |= O_CREAT;
+        if (fd & IO_TRUNC)
+            flags |= O_TRUNC;
+        if (fd & IO_EXCL)
+            flags |= O_EXCL;
+
+        fd = open(buf, flags, len != 0 ? len : 0644);
+        if (fd >= CONSOLE_FILES)
+        {
+            close(fd);
+            return -1;
+        }
+        if (fd >= 0)
+            guestfiles[fd] = 1;
+        return fd;
+    }
+
+    if (fd < 0 || fd >= CONSOLE_FILES || !guestfiles[fd])
+        return -1;
+
+    switch (op)
+    {
+        case IO_READ:
+            return read(fd, buf, len);
+        case IO_WRITE:
+            return write(fd, buf, len);
+        case IO_CLOSE:
+            guestfiles[fd] = 0;
+            return close(fd);
+    }
+    return -1;
+}
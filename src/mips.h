@@ -8,220 +8,1756 @@
     Typical memory size is 1 << 29 (512MB).
 */
 
-#ifndef LDMEM
-#define LDMEM(r, s, m, a)
-#endif
-#ifndef STMEM
-#define STMEM(s, m, a, d)
-#endif
-#ifndef IPRINT
-#define IPRINT(i)
-#endif
-#ifndef SPRINT
-#define SPRINT(s)
-#endif
-#ifndef IREAD
-#define IREAD(i)
+#include <stdlib.h>
+#include <string.h>
+
+#include <stdio.h>
+
+typedef struct _R_FMT
+{
+    unsigned char opcode;
+    unsigned char rs;
+    unsigned char rt;
+    unsigned char rd;
+    unsigned char shift;
+    unsigned char funct;
+} R_FMT;
+
+typedef struct _I_FMT
+{
+    unsigned char opcode;
+    unsigned char rs;
+    unsigned char rt;
+    unsigned short immediate;
+} I_FMT;
+
+typedef struct _J_FMT
+{
+    unsigned char opcode;
+    unsigned int address;
+} J_FMT;
+
+#define MIPS_EVENTS (16 + 3) /* one per device (MEM_DEVICES), the timer, stop requests and the idle probe */
+
+/* why a run stopped, see machine_slice() */
+#define STOP_BUDGET 0 /* ran every instruction it was given */
+#define STOP_HALT 1 /* jr $ra or the exit syscall */
+#define STOP_BREAK 2 /* break, pc is at it */
+#define STOP_FAULT 3 /* an exception was delivered */
+#define STOP_WAIT 4 /* the guest spins on an empty device */
+#define STOP_DEADLINE 5 /* host time ran out */
+
+struct _MIPS_state;
+
+typedef struct _MIPS_event
+{
+    unsigned long when; /* clock value it fires at */
+    void (*fire)(struct _MIPS_state *state, void *user);
+    void *user;
+} MIPS_event;
+
+/* @note With the MMU on (machine_mmu()) guest addresses are virtual like
+    on a MIPS32 4Kc: kseg0 and kseg1 map straight onto the first 512MB of
+    physical memory, everything else goes through a software managed TLB
+    of MMU_TLB entries with variable page size. The guest fills it through
+    CP0 Index, Random, EntryLo0/1, Context, PageMask, Wired and EntryHi with
+    tlbr, tlbwi, tlbwr and tlbp. A miss or a fault raises a TLB exception
+    that restarts the instruction after eret, refills go to MMU_REFILL and
+    everything else to MMU_GENERAL. Privilege levels, ERL and caches are not
+    modelled, every mode may touch every segment.
+    With the MMU off addresses are physical and exceptions keep the vector
+    and eret of the original design.
+*/
+
+#define MMU_TLB 32
+#define MMU_KSEG0 0x80000000
+#define MMU_KSEG1 0xa0000000
+#define MMU_KSEG2 0xc0000000
+#define MMU_RESET 0xbfc00000 /* pc after reset with the MMU */
+#define MMU_REFILL 0x80000000 /* TLB refill vector */
+#define MMU_GENERAL 0x80000180
+#define MMU_EXL 0x02 /* Status bit */
+
+/* exception codes */
+#define MMU_MOD 1
+#define MMU_TLBL 2
+#define MMU_TLBS 3
+
+/* mmu_lookup() results */
+#define MMU_MISS 1
+#define MMU_INVALID 2
+#define MMU_CLEAN 3 /* store to a page without D */
+
+typedef struct _MIPS_tlb
+{
+    unsigned int hi; /* VPN2 and ASID */
+    unsigned int lo0, lo1; /* PFN, D, V, G of the even and odd page */
+    unsigned int mask;
+} MIPS_tlb;
+
+typedef struct _MIPS_state
+{
+    unsigned int pc;
+    unsigned int hi, lo;
+    unsigned int regs[32];
+    unsigned int cp0regs[32];
+    unsigned char interrupts[8];
+    int exception;
+    char mode;
+    unsigned long clock; /* retired instructions */
+    unsigned int countbase; /* CP0 Count is countbase + clock */
+    unsigned long next; /* when of events[0], ~0 with an empty queue */
+    int nevents;
+    MIPS_event events[MIPS_EVENTS]; /* sorted by when */
+    unsigned long branches; /* taken branches and jumps */
+    unsigned long loads, stores;
+    unsigned long traps, irqs; /* exceptions and interrupts delivered */
+    unsigned long timereads; /* guest reads of Count, Random and the performance counters */
+    unsigned long syscalls; /* host calls, they have effects outside the guest */
+    int mmu;
+    MIPS_tlb tlb[MMU_TLB];
+    int fault; /* mmu_lookup() result behind the pending exception, 0 if not a TLB one */
+    int faultreg; /* load target + 1 to put back when the fault is delivered */
+    unsigned int faultval;
+    unsigned int pending; /* interrupt lines raised while masked, with the MMU */
+    int stop; /* STOP_ reason the engine returns 5 for, 0 while running */
+    unsigned int yield; /* reasons stop_request() may stop for, 1 << STOP_ each */
+#ifdef MIPS_PROFILE
+    unsigned long raised[8]; /* interrupt_handler() calls per interrupt line */
+    unsigned long exceptions[32]; /* and per exception code */
 #endif
-#ifndef SREAD
-#define SREAD(b, l)
+} MIPS_state;
+
+/* @note Building with MIPS_PROFILE adds counters for interrupts, exceptions
+    and RAM/MMIO accesses (see mips_profile.h), without it they compile to
+    nothing.
+*/
+#ifdef MIPS_PROFILE
+#define PROFILE_COUNT(counter) ((counter)++)
+#else
+#define PROFILE_COUNT(counter) ((void)0)
 #endif
-#ifndef CPRINT
-#define CPRINT(c)
+
+/* @note Guest memory is a two-level page table, 1024 tables of 1024 pages
+    of 4KB cover the whole 32 bit address space. Pages are allocated on the
+    first write, reads from untouched pages return 0.
+    Devices are mapped with mem_map() and found through a map of device
+    indices per table, a table that is not covered by a single device gets
+    a map per page. A page that overlaps a device is I/O space as a whole
+    and never gets RAM, so an allocated page is always plain RAM and loads
+    and stores only look further when the page walk fails.
+    Loads, stores and fetches look in a direct mapped soft TLB of MEM_STLB
+    host pages first, tagged by guest page for reads and for writes. It is
+    filled on a miss from the page walk, through the MMU when that is on,
+    a read fill gives the write tag too if the page may be written.
+    Anything that frees pages or changes translations flushes it.
+    The write tag doubles as the write barrier: it is only given for pages
+    that are dirty already and hold no cached code, so a store that hits
+    costs nothing extra. The first store to a page after mem_clean() and
+    every store to a page with code go through mem_barrier(), which sets
+    the bit of the physical page in the dirty bitmap, logs the first
+    MEM_DIRTYLOG of them and drops the code of every guest page that maps
+    it through the codewrite hook. Code is tracked by physical page too, so
+    a store through an alias (kseg1 for code run from kseg0, another TLB
+    mapping, a device filling RAM) finds it. Lockstep hashes and
+    incremental snapshots only look at the dirty pages, the code caches
+    mark their pages with mem_code().
+    The syscall instruction talks to the host through io. Everything a
+    guest touches hangs off its MIPS_mem, so any number of them can coexist.
+*/
+
+#define MEM_PAGE_SHIFT 12
+#define MEM_PAGE_SIZE (1 << MEM_PAGE_SHIFT)
+#define MEM_TABLE_BITS 10
+#define MEM_TABLES (1 << (32 - MEM_PAGE_SHIFT - MEM_TABLE_BITS))
+#define MEM_DEVICES 16
+#define MEM_MIXED 0xff /* iotables entry of a table with a per-page map */
+#define MEM_STLB 1024 /* soft TLB entries, power of two */
+#define MEM_STLB_NONE 1 /* tag of an empty entry, never a page address */
+#define MEM_BITMAP (1 << (32 - MEM_PAGE_SHIFT - 3)) /* bytes of a bitmap with one bit per page */
+#define MEM_DIRTYLOG 256 /* dirty pages logged in store order */
+#define MEM_BIT(map, page) ((map)[(page) >> 3] & 1 << ((page) & 7))
+
+/* guest order is big-endian */
+#if defined(__BYTE_ORDER__) && defined(__ORDER_BIG_ENDIAN__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define MEM_BE16(x) (x)
+#define MEM_BE32(x) (x)
+#elif defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 3))
+#define MEM_BE16(x) ((unsigned short)((x) >> 8 | (x) << 8))
+#define MEM_BE32(x) __builtin_bswap32(x)
+#else
+#define MEM_BE16(x) ((unsigned short)((x) >> 8 | (x) << 8))
+#define MEM_BE32(x) ((x) >> 24 | ((x) >> 8 & 0xff00) | ((x) << 8 & 0xff0000) | (x) << 24)
 #endif
-#ifndef CUSTOMIOMEM
-#define CUSTOMIOMEM
+
+typedef struct _MIPS_device
+{
+    unsigned int base;
+    unsigned int size;
+    unsigned int (*read)(void *user, unsigned int address, int size);
+    void (*write)(void *user, unsigned int address, int size, unsigned int value);
+    void *user;
+} MIPS_device;
+
+/* file operations of the syscall instruction */
+#define IO_OPEN 0 /* buf is the path, fd the guest flags, len the mode */
+#define IO_READ 1
+#define IO_WRITE 2
+#define IO_CLOSE 3
+
+/* guest open flags, the values of MIPS Linux */
+#define IO_ACCMODE 0x0003 /* 0 read, 1 write, 2 both */
+#define IO_APPEND 0x0008
+#define IO_CREAT 0x0100
+#define IO_TRUNC 0x0200
+#define IO_EXCL 0x0400
+
+/* host console used by the syscall instruction and the UART, callbacks
+   may be NULL. poll is read that returns 0 instead of waiting for input.
+   file serves guest files, fd 0 to 2 are the console and never get there.
+   It returns the fd, the byte count or 0, -1 on failure */
+typedef struct _MIPS_io
+{
+    void *user;
+    int (*write)(void *user, const char *buf, unsigned int len);
+    int (*read)(void *user, char *buf, unsigned int len);
+    int (*poll)(void *user, char *buf, unsigned int len);
+    int (*file)(void *user, int op, int fd, char *buf, unsigned int len);
+} MIPS_io;
+
+typedef struct _MIPS_stlb
+{
+    unsigned int read, write; /* guest page for loads and for stores */
+    unsigned char *page;
+} MIPS_stlb;
+
+typedef struct _MIPS_mem
+{
+    MIPS_stlb stlb[MEM_STLB];
+    MIPS_state *mmu; /* translates through its TLB, NULL for physical addresses */
+    unsigned char **tables[MEM_TABLES];
+    unsigned int pages; /* allocated pages */
+    MIPS_device devices[MEM_DEVICES];
+    int ndevices;
+    unsigned char iotables[MEM_TABLES]; /* device + 1, 0 for RAM or MEM_MIXED */
+    unsigned char *iopages[MEM_TABLES]; /* device + 1 per page of MEM_MIXED tables */
+    MIPS_io io;
+    void (*codewrite)(void *cache, unsigned int address); /* drops the code of a guest page */
+    void *cache;
+    unsigned char code[MEM_BITMAP]; /* physical pages holding cached code */
+    unsigned char dirty[MEM_BITMAP]; /* physical pages stored to since mem_clean() */
+    unsigned int dirtylog[MEM_DIRTYLOG];
+    unsigned int ndirty; /* dirty pages, the log holds them all while <= MEM_DIRTYLOG */
+    unsigned char *backing; /* pages inside it are not ours to free, see mips_snapshot.h */
+    unsigned long backingsize;
+    void (*unback)(void *backing, unsigned long size);
+    unsigned long mmio; /* guest loads and stores that went to a device */
+#ifdef MIPS_PROFILE
+    unsigned long ramloads, ramstores;
+    unsigned long ioloads, iostores;
 #endif
+} MIPS_mem;
+
+R_FMT decodeR(unsigned int instruction)
+{
+    R_FMT fmt;
+    fmt.opcode = (instruction >> 26) & 0x3f;
+    fmt.rs = (instruction >> 21) & 0x1f;
+    fmt.rt = (instruction >> 16) & 0x1f;
+    fmt.rd = (instruction >> 11) & 0x1f;
+    fmt.shift = (instruction >> 6) & 0x1f;
+    fmt.funct = instruction & 0x3f;
+    return fmt;
+}
+
+I_FMT decodeI(unsigned int instruction)
+{
+    I_FMT fmt;
+    fmt.opcode = (instruction >> 26) & 0x3f;
+    fmt.rs = (instruction >> 21) & 0x1f;
+    fmt.rt = (instruction >> 16) & 0x1f;
+    fmt.immediate = instruction & 0xffff;
+    return fmt;
+}
+
+J_FMT decodeJ(unsigned int instruction)
+{
+    J_FMT fmt;
+    fmt.opcode = (instruction >> 26) & 0x3f;
+    fmt.address = instruction & 0x3ffffff;
+    return fmt;
+}
+
+/* physical address of va to *pa, returns 0 or why it does not translate */
+int mmu_lookup(MIPS_state *state, unsigned int va, int write, unsigned int *pa)
+{
+    unsigned int asid = state->cp0regs[10] & 0xff;
+    int i;
+
+    if (va - MMU_KSEG0 < MMU_KSEG2 - MMU_KSEG0)
+    {
+        *pa = va & 0x1fffffff;
+        return 0;
+    }
+
+    for (i = 0; i < MMU_TLB; i++)
+    {
+        const MIPS_tlb *e = &state->tlb[i];
+        unsigned int mask = e->mask | 0x1fff;
+        unsigned int lo;
+
+        if (((va ^ e->hi) & ~mask) != 0 || (!(e->lo0 & e->lo1 & 0x01) && (e->hi & 0xff) != asid))
+            continue;
+
+        lo = va & (mask + 1) >> 1 ? e->lo1 : e->lo0;
+        if (!(lo & 0x02))
+            return MMU_INVALID;
+        if (write && !(lo & 0x04))
+            return MMU_CLEAN;
+        *pa = ((lo >> 6) << MEM_PAGE_SHIFT & ~(mask >> 1)) | (va & mask >> 1);
+        return 0;
+    }
+
+    return MMU_MISS;
+}
+
+/* sets up BadVAddr, Context and EntryHi for a fault at va and raises it */
+void mmu_raise(MIPS_state *state, unsigned int va, int write, int why)
+{
+    state->cp0regs[8] = va;
+    state->cp0regs[4] = (state->cp0regs[4] & 0xff800000) | (va >> 9 & 0x7ffff0);
+    state->cp0regs[10] = (va & 0xffffe000) | (state->cp0regs[10] & 0xff);
+    state->exception = why == MMU_CLEAN ? MMU_MOD : write ? MMU_TLBS : MMU_TLBL;
+    state->fault = why;
+}
+
+/* first page of the given address, NULL if it was never written */
+unsigned char *mem_page(MIPS_mem *mem, unsigned int address)
+{
+    unsigned char **table = mem->tables[address >> (MEM_PAGE_SHIFT + MEM_TABLE_BITS)];
+
+    if (table == NULL)
+        return NULL;
+    return table[(address >> MEM_PAGE_SHIFT) & ((1 << MEM_TABLE_BITS) - 1)];
+}
+
+/* device + 1 of the page holding address, 0 for RAM */
+unsigned int mem_io(MIPS_mem *mem, unsigned int address)
+{
+    unsigned int t = address >> (MEM_PAGE_SHIFT + MEM_TABLE_BITS);
+    unsigned int i = mem->iotables[t];
+
+    if (i == MEM_MIXED)
+        i = mem->iopages[t][(address >> MEM_PAGE_SHIFT) & ((1 << MEM_TABLE_BITS) - 1)];
+    return i;
+}
+
+/* device mapped at address, NULL for RAM and unmapped I/O space */
+MIPS_device *mem_device(MIPS_mem *mem, unsigned int address)
+{
+    unsigned int i = mem_io(mem, address);
+    MIPS_device *dev;
+
+    if (i == 0)
+        return NULL;
+
+    dev = &mem->devices[i - 1];
+    if (address - dev->base < dev->size)
+        return dev;
+
+    /* the page is shared with another device or with unmapped space */
+    for (i = 0; i < (unsigned int)mem->ndevices; i++)
+    {
+        dev = &mem->devices[i];
+        if (address - dev->base < dev->size)
+            return dev;
+    }
+    return NULL;
+}
+
+/* same as mem_page() but allocates the page on first touch, NULL for I/O pages */
+unsigned char *mem_touch(MIPS_mem *mem, unsigned int address)
+{
+    unsigned char ***table = &mem->tables[address >> (MEM_PAGE_SHIFT + MEM_TABLE_BITS)];
+    unsigned char **page;
+
+    if (mem_io(mem, address) != 0)
+        return NULL;
+
+    if (*table == NULL)
+    {
+        *table = (unsigned char **)calloc(1 << MEM_TABLE_BITS, sizeof(unsigned char *));
+        if (*table == NULL)
+            return NULL;
+    }
+
+    page = &(*table)[(address >> MEM_PAGE_SHIFT) & ((1 << MEM_TABLE_BITS) - 1)];
+    if (*page == NULL)
+    {
+        *page = (unsigned char *)calloc(1, MEM_PAGE_SIZE);
+        if (*page == NULL)
+            return NULL;
+        mem->pages++;
+    }
+
+    return *page;
+}
+
+#define MEM_STLB_SLOT(mem, address) (&(mem)->stlb[((address) >> MEM_PAGE_SHIFT) & (MEM_STLB - 1)])
+
+void mem_flushtlb(MIPS_mem *mem)
+{
+    int i;
+
+    for (i = 0; i < MEM_STLB; i++)
+    {
+        mem->stlb[i].read = MEM_STLB_NONE;
+        mem->stlb[i].write = MEM_STLB_NONE;
+        mem->stlb[i].page = NULL;
+    }
+}
+
+/* drops the soft TLB entry of the guest page holding address */
+void mem_flushpage(MIPS_mem *mem, unsigned int address)
+{
+    MIPS_stlb *e = MEM_STLB_SLOT(mem, address);
+
+    if (e->read == (address & ~(MEM_PAGE_SIZE - 1)) || e->write == (address & ~(MEM_PAGE_SIZE - 1)))
+    {
+        e->read = MEM_STLB_NONE;
+        e->write = MEM_STLB_NONE;
+    }
+}
+
+/* starts a new dirty set. The write tags go too, so the next store to
+   every page is seen again */
+void mem_clean(MIPS_mem *mem)
+{
+    unsigned int i;
+
+    /* without dirty pages there are no write tags either */
+    if (mem->ndirty == 0)
+        return;
+    if (mem->ndirty > MEM_DIRTYLOG)
+        memset(mem->dirty, 0, sizeof(mem->dirty));
+    else
+        for (i = 0; i < mem->ndirty; i++)
+            mem->dirty[mem->dirtylog[i] >> 3] = 0;
+    mem->ndirty = 0;
+
+    for (i = 0; i < MEM_STLB; i++)
+        mem->stlb[i].write = MEM_STLB_NONE;
+}
+
+/* drops the code cached from the physical page holding pa under every
+   guest address that maps it: pa itself without the MMU, else its kseg0
+   and kseg1 addresses and every TLB mapping of it */
+void mem_uncode(MIPS_mem *mem, unsigned int pa)
+{
+    unsigned int page = pa >> MEM_PAGE_SHIFT;
+    int i;
+
+    if (!MEM_BIT(mem->code, page))
+        return;
+    mem->code[page >> 3] &= ~(1 << (page & 7));
+    if (mem->codewrite == NULL)
+        return;
+    if (mem->mmu == NULL)
+    {
+        mem->codewrite(mem->cache, pa);
+        return;
+    }
+
+    if (pa < MMU_KSEG1 - MMU_KSEG0)
+    {
+        mem->codewrite(mem->cache, pa | MMU_KSEG0);
+        mem->codewrite(mem->cache, pa | MMU_KSEG1);
+    }
+    for (i = 0; i < MMU_TLB; i++)
+    {
+        const MIPS_tlb *e = &mem->mmu->tlb[i];
+        unsigned int half = ((e->mask | 0x1fff) >> 1) + 1; /* bytes mapped by lo0 and by lo1 */
+        unsigned int va = e->hi & ~(half * 2 - 1);
+
+        if ((e->lo0 & 0x02) && pa - ((e->lo0 >> 6) << MEM_PAGE_SHIFT & ~(half - 1)) < half)
+            mem->codewrite(mem->cache, va + (pa & (half - 1)));
+        if ((e->lo1 & 0x02) && pa - ((e->lo1 >> 6) << MEM_PAGE_SHIFT & ~(half - 1)) < half)
+            mem->codewrite(mem->cache, va + half + (pa & (half - 1)));
+    }
+}
+
+/* a cache holds code fetched from the guest page at address, stores to
+   its physical page must take mem_barrier() from now on, through any
+   soft TLB entry */
+void mem_code(MIPS_mem *mem, unsigned int address)
+{
+    unsigned int pa = address;
+    unsigned int page;
+    unsigned char *host;
+    int i;
+
+    if (mem->mmu != NULL && mmu_lookup(mem->mmu, address, 0, &pa) != 0)
+        return;
+    page = pa >> MEM_PAGE_SHIFT;
+    if (MEM_BIT(mem->code, page))
+        return;
+    mem->code[page >> 3] |= 1 << (page & 7);
+
+    /* a page never written has no write tag anywhere */
+    host = mem_page(mem, pa);
+    if (host == NULL)
+        return;
+    for (i = 0; i < MEM_STLB; i++)
+        if (mem->stlb[i].page == host)
+            mem->stlb[i].write = MEM_STLB_NONE;
+}
+
+/* runs before a store to the physical address pa that missed the write tag */
+void mem_barrier(MIPS_mem *mem, unsigned int pa)
+{
+    unsigned int page = pa >> MEM_PAGE_SHIFT;
+
+    if (!MEM_BIT(mem->dirty, page))
+    {
+        mem->dirty[page >> 3] |= 1 << (page & 7);
+        if (mem->ndirty < MEM_DIRTYLOG)
+            mem->dirtylog[mem->ndirty] = page;
+        mem->ndirty++;
+    }
+    mem_uncode(mem, pa);
+}
+
+/* physical address of a guest access, raises the TLB exception and
+   returns -1 if it does not translate */
+int mem_translate(MIPS_mem *mem, unsigned int address, int write, unsigned int *pa)
+{
+    int why;
+
+    if (mem->mmu == NULL)
+    {
+        *pa = address;
+        return 0;
+    }
+    why = mmu_lookup(mem->mmu, address, write, pa);
+    if (why == 0)
+        return 0;
+    mmu_raise(mem->mmu, address, write, why);
+    return -1;
+}
+
+/* caches the RAM page at pa for guest accesses to address after a miss.
+   The write tag comes with it if the page may be stored to, is dirty and
+   holds no code */
+void mem_fill(MIPS_mem *mem, unsigned int address, unsigned int pa, int write)
+{
+    MIPS_stlb *e = MEM_STLB_SLOT(mem, address);
+    unsigned char *page = write ? mem_touch(mem, pa) : mem_page(mem, pa);
+    unsigned int tag = address & ~(MEM_PAGE_SIZE - 1);
+
+    if (page == NULL)
+        return;
+    e->page = page;
+    e->read = tag;
+    e->write = MEM_STLB_NONE;
+    if (!MEM_BIT(mem->dirty, pa >> MEM_PAGE_SHIFT) || MEM_BIT(mem->code, pa >> MEM_PAGE_SHIFT))
+        return;
+    if (write || mem->mmu == NULL || mmu_lookup(mem->mmu, address, 1, &pa) == 0)
+        e->write = tag;
+}
+
+/* 1 if what pc holds is not to be cached: I/O space or a fetch that does
+   not translate. Raises nothing */
+int mem_uncached(MIPS_mem *mem, unsigned int pc)
+{
+    unsigned int pa = pc;
+
+    if (mem->mmu != NULL && mmu_lookup(mem->mmu, pc, 0, &pa) != 0)
+        return 1;
+    return mem_io(mem, pa) != 0;
+}
+
+/* frees a page unless it lives in the backing mapping */
+void mem_release(MIPS_mem *mem, unsigned char *page)
+{
+    if (page == NULL)
+        return;
+    if (page < mem->backing || page >= mem->backing + mem->backingsize)
+        free(page);
+    mem->pages--;
+}
+
+/* installs a page the caller allocated, returns -1 for I/O pages or out of memory */
+int mem_attach(MIPS_mem *mem, unsigned int address, unsigned char *page)
+{
+    unsigned char ***table = &mem->tables[address >> (MEM_PAGE_SHIFT + MEM_TABLE_BITS)];
+    unsigned char **slot;
+
+    if (mem_io(mem, address) != 0)
+        return -1;
+
+    if (*table == NULL)
+    {
+        *table = (unsigned char **)calloc(1 << MEM_TABLE_BITS, sizeof(unsigned char *));
+        if (*table == NULL)
+            return -1;
+    }
+
+    slot = &(*table)[(address >> MEM_PAGE_SHIFT) & ((1 << MEM_TABLE_BITS) - 1)];
+    if (*slot != NULL)
+    {
+        mem_release(mem, *slot);
+        mem_flushtlb(mem);
+    }
+    *slot = page;
+    mem->pages++;
+
+    return 0;
+}
+
+unsigned char mem_readb(MIPS_mem *mem, unsigned int address)
+{
+    unsigned char *page = mem_page(mem, address);
+
+    if (page == NULL)
+        return 0;
+    return page[address & (MEM_PAGE_SIZE - 1)];
+}
+
+void mem_writeb(MIPS_mem *mem, unsigned int address, unsigned char value)
+{
+    unsigned char *page = mem_touch(mem, address);
+
+    if (page != NULL)
+        page[address & (MEM_PAGE_SIZE - 1)] = value;
+}
+
+void mem_init(MIPS_mem *mem)
+{
+    int i;
+
+    for (i = 0; i < MEM_TABLES; i++)
+    {
+        mem->tables[i] = NULL;
+        mem->iotables[i] = 0;
+        mem->iopages[i] = NULL;
+    }
+    mem->pages = 0;
+    mem->ndevices = 0;
+    mem->io.user = NULL;
+    mem->io.write = NULL;
+    mem->io.read = NULL;
+    mem->io.poll = NULL;
+    mem->io.file = NULL;
+    mem->codewrite = NULL;
+    mem->cache = NULL;
+    mem->backing = NULL;
+    mem->backingsize = 0;
+    mem->unback = NULL;
+    mem->mmu = NULL;
+    memset(mem->code, 0, sizeof(mem->code));
+    memset(mem->dirty, 0, sizeof(mem->dirty));
+    mem->ndirty = 0;
+    mem_flushtlb(mem);
+}
+
+/* drops all RAM, devices and host callbacks stay */
+void mem_clear(MIPS_mem *mem)
+{
+    int i, j;
+
+    for (i = 0; i < MEM_TABLES; i++)
+    {
+        if (mem->tables[i] == NULL)
+            continue;
+        for (j = 0; j < (1 << MEM_TABLE_BITS); j++)
+            mem_release(mem, mem->tables[i][j]);
+        free(mem->tables[i]);
+        mem->tables[i] = NULL;
+    }
+    mem->pages = 0;
+    mem_flushtlb(mem);
+    memset(mem->dirty, 0, sizeof(mem->dirty));
+    mem->ndirty = 0;
+
+    if (mem->unback != NULL)
+        mem->unback(mem->backing, mem->backingsize);
+    mem->backing = NULL;
+    mem->backingsize = 0;
+    mem->unback = NULL;
+}
+
+void mem_free(MIPS_mem *mem)
+{
+    int i;
+
+    mem_clear(mem);
+
+    for (i = 0; i < MEM_TABLES; i++)
+    {
+        free(mem->iopages[i]);
+        mem->iopages[i] = NULL;
+        mem->iotables[i] = 0;
+    }
+    mem->ndevices = 0;
+}
+
+/* maps a device over [base, base + size), returns 0 on success.
+   RAM in the pages it overlaps is dropped, earlier devices win overlaps */
+int mem_map(MIPS_mem *mem, unsigned int base, unsigned int size,
+    unsigned int (*read)(void *user, unsigned int address, int size),
+    void (*write)(void *user, unsigned int address, int size, unsigned int value),
+    void *user)
+{
+    MIPS_device *dev;
+    unsigned int first = base >> MEM_PAGE_SHIFT;
+    unsigned int last = (base + size - 1) >> MEM_PAGE_SHIFT;
+    unsigned int page;
+
+    if (mem->ndevices == MEM_DEVICES || size == 0 || base + size - 1 < base)
+        return -1;
+
+    dev = &mem->devices[mem->ndevices++];
+    dev->base = base;
+    dev->size = size;
+    dev->read = read;
+    dev->write = write;
+    dev->user = user;
+    mem_flushtlb(mem);
+
+    for (page = first; ; page++)
+    {
+        unsigned int t = page >> MEM_TABLE_BITS;
+        unsigned int i = page & ((1 << MEM_TABLE_BITS) - 1);
+
+        if (mem->tables[t] != NULL && mem->tables[t][i] != NULL)
+        {
+            mem_release(mem, mem->tables[t][i]);
+            mem->tables[t][i] = NULL;
+        }
+
+        if (mem->iotables[t] == 0)
+        {
+            if (i == 0 && last - page >= (1 << MEM_TABLE_BITS) - 1)
+                mem->iotables[t] = mem->ndevices;
+            else
+            {
+                mem->iopages[t] = (unsigned char *)calloc(1 << MEM_TABLE_BITS, 1);
+                if (mem->iopages[t] == NULL)
+                    return -1;
+                mem->iotables[t] = MEM_MIXED;
+            }
+        }
+
+        /* a table without a page map belongs to one device as a whole */
+        if (mem->iotables[t] == MEM_MIXED && mem->iopages[t][i] == 0)
+            mem->iopages[t][i] = mem->ndevices;
+
+        if (page == last)
+            break;
+    }
+
+    return 0;
+}
+
+unsigned int mmio_read(MIPS_mem *mem, unsigned int address, int size)
+{
+    MIPS_device *dev = mem_device(mem, address);
+
+    if (dev == NULL || dev->read == NULL)
+        return 0;
+    return dev->read(dev->user, address, size);
+}
+
+void mmio_write(MIPS_mem *mem, unsigned int address, int size, unsigned int value)
+{
+    MIPS_device *dev = mem_device(mem, address);
+
+    if (dev != NULL && dev->write != NULL)
+        dev->write(dev->user, address, size, value);
+}
+
+/* copies a host buffer into guest memory, bypassing MMIO */
+void mem_load(MIPS_mem *mem, unsigned int address, const unsigned char *src, unsigned int len)
+{
+    while (len > 0)
+    {
+        unsigned char *page = mem_touch(mem, address);
+        unsigned int offset = address & (MEM_PAGE_SIZE - 1);
+        unsigned int chunk = MEM_PAGE_SIZE - offset;
+
+        if (chunk > len)
+            chunk = len;
+        if (page != NULL)
+            memcpy(page + offset, src, chunk);
+
+        address += chunk;
+        src += chunk;
+        len -= chunk;
+    }
+}
+
+/* @note Loads and stores take one access on a soft TLB hit and fall back
+    to these on a miss or when the access crosses a page. I/O pages go to
+    their device, everything else is done byte by byte. With the MMU a
+    load that faults returns 0 and its target register gets its old value
+    back when the exception is delivered, a store that faults stores
+    nothing.
+*/
+
+unsigned int mem_read(MIPS_mem *mem, unsigned int address, int size)
+{
+    unsigned int value = 0;
+    int i;
+
+    if (mem_io(mem, address) != 0)
+        return mmio_read(mem, address, size);
+
+    for (i = 0; i < size; i++)
+        value = value << 8 | mem_readb(mem, address + i);
+    return value;
+}
+
+/* a load at state->pc faulted, keeps what its target register holds */
+void mmu_loadfault(MIPS_mem *mem)
+{
+    MIPS_state *state = mem->mmu;
+    unsigned int pa, instruction;
+
+    if (state->faultreg != 0 || mmu_lookup(state, state->pc, 0, &pa) != 0 || mem_io(mem, pa) != 0)
+        return;
+    instruction = mem_read(mem, pa, 4);
+    if (instruction >> 26 >= 0x20 && instruction >> 26 <= 0x26)
+    {
+        state->faultreg = (instruction >> 16 & 0x1f) + 1;
+        state->faultval = state->regs[instruction >> 16 & 0x1f];
+    }
+}
+
+unsigned int loadmem_slow(MIPS_mem *mem, unsigned int address, int size)
+{
+    unsigned int pa, value = 0;
+    int i;
+
+    if (mem_translate(mem, address, 0, &pa) != 0)
+    {
+        mmu_loadfault(mem);
+        return 0;
+    }
+    if (mem_io(mem, pa) != 0)
+    {
+        PROFILE_COUNT(mem->ioloads);
+        mem->mmio++;
+        return mmio_read(mem, pa, size);
+    }
+
+    PROFILE_COUNT(mem->ramloads);
+    mem_fill(mem, address, pa, 0);
+    for (i = 0; i < size; i++, pa++)
+    {
+        if (i > 0 && ((address + i) & (MEM_PAGE_SIZE - 1)) == 0 && mem_translate(mem, address + i, 0, &pa) != 0)
+        {
+            mmu_loadfault(mem);
+            return 0;
+        }
+        value = value << 8 | mem_readb(mem, pa);
+    }
+    return value;
+}
+
+void storemem_slow(MIPS_mem *mem, unsigned int address, int size, unsigned int value)
+{
+    unsigned int first = MEM_PAGE_SIZE - (address & (MEM_PAGE_SIZE - 1)); /* bytes in the first page */
+    unsigned int pa, next;
+    int i;
+
+    if (mem_translate(mem, address, 1, &pa) != 0)
+        return;
+    if (mem_io(mem, pa) != 0)
+    {
+        PROFILE_COUNT(mem->iostores);
+        mem->mmio++;
+        mmio_write(mem, pa, size, value);
+        return;
+    }
+
+    /* both pages translate before anything is stored */
+    next = pa + first;
+    if ((unsigned int)size > first && mem_translate(mem, address + first, 1, &next) != 0)
+        return;
+
+    PROFILE_COUNT(mem->ramstores);
+    mem_barrier(mem, pa);
+    if ((unsigned int)size > first)
+        mem_barrier(mem, next);
+    for (i = size - 1; i >= 0; i--)
+    {
+        mem_writeb(mem, (unsigned int)i < first ? pa + i : next + i - first, value & 0xff);
+        value >>= 8;
+    }
+    mem_fill(mem, address, pa, 1);
+}
+
+unsigned char loadmembu(MIPS_mem *mem, unsigned int address)
+{
+    MIPS_stlb *e = MEM_STLB_SLOT(mem, address);
+
+    if (e->read == (address & ~(MEM_PAGE_SIZE - 1)))
+    {
+        PROFILE_COUNT(mem->ramloads);
+        return e->page[address & (MEM_PAGE_SIZE - 1)];
+    }
+    return loadmem_slow(mem, address, sizeof(unsigned char));
+}
+
+char loadmemb(MIPS_mem *mem, unsigned int address)
+{
+    return loadmembu(mem, address);
+}
+
+unsigned short loadmemhu(MIPS_mem *mem, unsigned int address)
+{
+    MIPS_stlb *e = MEM_STLB_SLOT(mem, address);
+    unsigned int offset = address & (MEM_PAGE_SIZE - 1);
+    unsigned short value;
+
+    if (e->read == address - offset && offset <= MEM_PAGE_SIZE - 2)
+    {
+        PROFILE_COUNT(mem->ramloads);
+        memcpy(&value, e->page + offset, 2);
+        return MEM_BE16(value);
+    }
+    return loadmem_slow(mem, address, sizeof(unsigned short));
+}
+
+unsigned short loadmemh(MIPS_mem *mem, unsigned int address)
+{
+    return loadmemhu(mem, address);
+}
+
+int loadmemw(MIPS_mem *mem, unsigned int address)
+{
+    MIPS_stlb *e = MEM_STLB_SLOT(mem, address);
+    unsigned int offset = address & (MEM_PAGE_SIZE - 1);
+    unsigned int value;
+
+    if (e->read == address - offset && offset <= MEM_PAGE_SIZE - 4)
+    {
+        PROFILE_COUNT(mem->ramloads);
+        memcpy(&value, e->page + offset, 4);
+        return MEM_BE32(value);
+    }
+    return loadmem_slow(mem, address, sizeof(int));
+}
+
+/* instruction fetch, same as loadmemw() but not a data access. A fetch
+   that faults returns a nop with the exception raised */
+unsigned int mem_fetch(MIPS_mem *mem, unsigned int address)
+{
+    MIPS_stlb *e = MEM_STLB_SLOT(mem, address);
+    unsigned int offset = address & (MEM_PAGE_SIZE - 1);
+    unsigned int value, pa;
+
+    if (e->read == address - offset && offset <= MEM_PAGE_SIZE - 4)
+    {
+        memcpy(&value, e->page + offset, 4);
+        return MEM_BE32(value);
+    }
+    if (mem_translate(mem, address, 0, &pa) != 0)
+        return 0;
+    mem_fill(mem, address, pa, 0);
+    return mem_read(mem, pa, sizeof(int));
+}
+
+void storememb(MIPS_mem *mem, unsigned int address, unsigned char value)
+{
+    MIPS_stlb *e = MEM_STLB_SLOT(mem, address);
+
+    if (e->write == (address & ~(MEM_PAGE_SIZE - 1)))
+    {
+        PROFILE_COUNT(mem->ramstores);
+        e->page[address & (MEM_PAGE_SIZE - 1)] = value;
+        return;
+    }
+    storemem_slow(mem, address, sizeof(char), value);
+}
+
+void storememh(MIPS_mem *mem, unsigned int address, unsigned int value)
+{
+    MIPS_stlb *e = MEM_STLB_SLOT(mem, address);
+    unsigned int offset = address & (MEM_PAGE_SIZE - 1);
+    unsigned short half = value;
+
+    if (e->write == address - offset && offset <= MEM_PAGE_SIZE - 2)
+    {
+        PROFILE_COUNT(mem->ramstores);
+        half = MEM_BE16(half);
+        memcpy(e->page + offset, &half, 2);
+        return;
+    }
+    storemem_slow(mem, address, sizeof(short), value);
+}
+
+void storememw(MIPS_mem *mem, unsigned int address, unsigned int value)
+{
+    MIPS_stlb *e = MEM_STLB_SLOT(mem, address);
+    unsigned int offset = address & (MEM_PAGE_SIZE - 1);
+
+    if (e->write == address - offset && offset <= MEM_PAGE_SIZE - 4)
+    {
+        PROFILE_COUNT(mem->ramstores);
+        value = MEM_BE32(value);
+        memcpy(e->page + offset, &value, 4);
+        return;
+    }
+    storemem_slow(mem, address, sizeof(int), value);
+}
+
+/* interrupt lines are masked without Status IE, with the MMU also during EXL */
+void cp0_mask(MIPS_state *state)
+{
+    int masked = (state->cp0regs[12] & 0x01) == 0 || (state->mmu && (state->cp0regs[12] & MMU_EXL));
+    int i;
+
+    for (i = 0; i < 8; i++)
+        state->interrupts[i] = masked ? 0xff : 0x00;
+}
+
+void stop_request(MIPS_state *state, int why);
+
+/* exception entry with the MMU. TLB faults restart the instruction, for
+   everything else EPC is the instruction after it. A line raised while
+   masked or next to an exception of the same instruction waits in
+   pending until the guest unmasks it */
+void mmu_deliver(MIPS_state *state, int interrupt, int exception)
+{
+    unsigned int *cp0 = state->cp0regs;
+    unsigned int vector = MMU_GENERAL;
+
+    if (exception == 0)
+    {
+        if (state->interrupts[interrupt - 1] == 0xff || state->exception != 0)
+        {
+            state->pending |= 1 << (interrupt - 1);
+            return;
+        }
+        state->irqs++;
+        cp0[13] = (cp0[13] & ~0x7c) | 1 << (interrupt + 7);
+    }
+    else
+    {
+        state->traps++;
+        if (state->fault == MMU_MISS && !(cp0[12] & MMU_EXL))
+            vector = MMU_REFILL;
+        cp0[13] = (cp0[13] & ~0x7c) | (exception & 0x1f) << 2;
+        if (state->faultreg != 0)
+            state->regs[state->faultreg - 1] = state->faultval;
+    }
+
+    if (!(cp0[12] & MMU_EXL))
+        cp0[14] = state->fault != 0 ? state->pc : state->pc + 4;
+    cp0[12] |= MMU_EXL;
+    state->exception = 0;
+    state->fault = 0;
+    state->faultreg = 0;
+    cp0_mask(state);
+
+    state->pc = vector - 4;
+}
+
+/* takes the lowest pending interrupt line once the guest unmasked it */
+void mmu_pending(MIPS_state *state)
+{
+    int i;
+
+    if (state->interrupts[0] == 0xff || state->exception != 0)
+        return;
+    for (i = 0; i < 8; i++)
+        if (state->pending & 1 << i)
+        {
+            state->pending &= ~(1 << i);
+            mmu_deliver(state, i + 1, 0);
+            return;
+        }
+}
+
+void interrupt_handler(MIPS_state *state, int interrupt, int exception)
+{
+    if (exception != 0)
+        PROFILE_COUNT(state->exceptions[exception & 31]);
+    else
+        PROFILE_COUNT(state->raised[(interrupt - 1) & 7]);
+    if (exception != 0)
+        stop_request(state, STOP_FAULT);
+
+    if (state->mmu)
+    {
+        if (exception != 0 || (interrupt >= 1 && interrupt <= 8))
+            mmu_deliver(state, interrupt, exception);
+        return;
+    }
+
+    if (state->interrupts[interrupt - 1] == 0xff)
+        return;
+
+    state->interrupts[interrupt - 1] = 1;
+
+    if ((interrupt > 8 || interrupt < 1) && exception == 0)
+        return;
+    if (exception != 0)
+        state->traps++;
+    else
+        state->irqs++;
+    /* timer parsing */
+    if (interrupt == 8)
+        state->cp0regs[12] |= 1 << (interrupt + 7);  
+
+    if (exception == 0)
+        state->cp0regs[13] |= 1 << (interrupt + 7);
+    else
+    {
+        /* clear previous exception */
+        state->cp0regs[13] &= 31 << 1;
+        state->cp0regs[13] |= (exception & 0x5) << 1;
+    }
 
-typedef struct _R_FMT
-{
-    unsigned char opcode;
-    unsigned char rs;
-    unsigned char rt;
-    unsigned char rd;
-    unsigned char shift;
-    unsigned char funct;
-} R_FMT;
+    state->cp0regs[14] = state->pc;
+    state->pc = 0x10000180;
+}
 
-typedef struct _I_FMT
-{
-    unsigned char opcode;
-    unsigned char rs;
-    unsigned char rt;
-    unsigned short immediate;
-} I_FMT;
+/* @note Buffers of syscalls are moved in spans: mem_span() resolves a
+    guest range to host memory once per page, or once for a run of pages
+    that are contiguous on the host (a restored snapshot), and the span
+    goes to the host in one call without a copy. Only I/O space and pages
+    that were never written take the bytewise path. A range that wraps
+    around the address space fails as a whole before anything moves.
+    Every page a read lands in goes through mem_barrier(), it is dirty
+    afterwards and loses its cached code. With the MMU
+    syscalls go through mem_vspan() one guest page at a time, mem_span()
+    itself always takes physical addresses.
+*/
 
-typedef struct _J_FMT
+/* host bytes from address on, at most len and the bytes left in its page
+   plus following pages that are contiguous on the host. The length goes
+   to *span. write allocates the pages. Returns NULL for I/O space and,
+   unless write, for pages never written, those are one page at most */
+unsigned char *mem_span(MIPS_mem *mem, unsigned int address, unsigned int len, int write, unsigned int *span)
 {
-    unsigned char opcode;
-    unsigned int address;
-} J_FMT;
+    unsigned int offset = address & (MEM_PAGE_SIZE - 1);
+    unsigned char *p = write ? mem_touch(mem, address) : mem_page(mem, address);
 
-typedef struct _MIPS_state
+    *span = MEM_PAGE_SIZE - offset < len ? MEM_PAGE_SIZE - offset : len;
+    if (p == NULL)
+        return NULL;
+    p += offset;
+    if (write)
+        mem_barrier(mem, address);
+
+    while (*span < len)
+    {
+        unsigned int next = address + *span; /* page aligned */
+
+        if ((write ? mem_touch(mem, next) : mem_page(mem, next)) != p + *span)
+            break;
+        if (write)
+            mem_barrier(mem, next);
+        *span += len - *span < MEM_PAGE_SIZE ? len - *span : MEM_PAGE_SIZE;
+    }
+
+    return p;
+}
+
+/* mem_span() for a guest address that goes through the MMU when it is on,
+   the span then ends with the page. NULL for a page that does not
+   translate, the bytewise path raises the fault */
+unsigned char *mem_vspan(MIPS_mem *mem, unsigned int address, unsigned int len, int write, unsigned int *span)
 {
-    unsigned int pc;
-    unsigned int hi, lo;
-    unsigned int regs[32];
-    unsigned int cp0regs[32];
-    unsigned char interrupts[8];
-    int exception;
-    char mode;
-} MIPS_state;
+    unsigned int rest = MEM_PAGE_SIZE - (address & (MEM_PAGE_SIZE - 1));
+    unsigned int pa;
 
-R_FMT decodeR(unsigned int instruction)
+    if (mem->mmu == NULL)
+        return mem_span(mem, address, len, write, span);
+
+    *span = len < rest ? len : rest;
+    if (mmu_lookup(mem->mmu, address, write, &pa) != 0)
+        return NULL;
+    return mem_span(mem, pa, *span, write, span);
+}
+
+/* len bytes of guest memory at address to fd, returns the count or -1 */
+int syscall_write(MIPS_mem *mem, int fd, unsigned int address, unsigned int len)
 {
-    R_FMT fmt;
-    fmt.opcode = (instruction >> 26) & 0x3f;
-    fmt.rs = (instruction >> 21) & 0x1f;
-    fmt.rt = (instruction >> 16) & 0x1f;
-    fmt.rd = (instruction >> 11) & 0x1f;
-    fmt.shift = (instruction >> 6) & 0x1f;
-    fmt.funct = instruction & 0x3f;
-    return fmt;
+    MIPS_io *io = &mem->io;
+    unsigned char buf[256];
+    unsigned int done = 0;
+
+    if (address + len < address || (fd < 3 ? fd == 0 || io->write == NULL : io->file == NULL))
+        return -1;
+
+    while (done < len)
+    {
+        unsigned int span, i;
+        unsigned char *p = mem_vspan(mem, address + done, len - done, 0, &span);
+        int n;
+
+        if (p == NULL)
+        {
+            /* I/O space or a page of zeros */
+            if (span > sizeof(buf))
+                span = sizeof(buf);
+            for (i = 0; i < span; i++)
+                buf[i] = loadmembu(mem, address + done + i);
+            if (mem->mmu != NULL && mem->mmu->fault != 0)
+                return done > 0 ? (int)done : -1;
+            p = buf;
+        }
+
+        n = fd < 3 ? io->write(io->user, (const char *)p, span) : io->file(io->user, IO_WRITE, fd, (char *)p, span);
+        if (n < 0)
+            return done > 0 ? (int)done : -1;
+        done += n;
+        if ((unsigned int)n < span)
+            break;
+    }
+
+    return done;
 }
 
-I_FMT decodeI(unsigned int instruction)
+/* up to len bytes from fd to guest memory at address, stops after a short
+   read. Returns the count, 0 at the end of the file or -1 */
+int syscall_read(MIPS_mem *mem, int fd, unsigned int address, unsigned int len)
 {
-    I_FMT fmt;
-    fmt.opcode = (instruction >> 26) & 0x3f;
-    fmt.rs = (instruction >> 21) & 0x1f;
-    fmt.rt = (instruction >> 16) & 0x1f;
-    fmt.immediate = instruction & 0xffff;
-    return fmt;
+    MIPS_io *io = &mem->io;
+    unsigned char buf[256];
+    unsigned int done = 0;
+
+    if (address + len < address || (fd < 3 ? fd != 0 || io->read == NULL : io->file == NULL))
+        return -1;
+
+    while (done < len)
+    {
+        unsigned int span, i;
+        unsigned char *p = mem_vspan(mem, address + done, len - done, 1, &span);
+        unsigned char *to = p;
+        int n;
+
+        if (p == NULL)
+        {
+            /* I/O space */
+            if (span > sizeof(buf))
+                span = sizeof(buf);
+            to = buf;
+        }
+
+        n = fd == 0 ? io->read(io->user, (char *)to, span) : io->file(io->user, IO_READ, fd, (char *)to, span);
+        if (n <= 0)
+            return done > 0 ? (int)done : n;
+        if (p == NULL)
+            for (i = 0; i < (unsigned int)n; i++)
+                storememb(mem, address + done + i, buf[i]);
+        done += n;
+        if ((unsigned int)n < span)
+            break;
+    }
+
+    return done;
 }
 
-J_FMT decodeJ(unsigned int instruction)
+/* console output of a NUL terminated guest string */
+void syscall_print(MIPS_mem *mem, unsigned int address)
 {
-    J_FMT fmt;
-    fmt.opcode = (instruction >> 26) & 0x3f;
-    fmt.address = instruction & 0x3ffffff;
-    return fmt;
+    MIPS_io *io = &mem->io;
+
+    while (io->write != NULL)
+    {
+        unsigned int span, i;
+        unsigned char *p = mem_vspan(mem, address, MEM_PAGE_SIZE, 0, &span);
+        unsigned char *end;
+
+        if (p == NULL)
+        {
+            char c;
+
+            /* a page never written ends the string right away */
+            if (mem_uncached(mem, address) == 0)
+                return;
+            for (i = 0; i < span; i++)
+            {
+                if ((c = loadmembu(mem, address + i)) == '\0')
+                    return;
+                io->write(io->user, &c, 1);
+            }
+        }
+        else
+        {
+            end = (unsigned char *)memchr(p, 0, span);
+            io->write(io->user, (const char *)p, end != NULL ? (unsigned int)(end - p) : span);
+            if (end != NULL)
+                return;
+        }
+
+        address += span;
+        if (address < span) /* wrapped */
+            return;
+    }
 }
 
-unsigned char loadmembu(unsigned char *mem, unsigned int address)
+/* returns 5 if the guest exits */
+int syscall_handler(MIPS_state *state, MIPS_mem *mem)
 {
-    unsigned char retval = 0;
-    if (address > 0x3e000000)
+    MIPS_io *io = &mem->io;
+    char buf[256];
+    unsigned int i = 0;
+    int n;
+
+    state->syscalls++;
+    switch (state->regs[2])
     {
-        LDMEM(retval, sizeof(unsigned char), mem, address);
-        return retval;
+        case 1: /* print int */
+            if (io->write != NULL)
+            {
+                sprintf(buf, "%u", state->regs[4]);
+                io->write(io->user, buf, strlen(buf));
+            }
+        break;
+        case 4: /* print string */
+            syscall_print(mem, state->regs[4]);
+        break;
+        case 5: /* read int */
+            if (io->read != NULL)
+            {
+                unsigned int value = 0;
+                int digits = 0;
+                char c;
+
+                while (io->read(io->user, &c, 1) == 1)
+                {
+                    if (c >= '0' && c <= '9')
+                    {
+                        value = value * 10 + (c - '0');
+                        digits++;
+                    }
+                    else if (digits > 0 || (c != ' ' && c != '\t' && c != '\n' && c != '\r'))
+                        break;
+                }
+                if (digits > 0)
+                    state->regs[2] = value;
+            }
+        break;
+        case 8: /* read string */
+            while (i < state->regs[5] && (n = syscall_read(mem, 0, state->regs[4] + i, state->regs[5] - i)) > 0)
+                i += n;
+        break;
+        case 10: /* exit */
+        case 17: /* exit with the code in a0 */
+            state->stop = STOP_HALT;
+            return 5;
+        case 11: /* single character print */
+            if (io->write != NULL)
+            {
+                buf[0] = (char)state->regs[4];
+                io->write(io->user, buf, 1);
+            }
+        break;
+        case 13: /* open, a0 path, a1 flags, a2 mode */
+            for (i = 0; i < sizeof(buf) && (buf[i] = loadmembu(mem, state->regs[4] + i)) != '\0'; i++)
+                ;
+            if (i == sizeof(buf) || io->file == NULL)
+                state->regs[2] = (unsigned int)-1;
+            else
+                state->regs[2] = io->file(io->user, IO_OPEN, state->regs[5], buf, state->regs[6]);
+        break;
+        case 14: /* read, a0 fd, a1 buffer, a2 length */
+            state->regs[2] = syscall_read(mem, state->regs[4], state->regs[5], state->regs[6]);
+        break;
+        case 15: /* write, a0 fd, a1 buffer, a2 length */
+            state->regs[2] = syscall_write(mem, state->regs[4], state->regs[5], state->regs[6]);
+        break;
+        case 16: /* close, a0 fd */
+            if ((int)state->regs[4] < 3)
+                state->regs[2] = 0;
+            else
+                state->regs[2] = io->file != NULL ? io->file(io->user, IO_CLOSE, state->regs[4], NULL, 0) : -1;
+        break;
     }
-    else
-        return mem[address];
+
+    return 0;
+}
+
+/* @note Timed work sits in a queue sorted by clock, the number of retired
+    instructions. cp0_update() only looks at it when the head is due, so
+    nothing is rescanned per instruction. Count is not stored, it advances
+    by one per retired instruction and is derived from clock when read. The
+    Count == Compare timer is an event that is rescheduled when Count or
+    Compare are written, the interrupt mask and mode only change with Status.
+    Whoever writes cp0regs directly has to call cp0_sync() afterwards.
+*/
+
+/* drops every pending event with this callback and user */
+void event_cancel(MIPS_state *state, void (*fire)(MIPS_state *state, void *user), void *user)
+{
+    int i, j;
+
+    for (i = 0, j = 0; i < state->nevents; i++)
+        if (state->events[i].fire != fire || state->events[i].user != user)
+            state->events[j++] = state->events[i];
+
+    state->nevents = j;
+    state->next = j > 0 ? state->events[0].when : ~0UL;
 }
 
-char loadmemb(unsigned char *mem, unsigned int address)
+/* fire(state, user) runs after delay more instructions, in place of an
+   event it had pending. Every source keeps one event at most, so the queue
+   only fills up through a bug, that aborts rather than lose an interrupt */
+void event_schedule(MIPS_state *state, unsigned long delay, void (*fire)(MIPS_state *state, void *user), void *user)
 {
-    char retval = 0;
-    if (address > 0x3e000000)
+    unsigned long when = state->clock + (delay ? delay : 1);
+    int i;
+
+    event_cancel(state, fire, user);
+    if (state->nevents == MIPS_EVENTS)
     {
-        LDMEM(retval, sizeof(char), mem, address);
-        return retval;
+        fprintf(stderr, "event queue full\n");
+        abort();
     }
-    else
-        return mem[address];
+
+    for (i = state->nevents; i > 0 && state->events[i - 1].when > when; i--)
+        state->events[i] = state->events[i - 1];
+
+    state->events[i].when = when;
+    state->events[i].fire = fire;
+    state->events[i].user = user;
+    state->nevents++;
+    state->next = state->events[0].when;
+}
+
+/* @note A run ends when the guest halts or hits break, execute() and the
+    handlers then return 5 with state->stop saying which. Devices and
+    exceptions may ask for a stop as well through stop_request(), it takes
+    effect once the current instruction is done: stop_event() makes its
+    epilogue take the slow path of every engine, which returns 5 when
+    state->stop is set (the block engines at the end of the block). Only
+    the reasons in state->yield are taken, machine_run() has none of them
+    and always runs to its budget.
+*/
+
+void stop_event(MIPS_state *state, void *user)
+{
+}
+
+void stop_request(MIPS_state *state, int why)
+{
+    if (!(state->yield & 1 << why) || state->stop != 0)
+        return;
+    state->stop = why;
+    event_schedule(state, 1, stop_event, NULL);
 }
 
-unsigned short loadmemh(unsigned char *mem, unsigned int address)
+/* runs the events that are due */
+void event_run(MIPS_state *state)
 {
-    short retval = 0;
-    if (address > 0x3e000000)
+    while (state->nevents > 0 && state->events[0].when <= state->clock)
     {
-        LDMEM(retval, sizeof(short), mem, address);
-        return retval;
+        MIPS_event e = state->events[0];
+        int i;
+
+        for (i = 1; i < state->nevents; i++)
+            state->events[i - 1] = state->events[i];
+        state->nevents--;
+        state->next = state->nevents > 0 ? state->events[0].when : ~0UL;
+
+        e.fire(state, e.user);
     }
-    else
-        return (mem[address + 1] & 0xff) |
-            ((mem[address]) & 0xff) << 8;
 }
 
-unsigned short loadmemhu(unsigned char *mem, unsigned int address)
+unsigned int cp0_count(MIPS_state *state)
+{
+    return state->countbase + (unsigned int)state->clock;
+}
+
+void cp0_timer(MIPS_state *state, void *user);
+
+/* the timer fires when Count reaches Compare, a full wrap if it just did */
+void cp0_schedule(MIPS_state *state)
+{
+    unsigned int delta = state->cp0regs[11] - cp0_count(state);
+
+    event_cancel(state, cp0_timer, NULL);
+    event_schedule(state, delta != 0 ? delta : 0xffffffffUL + 1, cp0_timer, NULL);
+}
+
+void cp0_timer(MIPS_state *state, void *user)
+{
+    /* timer count == timer compare, interrupt */
+    interrupt_handler(state, 8, 0);
+    cp0_schedule(state);
+}
+
+/* recomputes everything derived from CP0 registers */
+void cp0_sync(MIPS_state *state)
 {
-    unsigned short retval = 0;
-    if (address > 0x3e000000)
+    /* Coprocessor 0 parsing */
+    cp0_mask(state);
+
+    state->mode = (state->cp0regs[12] & 0x05) >> 4;
+
+    state->countbase = state->cp0regs[9] - (unsigned int)state->clock;
+    cp0_schedule(state);
+}
+
+/* @note Performance counters count what the guest did since reset:
+    retired instructions, taken branches and jumps, loads, stores, loads
+    and stores that went to a device, and exceptions and interrupts
+    delivered. Every engine counts them the same way. A pending exception
+    is delivered again after every instruction until eret and counts each
+    time, with the MMU it is delivered once. The guest reads the low 32
+    bits with mfc0 from CP0 registers PERF_CP0 to PERF_CP0 +
+    PERF_COUNTERS - 1, mtc0 leaves them alone. Like Count they are copied
+    into cp0regs when read and when machine_run() returns, so snapshots
+    and lockstep compares carry them.
+*/
+
+#define PERF_RETIRED 0
+#define PERF_BRANCHES 1
+#define PERF_LOADS 2
+#define PERF_STORES 3
+#define PERF_MMIO 4
+#define PERF_EXCEPTIONS 5
+#define PERF_INTERRUPTS 6
+#define PERF_COUNTERS 7
+#define PERF_CP0 16 /* CP0 register of PERF_RETIRED */
+
+unsigned long perf_counter(MIPS_state *state, MIPS_mem *mem, int counter)
+{
+    switch (counter)
     {
-        LDMEM(retval, sizeof(unsigned short), mem, address);
-        return retval;
+        case PERF_RETIRED:
+            return state->clock;
+        case PERF_BRANCHES:
+            return state->branches;
+        case PERF_LOADS:
+            return state->loads;
+        case PERF_STORES:
+            return state->stores;
+        case PERF_MMIO:
+            return mem->mmio;
+        case PERF_EXCEPTIONS:
+            return state->traps;
+        case PERF_INTERRUPTS:
+            return state->irqs;
     }
-    else
-        return (mem[address + 1] & 0xff) |
-            ((mem[address]) & 0xff) << 8;
+    return 0;
+}
+
+/* copies the counters into their CP0 registers */
+void perf_sync(MIPS_state *state, MIPS_mem *mem)
+{
+    int i;
+
+    for (i = 0; i < PERF_COUNTERS; i++)
+        state->cp0regs[PERF_CP0 + i] = (unsigned int)perf_counter(state, mem, i);
+}
+
+/* TLB entry tlbwr replaces, above Wired and derived from clock so runs repeat */
+unsigned int cp0_random(MIPS_state *state)
+{
+    unsigned int wired = state->cp0regs[6] % MMU_TLB;
+
+    state->timereads++;
+    return wired + (unsigned int)(state->clock % (MMU_TLB - wired));
 }
 
-int loadmemw(unsigned char *mem, unsigned int address)
+/* drops what entry e maps from the soft TLB and the code caches */
+void mmu_unmap(MIPS_mem *mem, const MIPS_tlb *e)
 {
-    int retval = 0;
-    if (address > 0x3e000000)
+    unsigned int size = (e->mask | 0x1fff) + 1;
+    unsigned int va = e->hi & ~(size - 1);
+    unsigned int i;
+
+    if (mem->mmu == NULL || !((e->lo0 | e->lo1) & 0x02) || va - MMU_KSEG0 < MMU_KSEG2 - MMU_KSEG0)
+        return;
+    if (size / MEM_PAGE_SIZE > MEM_STLB)
+        mem_flushtlb(mem);
+    for (i = 0; i < size; i += MEM_PAGE_SIZE)
     {
-        LDMEM(retval, sizeof(int), mem, address);
-        return retval;
+        unsigned int lo = i < size / 2 ? e->lo0 : e->lo1;
+        unsigned int pa = ((lo >> 6) << MEM_PAGE_SHIFT & ~(size / 2 - 1)) | (i & (size / 2 - 1));
+
+        mem_flushpage(mem, va + i);
+        /* only this mapping goes, the page keeps its bit for the others */
+        if ((lo & 0x02) && MEM_BIT(mem->code, pa >> MEM_PAGE_SHIFT) && mem->codewrite != NULL)
+            mem->codewrite(mem->cache, va + i);
     }
-    else
-        return (mem[address + 3] & 0xff) |
-                (mem[address + 2] & 0xff) << 8 |
-                (mem[address + 1] & 0xff) << 16 |
-                (mem[address] & 0xff) << 24;
 }
 
-void storememb(unsigned char *mem, unsigned int address, unsigned char value)
+/* EntryHi got another ASID, every entry that is not global maps differently now */
+void mmu_asid(MIPS_state *state, MIPS_mem *mem)
 {
-    if (address > 0x3e000000)
-        STMEM(sizeof(char), mem, address, value);
-    mem[address] = value;
+    int i;
+
+    if (mem->mmu == NULL)
+        return;
+    mem_flushtlb(mem);
+    for (i = 0; i < MMU_TLB; i++)
+        if (!(state->tlb[i].lo0 & state->tlb[i].lo1 & 0x01))
+            mmu_unmap(mem, &state->tlb[i]);
 }
 
-void storememh(unsigned char *mem, unsigned int address, unsigned int value)
+/* tlbwi, tlbwr */
+void mmu_write(MIPS_state *state, MIPS_mem *mem, unsigned int index)
 {
-    if (address > 0x3e000000)
-        STMEM(sizeof(short), mem, address, value);
-    mem[address + 1] = value & 0xff;
-    mem[address] = (value << 8) & 0xff;
+    MIPS_tlb *e = &state->tlb[index];
+
+    mmu_unmap(mem, e);
+    e->mask = state->cp0regs[5] & 0x1fffe000;
+    e->hi = state->cp0regs[10] & ~(e->mask | 0x1f00);
+    e->lo0 = state->cp0regs[2] & 0x3fffffff;
+    e->lo1 = state->cp0regs[3] & 0x3fffffff;
+    mmu_unmap(mem, e);
 }
 
+/* tlbp, Index gets the entry matching EntryHi or bit 31 */
+void mmu_probe(MIPS_state *state)
+{
+    unsigned int hi = state->cp0regs[10];
+    int i;
+
+    state->cp0regs[0] = 0x80000000;
+    for (i = 0; i < MMU_TLB; i++)
+    {
+        const MIPS_tlb *e = &state->tlb[i];
+
+        if (((hi ^ e->hi) & ~(e->mask | 0x1fff)) == 0 && ((e->lo0 & e->lo1 & 0x01) || ((hi ^ e->hi) & 0xff) == 0))
+        {
+            state->cp0regs[0] = i;
+            return;
+        }
+    }
+}
 
-void storememw(unsigned char *mem, unsigned int address, unsigned int value)
+/* mfc0 */
+unsigned int cp0_load(MIPS_state *state, MIPS_mem *mem, unsigned int reg)
 {
-    if (address > 0x3e000000)
-        STMEM(sizeof(int), mem, address, value);
-    mem[address + 3] = value & 0xff;
-    mem[address + 2] = (value << 8) & 0xff;
-    mem[address + 1] = (value << 16) & 0xff;
-    mem[address] = (value << 8) & 0xff;
+    if (reg == 1 && state->mmu)
+        state->cp0regs[1] = cp0_random(state);
+    else if (reg == 9)
+    {
+        state->timereads++;
+        state->cp0regs[9] = cp0_count(state);
+    }
+    else if (reg >= PERF_CP0 && reg < PERF_CP0 + PERF_COUNTERS)
+    {
+        state->timereads++;
+        state->cp0regs[reg] = (unsigned int)perf_counter(state, mem, reg - PERF_CP0);
+    }
+    return state->cp0regs[reg];
 }
 
-void interrupt_handler(MIPS_state *state, int interrupt, int exception)
+/* mtc0 */
+void cp0_store(MIPS_state *state, MIPS_mem *mem, unsigned int reg, unsigned int value)
 {
-    if (state->interrupts[interrupt - 1] == 0xff)
+    unsigned int old = state->cp0regs[reg];
+
+    if (reg >= PERF_CP0 && reg < PERF_CP0 + PERF_COUNTERS)
         return;
+    state->cp0regs[reg] = value;
 
-    state->interrupts[interrupt - 1] = 1;
+    if (reg == 10 && ((old ^ value) & 0xff) != 0)
+        mmu_asid(state, mem);
+    if (reg == 11 || reg == 12)
+        state->cp0regs[9] = cp0_count(state);
+    if (reg == 9 || reg == 11 || reg == 12)
+        cp0_sync(state);
+    if (reg == 12 && state->mmu)
+        mmu_pending(state);
+}
 
-    if ((interrupt > 8 || interrupt < 1) && exception == 0)
+void cp0_eret(MIPS_state *state)
+{
+    if (state->mmu)
+    {
+        state->pc = state->cp0regs[14] - 4;
+        state->cp0regs[12] &= ~MMU_EXL;
+        state->cp0regs[13] &= ~0xff00;
+        cp0_mask(state);
+        mmu_pending(state);
         return;
-    /* timer parsing */
-    if (interrupt == 8)
-        state->cp0regs[12] |= 1 << (interrupt + 7);  
+    }
+    state->exception = 0;
+    state->pc = state->cp0regs[14];
+    state->cp0regs[14] = 0;
+}
 
-    if (exception == 0)
-        state->cp0regs[13] |= 1 << (interrupt + 7);
-    else
+/* opcode 0x10 with the MMU, decoded by the rs field: mfc0, mtc0 and with
+   the CO bit tlbr, tlbwi, tlbwr, tlbp and eret */
+void cp0_mmu(MIPS_state *state, MIPS_mem *mem, unsigned int instruction)
+{
+    unsigned int rs = instruction >> 21 & 0x1f;
+    unsigned int rt = instruction >> 16 & 0x1f;
+    unsigned int rd = instruction >> 11 & 0x1f;
+    unsigned int *cp0 = state->cp0regs;
+    MIPS_tlb *e;
+
+    if (rs == 0)
+        state->regs[rt] = cp0_load(state, mem, rd);
+    else if (rs == 4)
+        cp0_store(state, mem, rd, state->regs[rt]);
+    else if (rs & 0x10)
+        switch (instruction & 0x3f)
+        {
+            case 0x01: /* tlbr */
+                e = &state->tlb[cp0[0] % MMU_TLB];
+                cp0[2] = e->lo0;
+                cp0[3] = e->lo1;
+                cp0[5] = e->mask;
+                cp0_store(state, mem, 10, e->hi);
+            break;
+            case 0x02: /* tlbwi */
+                mmu_write(state, mem, cp0[0] % MMU_TLB);
+            break;
+            case 0x06: /* tlbwr */
+                mmu_write(state, mem, cp0_random(state));
+            break;
+            case 0x08: /* tlbp */
+                mmu_probe(state);
+            break;
+            case 0x18: /* eret */
+                cp0_eret(state);
+            break;
+        }
+}
+
+/* the epilogue after the clock has counted the instruction */
+void cp0_finish(MIPS_state *state)
+{
+    /* Check timer and device events */
+    if (state->clock >= state->next)
+        event_run(state);
+
+    /* Check for exceptions */
+    if (state->exception != 0)
     {
-        /* clear previous exception */
-        state->cp0regs[13] &= 31 << 1;
-        state->cp0regs[13] |= (exception & 0x5) << 1;
+        /* exception occured */
+        interrupt_handler(state, 0, state->exception);
     }
 
-    state->cp0regs[14] = state->pc;
-    state->pc = 0x10000180;
+    state->regs[0] = 0;
+
+    state->pc += 4;
+}
+
+/* epilogue of every instruction */
+void cp0_update(MIPS_state *state)
+{
+    state->clock++;
+    cp0_finish(state);
 }
 
-int execute(MIPS_state *state, unsigned int instruction, unsigned char *mem, unsigned int count)
+int execute(MIPS_state *state, unsigned int instruction, MIPS_mem *mem)
 {
     J_FMT jfmt = decodeJ(instruction);
     I_FMT ifmt = decodeI(instruction);
     R_FMT fmt = decodeR(instruction);
 
-    int ret = 0;
     long long temp = 0;
 
     switch (instruction >> 26 & 0x3f)
@@ -248,11 +1784,16 @@ int execute(MIPS_state *state, unsigned int instruction, unsigned char *mem, uns
                     state->regs[fmt.rd] = state->regs[fmt.rt] >> (state->regs[fmt.rs] & 0x1f);
                 break;
                 case 0x08: /* jr (R) */
+                    state->branches++;
                     state->pc = state->regs[fmt.rs] - 4;
                         if (fmt.rs == 31)
+                        {
+                            state->stop = STOP_HALT;
                             return 5;
+                        }
                 break;
                 case 0x09: /* jalr (R) */
+                    state->branches++;
                     state->pc = state->regs[fmt.rs] - 4;
                     state->regs[31] = state->pc + 4;
                 break;
@@ -265,29 +1806,13 @@ int execute(MIPS_state *state, unsigned int instruction, unsigned char *mem, uns
                         state->regs[fmt.rd] = state->regs[fmt.rs];
                 break;
                 case 0x0c: /* syscall (R) */
-                    switch (state->regs[2])
-                    {
-                        case 1: /* print int */
-                            IPRINT(state->regs[4]);
-                        break;
-                        case 4: /* print string */
-                            SPRINT(state->regs[4]);
-                        break;
-                        case 5: /* read int */
-                            IREAD(state->regs[2]);
-                        break;
-                        case 8: /* read string */
-                            SREAD(state->regs[4], state->regs[5]);
-                        break;
-                        case 11: /* single character print */
-                            CPRINT(state->regs[4]);
-                        break;
-                    }
+                    if (syscall_handler(state, mem) == 5)
+                        return 5;
                     state->pc = 0xbfc0380;
                 break;
                 case 0x0d: /* break (R) */
-                    ret = 5;
-                break;
+                    state->stop = STOP_BREAK;
+                    return 5;
                 case 0x10: /* mfhi (R) */
                     state->regs[fmt.rd] = state->hi;
                 break;
@@ -387,36 +1912,56 @@ int execute(MIPS_state *state, unsigned int instruction, unsigned char *mem, uns
             if (state->regs[ifmt.rt] == 0) /* bltz */
             {
                 if (state->regs[ifmt.rs] < 0)
+                {
+                    state->branches++;
                     state->pc += (ifmt.immediate << 2) - 4;
+                }
             }
             else if (state->regs[ifmt.rt] == 1) /* bgez */
             {
                 if (state->regs[ifmt.rs] >= 0)
+                {
+                    state->branches++;
                     state->pc += (ifmt.immediate << 2) - 4;
+                }
             }
         break;
         case 0x02: /* j (J) */
+            state->branches++;
             state->pc = (jfmt.address << 2) | ((state->pc & 0xf) << 28);
         break;
         case 0x03: /* jal (J) */
+            state->branches++;
             state->pc = (jfmt.address << 2) | ((state->pc & 0xf) << 28);
             state->regs[31] = state->pc + 4;
         break;
         case 0x04: /* beq (I) */
             if (state->regs[ifmt.rs] == state->regs[ifmt.rt])
+            {
+                state->branches++;
                 state->pc += (ifmt.immediate << 2) - 4;
+            }
         break;
         case 0x05: /* bne (I) */
             if(state->regs[ifmt.rs] != state->regs[ifmt.rt])
+            {
+                state->branches++;
                 state->pc += (ifmt.immediate << 2) - 4;
+            }
         break;
         case 0x06: /* blez (I) */
             if (state->regs[ifmt.rs] <= 0)
+            {
+                state->branches++;
                 state->pc += (ifmt.immediate << 2) - 4;
+            }
         break;
         case 0x07: /* bgtz (I) */
             if (state->regs[ifmt.rs] > 0)
+            {
+                state->branches++;
                 state->pc += (ifmt.immediate << 2) - 4;
+            }
         break;
         case 0x08: /* addi (I) */
             state->regs[ifmt.rt] = state->regs[ifmt.rs] + ifmt.immediate;
@@ -444,85 +1989,61 @@ int execute(MIPS_state *state, unsigned int instruction, unsigned char *mem, uns
             state->regs[ifmt.rt] &= 0xffff;
         break;
         case 0x10: /* mfc0/mtc0 (R) */
-            if (state->regs[fmt.rs] == 0) /* mfc0 */
-                state->regs[fmt.rt] = state->cp0regs[fmt.rd];
+            if (state->mmu)
+                cp0_mmu(state, mem, instruction);
+            else if (state->regs[fmt.rs] == 0) /* mfc0 */
+                state->regs[fmt.rt] = cp0_load(state, mem, fmt.rd);
             else if (state->regs[fmt.rs] == 4 &&  /* mtc0 (only kernel can write to certain cp0 registers) */
             (((state->regs[fmt.rd] == 0 || state->regs[fmt.rd] == 1 || state->regs[fmt.rd] == 2 || state->regs[fmt.rd] == 4 || state->regs[fmt.rd] == 8 || 
             state->regs[fmt.rd] == 10 || state->regs[fmt.rd] == 12 || state->regs[fmt.rd] == 13 || state->regs[fmt.rd] == 14 || state->regs[fmt.rd] == 15) && state->mode == 1) || state->mode == 0))
-                state->cp0regs[fmt.rd] = state->regs[fmt.rt];
+                cp0_store(state, mem, fmt.rd, state->regs[fmt.rt]);
         break;
         case 0x18: /* eret (I) */
-            state->exception = 0;
-            state->pc = state->cp0regs[14];
-            state->cp0regs[14] = 0;
+            cp0_eret(state);
         break;
         case 0x20: /* lb (I) */
+            state->loads++;
             state->regs[ifmt.rt] = loadmemb(mem, state->regs[ifmt.rs] + ifmt.immediate);
         break;
         case 0x21: /* lh (I) */
+            state->loads++;
             state->regs[ifmt.rt] = loadmemh(mem, state->regs[ifmt.rs] + ifmt.immediate);
         break;
         case 0x22: /* lwl (I) */
+            state->loads++;
             state->regs[ifmt.rt] = (loadmemw(mem, (state->regs[ifmt.rs] + ifmt.immediate & 0xfffffffc)) << (8 * (3 - (state->regs[ifmt.rs] + ifmt.immediate & 0xfffffffc) & 0x03)));
         break;
         case 0x23: /* lw (I) */
+            state->loads++;
             state->regs[ifmt.rt] = loadmemw(mem, state->regs[ifmt.rs] + ifmt.immediate);
         break;
         case 0x24: /* lbu (I) */
+            state->loads++;
             state->regs[ifmt.rt] = loadmembu(mem, state->regs[ifmt.rs] + ifmt.immediate);
         break;
         case 0x25: /* lhu (I) */
+            state->loads++;
             state->regs[ifmt.rt] = loadmemhu(mem, state->regs[ifmt.rs] + ifmt.immediate);
         break;
         case 0x26: /* lwr (I) */
+            state->loads++;
             state->regs[ifmt.rt] = (loadmemw(mem, (state->regs[ifmt.rs] + ifmt.immediate & 0xfffffffc)) >> (8 * ((state->regs[ifmt.rs] + ifmt.immediate & 0xfffffffc) & 0x03)));
         break;
         case 0x28: /* sb (I) */
+            state->stores++;
             storememb(mem, state->regs[ifmt.rs] + ifmt.immediate, state->regs[ifmt.rt]);
         break;
         case 0x29: /* sh (I) */
+            state->stores++;
             storememh(mem, state->regs[ifmt.rs] + ifmt.immediate, state->regs[ifmt.rt]);
         break;
         case 0x2b: /* sw (I) */
+            state->stores++;
             storememw(mem, state->regs[ifmt.rs] + ifmt.immediate, state->regs[ifmt.rt]);
         break;
     }
 
-    /* Coprocessor 0 parsing */
-    if ((state->cp0regs[12] & 0x01) == 0)
-    {
-        int interrupts = 0;
-        for (interrupts = 0; interrupts < 8; interrupts++)
-            state->interrupts[interrupts] = 0xff;
-    }
-    else
-    {
-        int interrupts = 0;
-        for (interrupts = 0; interrupts < 8; interrupts++)
-            state->interrupts[interrupts] = 0x00;
-    }
-
-    state->mode = (state->cp0regs[12] & 0x05) >> 4;
-
-    state->cp0regs[9] = count;
-
-    /* Check timer */
-    if (state->cp0regs[9] == state->cp0regs[11])
-    {
-        /* if timer count == timer compare then interrupt */
-        interrupt_handler(state, 8, 0);
-    }
-
-    /* Check for exceptions */
-    if (state->exception != 0)
-    {
-        /* exception occured */
-        interrupt_handler(state, 0, state->exception);
-    }
-
-    state->regs[0] = 0;
-
-    state->pc += 4;
+    cp0_update(state);
 
     return instruction;
 }
@@ -0,0 +1,441 @@
+/* MIPS Emulator - batch runner */
+/* Copyright 2024 Daniil Dunaef */
+
+#ifndef MIPS_BATCH
+#define MIPS_BATCH
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h> /* POSIX only! */
+#include <sched.h>
+#include "mips.h"
+#include "mips_machine.h"
+#include "mips_elf.h"
+#include "mips_gang.h"
+
+/* @note Runs many guests on a pool of worker threads. Every worker owns a
+    queue of jobs and runs them round robin, slice instructions at a time:
+    it takes the job at the head and puts it back at the tail if it has
+    neither stopped nor used up its budget. A worker with an empty queue
+    steals the tail of another worker's queue, so a queue is only touched
+    by two threads when one of them has run dry.
+    A machine is created by the first worker that runs its job and is
+    destroyed as soon as the job is done, a batch of block or JIT guests
+    would hold every cache to the end otherwise. finish() flushes what the
+    devices still buffer before that, the caller reads job->report.
+    Guest console output goes to a per-job buffer, guests read EOF.
+    With ENGINE_GANG a worker takes up to GANG_LANES jobs off its queue
+    and runs their slices together as a gang of ENGINE_INTERP machines
+    (mips_gang.h), which pays off for many guests of the same program.
+*/
+
+#define BATCH_SLICE 0x100000 /* instructions per time slice */
+
+typedef struct _MIPS_job
+{
+    const char *name;
+    const unsigned char *image; /* ELF or raw image loaded at address 0 */
+    unsigned int size;
+    MIPS_machine *machine;
+    unsigned int budget; /* instructions left */
+    int stopped; /* guest returned 5 */
+    int failed; /* out of memory */
+    MIPS_report report; /* the machine as it finished */
+    char *output;
+    unsigned int outlen;
+    unsigned int outcap;
+    void *user;
+} MIPS_job;
+
+typedef struct _MIPS_queue
+{
+    pthread_mutex_t lock;
+    MIPS_job **jobs; /* ring of njobs entries, a job sits in one queue at a time */
+    unsigned int head;
+    unsigned int len;
+    unsigned int steals;
+} MIPS_queue;
+
+typedef struct _MIPS_batch
+{
+    MIPS_job *jobs;
+    unsigned int njobs;
+    int engine;
+    unsigned int slice;
+    void (*setup)(MIPS_job *job); /* maps devices after the image is loaded */
+    void (*finish)(MIPS_job *job); /* runs before the machine of a done job is destroyed */
+    int nworkers;
+    MIPS_queue *queues;
+    pthread_mutex_t lock;
+    unsigned int left; /* jobs not finished yet */
+    unsigned long grouped, alone; /* instructions of ENGINE_GANG in and out of the group */
+} MIPS_batch;
+
+typedef struct _MIPS_worker
+{
+    MIPS_batch *batch;
+    int id;
+} MIPS_worker;
+
+/* appends to the console output of a job */
+int batch_output(MIPS_job *job, const char *buf, unsigned int len)
+{
+    if (job->outlen + len > job->outcap)
+    {
+        unsigned int cap = job->outcap ? job->outcap : 256;
+        char *output;
+
+        while (cap < job->outlen + len)
+            cap *= 2;
+        output = (char *)realloc(job->output, cap);
+        if (output == NULL)
+            return 0;
+        job->output = output;
+        job->outcap = cap;
+    }
+
+    memcpy(job->output + job->outlen, buf, len);
+    job->outlen += len;
+
+    return len;
+}
+
+int batch_write(void *user, const char *buf, unsigned int len)
+{
+    return batch_output((MIPS_job *)user, buf, len);
+}
+
+int batch_read(void *user, char *buf, unsigned int len)
+{
+    return 0;
+}
+
+/* budget is per guest, slice 0 means BATCH_SLICE */
+void batch_init(MIPS_batch *b, MIPS_job *jobs, unsigned int njobs, int engine, unsigned int budget, unsigned int slice)
+{
+    unsigned int i;
+
+    memset(b, 0, sizeof(MIPS_batch));
+    b->jobs = jobs;
+    b->njobs = njobs;
+    b->engine = engine;
+    b->slice = slice ? slice : BATCH_SLICE;
+
+    for (i = 0; i < njobs; i++)
+    {
+        jobs[i].machine = NULL;
+        jobs[i].budget = budget;
+        jobs[i].stopped = 0;
+        jobs[i].failed = 0;
+        jobs[i].output = NULL;
+        jobs[i].outlen = 0;
+        jobs[i].outcap = 0;
+    }
+}
+
+void batch_push(MIPS_batch *b, MIPS_queue *q, MIPS_job *job)
+{
+    pthread_mutex_lock(&q->lock);
+    q->jobs[(q->head + q->len) % b->njobs] = job;
+    q->len++;
+    pthread_mutex_unlock(&q->lock);
+}
+
+/* the owner takes the head */
+MIPS_job *batch_pop(MIPS_batch *b, MIPS_queue *q)
+{
+    MIPS_job *job = NULL;
+
+    pthread_mutex_lock(&q->lock);
+    if (q->len > 0)
+    {
+        job = q->jobs[q->head];
+        q->head = (q->head + 1) % b->njobs;
+        q->len--;
+    }
+    pthread_mutex_unlock(&q->lock);
+
+    return job;
+}
+
+/* thieves take the tail */
+MIPS_job *batch_steal(MIPS_batch *b, MIPS_queue *q)
+{
+    MIPS_job *job = NULL;
+
+    pthread_mutex_lock(&q->lock);
+    if (q->len > 0)
+    {
+        q->len--;
+        job = q->jobs[(q->head + q->len) % b->njobs];
+    }
+    pthread_mutex_unlock(&q->lock);
+
+    return job;
+}
+
+/* creates the machine of a job that has none, returns -1 if out of memory */
+int batch_start(MIPS_batch *b, MIPS_job *job)
+{
+    MIPS_io io;
+
+    if (job->machine != NULL)
+        return 0;
+
+    io.user = job;
+    io.write = batch_write;
+    io.read = batch_read;
+    io.poll = NULL;
+    io.file = NULL; /* no host files for batch guests */
+
+    job->machine = machine_create(b->engine == ENGINE_GANG ? ENGINE_INTERP : b->engine, &io);
+    if (job->machine == NULL)
+    {
+        job->failed = 1;
+        return -1;
+    }
+
+    if (elf_check(job->image, job->size))
+        elf_load_image(job->machine, job->image, job->size);
+    else
+        machine_load(job->machine, 0, job->image, job->size);
+    if (b->setup != NULL)
+        b->setup(job);
+
+    return 0;
+}
+
+int batch_done(MIPS_job *job)
+{
+    return job->failed || job->stopped || job->budget == 0;
+}
+
+/* keeps the report of a done job and frees its machine */
+void batch_retire(MIPS_batch *b, MIPS_job *job)
+{
+    if (job->machine == NULL)
+        return;
+    if (b->finish != NULL)
+        b->finish(job);
+    machine_report(job->machine, &job->report);
+    machine_destroy(job->machine);
+    job->machine = NULL;
+}
+
+void batch_slice(MIPS_batch *b, MIPS_job *job)
+{
+    unsigned int n = job->budget < b->slice ? job->budget : b->slice;
+    unsigned long retired;
+
+    if (batch_start(b, job) != 0)
+        return;
+
+    retired = job->machine->retired;
+    job->stopped = machine_run(job->machine, n) == 5;
+    job->budget -= job->machine->retired - retired;
+}
+
+/* one slice of up to GANG_LANES jobs as a gang */
+void batch_gang(MIPS_batch *b, MIPS_job **jobs, int n)
+{
+    MIPS_gang g;
+    unsigned long retired[GANG_LANES];
+    int lane[GANG_LANES];
+    int i;
+
+    gang_init(&g);
+    for (i = 0; i < n; i++)
+    {
+        lane[i] = -1;
+        if (batch_start(b, jobs[i]) != 0)
+            continue;
+        retired[i] = jobs[i]->machine->retired;
+        lane[i] = gang_add(&g, jobs[i]->machine, jobs[i]->budget < b->slice ? jobs[i]->budget : b->slice);
+    }
+
+    gang_run(&g);
+
+    for (i = 0; i < n; i++)
+    {
+        if (lane[i] < 0)
+            continue;
+        jobs[i]->stopped = g.stopped[lane[i]];
+        jobs[i]->budget -= jobs[i]->machine->retired - retired[i];
+    }
+
+    pthread_mutex_lock(&b->lock);
+    b->grouped += g.grouped;
+    b->alone += g.alone;
+    pthread_mutex_unlock(&b->lock);
+}
+
+void *batch_worker(void *arg)
+{
+    MIPS_worker *w = (MIPS_worker *)arg;
+    MIPS_batch *b = w->batch;
+    MIPS_queue *own = &b->queues[w->id];
+    MIPS_job *jobs[GANG_LANES];
+    int i, n;
+
+    for (;;)
+    {
+        MIPS_job *job = batch_pop(b, own);
+
+        for (i = 1; job == NULL && i < b->nworkers; i++)
+        {
+            job = batch_steal(b, &b->queues[(w->id + i) % b->nworkers]);
+            if (job != NULL)
+                own->steals++;
+        }
+
+        if (job == NULL)
+        {
+            unsigned int left;
+
+            pthread_mutex_lock(&b->lock);
+            left = b->left;
+            pthread_mutex_unlock(&b->lock);
+
+            /* the remaining jobs are running on other workers */
+            if (left == 0)
+                break;
+            sched_yield();
+            continue;
+        }
+
+        if (b->engine != ENGINE_GANG)
+        {
+            batch_slice(b, job);
+            jobs[0] = job;
+            n = 1;
+        }
+        else
+        {
+            /* a gang fills up from the own queue */
+            for (n = 0; job != NULL; job = n < GANG_LANES ? batch_pop(b, own) : NULL)
+                jobs[n++] = job;
+            batch_gang(b, jobs, n);
+        }
+
+        for (i = 0; i < n; i++)
+        {
+            if (batch_done(jobs[i]))
+            {
+                batch_retire(b, jobs[i]);
+                pthread_mutex_lock(&b->lock);
+                b->left--;
+                pthread_mutex_unlock(&b->lock);
+            }
+            else
+                batch_push(b, own, jobs[i]);
+        }
+    }
+
+    return NULL;
+}
+
+/* runs every job to completion on nworkers threads, returns -1 if out of resources */
+int batch_run(MIPS_batch *b, int nworkers)
+{
+    pthread_t *threads;
+    MIPS_worker *workers;
+    unsigned int i;
+    int started = 0;
+    int ret = 0;
+
+    if (b->njobs == 0)
+        return 0;
+    if (nworkers < 1)
+        nworkers = 1;
+    if ((unsigned int)nworkers > b->njobs)
+        nworkers = b->njobs;
+
+    b->nworkers = nworkers;
+    b->left = b->njobs;
+    b->queues = (MIPS_queue *)calloc(nworkers, sizeof(MIPS_queue));
+    threads = (pthread_t *)malloc(nworkers * sizeof(pthread_t));
+    workers = (MIPS_worker *)malloc(nworkers * sizeof(MIPS_worker));
+
+    if (b->queues == NULL || threads == NULL || workers == NULL)
+    {
+        free(b->queues);
+        free(threads);
+        free(workers);
+        b->queues = NULL;
+        return -1;
+    }
+
+    pthread_mutex_init(&b->lock, NULL);
+    for (i = 0; i < (unsigned int)nworkers; i++)
+    {
+        pthread_mutex_init(&b->queues[i].lock, NULL);
+        b->queues[i].jobs = (MIPS_job **)malloc(b->njobs * sizeof(MIPS_job *));
+        if (b->queues[i].jobs == NULL)
+            ret = -1;
+    }
+
+    /* deal the jobs out round robin, stealing evens out the rest */
+    if (ret == 0)
+    {
+        for (i = 0; i < b->njobs; i++)
+            batch_push(b, &b->queues[i % nworkers], &b->jobs[i]);
+
+        for (i = 0; i < (unsigned int)nworkers; i++)
+        {
+            workers[i].batch = b;
+            workers[i].id = i;
+            if (pthread_create(&threads[i], NULL, batch_worker, &workers[i]) != 0)
+                break;
+            started++;
+        }
+
+        /* no threads, worker 0 steals everything on this one */
+        if (started == 0)
+            batch_worker(&workers[0]);
+
+        for (i = 0; i < (unsigned int)started; i++)
+            pthread_join(threads[i], NULL);
+    }
+
+    for (i = 0; i < (unsigned int)nworkers; i++)
+    {
+        pthread_mutex_destroy(&b->queues[i].lock);
+        free(b->queues[i].jobs);
+    }
+    pthread_mutex_destroy(&b->lock);
+    free(threads);
+    free(workers);
+
+    return ret;
+}
+
+/* total steals of the last batch_run() */
+unsigned int batch_steals(MIPS_batch *b)
+{
+    unsigned int steals = 0;
+    int i;
+
+    for (i = 0; i < b->nworkers && b->queues != NULL; i++)
+        steals += b->queues[i].steals;
+
+    return steals;
+}
+
+void batch_free(MIPS_batch *b)
+{
+    unsigned int i;
+
+    for (i = 0; i < b->njobs; i++)
+    {
+        if (b->jobs[i].machine != NULL)
+            machine_destroy(b->jobs[i].machine);
+        free(b->jobs[i].output);
+        b->jobs[i].machine = NULL;
+        b->jobs[i].output = NULL;
+    }
+
+    free(b->queues);
+    b->queues = NULL;
+}
+
+#endif
@@ -0,0 +1,284 @@
+/* MIPS Emulator - basic block translation */
+/* Copyright 2024 Daniil Dunaef */
+
+#ifndef MIPS_BLOCK
+#define MIPS_BLOCK
+
+#include <string.h>
+#include "mips.h"
+#include "mips_icache.h"
+
+/* @note A block is a straight-line run of predecoded instructions that ends
+    at the first branch, jump, jr/jalr, syscall, break, eret or mfc0/mtc0,
+    at a page boundary or after BLOCK_MAX instructions.
+    Inside a block only the last instruction gets the full cp0_update()
+    epilogue, the others just clear $zero and advance pc and the clock, so
+    devices see the same clock as with execute(). This is exact because
+    Status/Count/Compare can only change in the terminating instruction.
+    Blocks are entered one instruction at a time while an exception is
+    pending or when an event falls due before their last instruction, and
+    they end early when a device write schedules an event that is due.
+    After a block the successor is taken from its chain slots, so the
+    cache is only searched when a chain misses.
+    A block that has run threshold times is handed to compile(), which may
+    return native code for it (see mips_jit.h). Native code runs a prefix
+    of the block and returns how many instructions it retired; the rest is
+    interpreted as usual, unless the last one retired raised an exception.
+    Blocks mark their page with mem_code(), the owner must point
+    mem->codewrite at block_store().
+*/
+
+#define BLOCK_MAX 32
+#define BLOCK_CACHE_SIZE 4096 /* blocks, power of two and >= 1024 */
+#define BLOCK_PAGE_SHIFT 12
+
+typedef unsigned int (*MIPS_native)(MIPS_state *state, MIPS_mem *mem);
+
+typedef struct _MIPS_block
+{
+    unsigned int pc;
+    unsigned int len;
+    int valid;
+    int chain; /* next chain slot to overwrite */
+    unsigned int hits;
+    MIPS_native native;
+    struct _MIPS_block *next[2];
+    MIPS_decoded code[BLOCK_MAX];
+} MIPS_block;
+
+typedef struct _MIPS_blockcache
+{
+    MIPS_block blocks[BLOCK_CACHE_SIZE];
+    MIPS_block uncached; /* blocks fetched from MMIO are never cached */
+    unsigned int threshold; /* runs before a block is compiled */
+    MIPS_native (*compile)(struct _MIPS_blockcache *c, MIPS_block *b);
+    void *jit;
+} MIPS_blockcache;
+
+/* instructions that may change pc or CP0 state end a block */
+int block_ends(const MIPS_decoded *d)
+{
+    switch (d->opcode)
+    {
+        case 0x00:
+            switch (d->funct)
+            {
+                case 0x08: /* jr */
+                case 0x09: /* jalr */
+                case 0x0c: /* syscall */
+                case 0x0d: /* break */
+                    return 1;
+            }
+            return 0;
+        case 0x01: /* bgez/bltz */
+        case 0x02: /* j */
+        case 0x03: /* jal */
+        case 0x04: /* beq */
+        case 0x05: /* bne */
+        case 0x06: /* blez */
+        case 0x07: /* bgtz */
+        case 0x10: /* mfc0/mtc0 */
+        case 0x18: /* eret */
+            return 1;
+    }
+    return 0;
+}
+
+void block_init(MIPS_blockcache *c)
+{
+    memset(c, 0, sizeof(MIPS_blockcache));
+}
+
+/* drop every block that starts in the given page */
+void block_invalidate(MIPS_blockcache *c, unsigned int page)
+{
+    unsigned int base = (page << (BLOCK_PAGE_SHIFT - 2)) & (BLOCK_CACHE_SIZE - 1);
+    unsigned int i;
+
+    for (i = 0; i < (1 << (BLOCK_PAGE_SHIFT - 2)); i++)
+    {
+        MIPS_block *b = &c->blocks[base + i];
+        if (b->valid && b->pc >> BLOCK_PAGE_SHIFT == page)
+            b->valid = 0;
+    }
+}
+
+/* mem->codewrite target, only called for pages marked with mem_code() */
+void block_store(void *cache, unsigned int address)
+{
+    block_invalidate((MIPS_blockcache *)cache, address >> BLOCK_PAGE_SHIFT);
+}
+
+void block_translate(MIPS_block *b, MIPS_mem *mem, unsigned int pc)
+{
+    unsigned int address = pc;
+
+    b->pc = pc;
+    b->len = 0;
+    b->chain = 0;
+    b->hits = 0;
+    b->native = NULL;
+    b->next[0] = NULL;
+    b->next[1] = NULL;
+
+    while (b->len < BLOCK_MAX)
+    {
+        MIPS_decoded *d = &b->code[b->len++];
+
+        predecode(d, mem_fetch(mem, address), address);
+        address += 4;
+
+        if (block_ends(d) || (address & ((1 << BLOCK_PAGE_SHIFT) - 1)) == 0)
+            break;
+    }
+
+    b->valid = 1;
+}
+
+MIPS_block *block_lookup(MIPS_blockcache *c, MIPS_mem *mem, unsigned int pc)
+{
+    MIPS_block *b = &c->blocks[(pc >> 2) & (BLOCK_CACHE_SIZE - 1)];
+
+    if (b->valid && b->pc == pc)
+        return b;
+
+    if (mem_uncached(mem, pc))
+    {
+        b = &c->uncached;
+        block_translate(b, mem, pc);
+        b->len = 1;
+        b->valid = 0;
+        return b;
+    }
+
+    block_translate(b, mem, pc);
+    mem_code(mem, pc);
+
+    return b;
+}
+
+/* runs the block, returns like execute() for the last instruction it ran */
+int block_exec(MIPS_block *b, MIPS_state *state, MIPS_mem *mem, unsigned int *retired)
+{
+    const MIPS_decoded *d = b->code;
+    const MIPS_decoded *last = b->code + b->len - 1;
+    unsigned long start = state->clock;
+
+    if (b->native != NULL)
+    {
+        unsigned int n = b->native(state, mem);
+
+        /* all of the block ran, instruction n - 1 raised or an event fell due */
+        if (n == b->len || state->exception != 0 || state->next <= start + n)
+        {
+            state->clock = start + n - 1;
+            *retired = n;
+            cp0_update(state);
+            return b->code[n - 1].instruction;
+        }
+        /* after lwl/lwr pc is still theirs, a bail has it right already */
+        state->clock = start + n;
+        state->pc = b->code[n].pc;
+        d += n;
+    }
+
+    for (;;)
+    {
+        unsigned int instruction = d->instruction;
+
+        *retired = d - b->code + 1;
+
+        if (d->handler(state, d, mem) == 5)
+            return 5;
+
+        /* stop early on exceptions, when a store hit this block and when
+           a device write scheduled an event that is due now */
+        if (d == last || state->exception != 0 || !b->valid || state->next <= state->clock + 1)
+        {
+            cp0_update(state);
+            return instruction;
+        }
+
+        state->regs[0] = 0;
+        state->pc += 4;
+        state->clock++;
+        d++;
+    }
+}
+
+/* runs up to max instructions chaining blocks, returns 5 if the guest stopped,
+    the number of instructions run goes to *ran */
+int block_run(MIPS_blockcache *c, MIPS_state *state, MIPS_mem *mem, unsigned int max, unsigned int *ran)
+{
+    MIPS_block *b = block_lookup(c, mem, state->pc);
+    unsigned int start = max;
+
+    *ran = 0;
+
+    while (max > 0)
+    {
+        MIPS_block *next;
+        unsigned int pc;
+        unsigned int retired;
+
+        if (b->len > max || state->exception != 0 || state->next - state->clock < b->len)
+        {
+            /* single step through the pending event */
+            const MIPS_decoded *d = b->code;
+
+            if (d->handler(state, d, mem) == 5)
+            {
+                *ran = start - max + 1;
+                return 5;
+            }
+            cp0_update(state);
+            max--;
+            if (state->stop != 0)
+            {
+                *ran = start - max;
+                return 5;
+            }
+
+            b = block_lookup(c, mem, state->pc);
+            continue;
+        }
+
+        if (c->compile != NULL && b->valid && b->native == NULL && ++b->hits == c->threshold)
+            b->native = c->compile(c, b);
+
+        if (block_exec(b, state, mem, &retired) == 5)
+        {
+            *ran = start - max + retired;
+            return 5;
+        }
+        max -= retired;
+        if (state->stop != 0)
+        {
+            *ran = start - max;
+            return 5;
+        }
+
+        /* follow the chain, link the successor on a miss */
+        pc = state->pc;
+        next = b->next[0];
+        if (next == NULL || !next->valid || next->pc != pc)
+        {
+            next = b->next[1];
+            if (next == NULL || !next->valid || next->pc != pc)
+            {
+                next = block_lookup(c, mem, pc);
+                if (b->valid && next->valid)
+                {
+                    b->next[b->chain] = next;
+                    b->chain ^= 1;
+                }
+            }
+        }
+        b = next;
+    }
+
+    *ran = start;
+    return 0;
+}
+
+#endif
@@ -0,0 +1,263 @@
+/* MIPS Emulator - block device backed by a host file */
+/* Copyright 2024 Daniil Dunaef */
+
+#ifndef MIPS_DISK
+#define MIPS_DISK
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mips.h"
+
+/* @note The disk is a host file of DISK_SECTOR byte sectors. The guest
+    sets sector, guest address and sector count and writes a command, the
+    whole transfer then runs at once as memcpy between the file and guest
+    RAM, page by page through mem_span() (or in one go for pages that are
+    contiguous on the host). Only I/O space on the guest side goes byte by
+    byte. Status tells done or error. With control bit 0 set, completion
+    raises interrupt line DISK_LINE at the next instruction boundary and
+    writing status acknowledges it. A masked completion is not lost: with
+    the MMU it waits in pending, without it the disk tries again every
+    DISK_RETRY instructions until the line is unmasked or status is written.
+    On POSIX hosts the file is mapped shared, guest writes reach the file
+    through the page cache and flush is msync(). A private disk is mapped
+    copy-on-write and never changes the file, for replays of a run that
+    wrote to its disk. Elsewhere the file is read in and written back on
+    flush and disk_close().
+    Registers are words at base:
+    0x00 sector, 0x04 guest address, 0x08 sector count,
+    0x0c command (DISK_READ, DISK_WRITE, DISK_FLUSH),
+    0x10 status (DISK_DONE, DISK_ERROR), 0x14 disk size in sectors,
+    0x18 control.
+*/
+
+#define DISK_SECTOR 512
+#define DISK_LINE 4
+#define DISK_RETRY 1024 /* instructions between tries of a masked completion interrupt */
+
+#define DISK_READ 1 /* disk to guest RAM */
+#define DISK_WRITE 2 /* guest RAM to disk */
+#define DISK_FLUSH 3
+
+#define DISK_DONE 0x01
+#define DISK_ERROR 0x02
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#define DISK_MMAP
+#endif
+
+typedef struct _MIPS_disk
+{
+    MIPS_state *state;
+    MIPS_mem *mem;
+    unsigned int base;
+    unsigned char *data; /* the whole file */
+    unsigned long size;
+    int readonly;
+    int private;
+    FILE *fp; /* without mmap */
+    unsigned int sector, address, count;
+    unsigned int status, control;
+} MIPS_disk;
+
+int disk_flush(MIPS_disk *d)
+{
+    if (d->private || d->readonly || d->size == 0)
+        return 0;
+#ifdef DISK_MMAP
+    return msync(d->data, d->size, MS_SYNC);
+#else
+    if (fseek(d->fp, 0, SEEK_SET) != 0 || fwrite(d->data, 1, d->size, d->fp) != d->size)
+        return -1;
+    return fflush(d->fp);
+#endif
+}
+
+/* moves count sectors between the disk and guest RAM, -1 if they do not fit */
+int disk_transfer(MIPS_disk *d, int todisk)
+{
+    unsigned long offset = (unsigned long)d->sector * DISK_SECTOR;
+    unsigned long len = (unsigned long)d->count * DISK_SECTOR;
+    unsigned int done = 0;
+
+    if ((unsigned long)d->sector + d->count > d->size / DISK_SECTOR || len > 0xffffffffUL ||
+        d->address + (unsigned int)len < d->address || (todisk && d->readonly))
+        return -1;
+
+    while (done < len)
+    {
+        unsigned int span, i;
+        unsigned char *disk = d->data + offset + done;
+        unsigned char *p = mem_span(d->mem, d->address + done, (unsigned int)len - done, !todisk, &span);
+
+        if (p != NULL)
+        {
+            if (todisk)
+                memcpy(disk, p, span);
+            else
+                memcpy(p, disk, span);
+        }
+        else if (todisk && mem_io(d->mem, d->address + done) == 0)
+            memset(disk, 0, span); /* never written */
+        else
+            for (i = 0; i < span; i++)
+            {
+                if (todisk)
+                    disk[i] = loadmembu(d->mem, d->address + done + i);
+                else
+                    storememb(d->mem, d->address + done + i, disk[i]);
+            }
+        done += span;
+    }
+
+    return 0;
+}
+
+void disk_done(MIPS_state *state, void *user)
+{
+    MIPS_disk *d = (MIPS_disk *)user;
+
+    if (!(d->control & 0x01) || d->status == 0)
+        return;
+    if (!state->mmu && state->interrupts[DISK_LINE - 1] == 0xff)
+        event_schedule(state, DISK_RETRY, disk_done, d);
+    else
+        interrupt_handler(state, DISK_LINE, 0);
+}
+
+unsigned int disk_read(void *user, unsigned int address, int size)
+{
+    MIPS_disk *d = (MIPS_disk *)user;
+
+    switch (address - d->base)
+    {
+        case 0x00:
+            return d->sector;
+        case 0x04:
+            return d->address;
+        case 0x08:
+            return d->count;
+        case 0x10:
+            return d->status;
+        case 0x14:
+            return (unsigned int)(d->size / DISK_SECTOR);
+        case 0x18:
+            return d->control;
+    }
+    return 0;
+}
+
+void disk_write(void *user, unsigned int address, int size, unsigned int value)
+{
+    MIPS_disk *d = (MIPS_disk *)user;
+    int ret = -1;
+
+    switch (address - d->base)
+    {
+        case 0x00:
+            d->sector = value;
+        break;
+        case 0x04:
+            d->address = value;
+        break;
+        case 0x08:
+            d->count = value;
+        break;
+        case 0x0c:
+            if (value == DISK_READ || value == DISK_WRITE)
+                ret = disk_transfer(d, value == DISK_WRITE);
+            else if (value == DISK_FLUSH)
+                ret = disk_flush(d);
+            d->status = ret == 0 ? DISK_DONE : DISK_DONE | DISK_ERROR;
+            /* the store finishes first, then the interrupt */
+            event_cancel(d->state, disk_done, d);
+            event_schedule(d->state, 1, disk_done, d);
+        break;
+        case 0x10:
+            d->status = 0;
+        break;
+        case 0x18:
+            d->control = value;
+        break;
+    }
+}
+
+/* opens path, read-only if it can not be written. Returns -1 on failure */
+int disk_open(MIPS_disk *d, const char *path, int private)
+{
+    memset(d, 0, sizeof(MIPS_disk));
+    d->private = private;
+
+    d->fp = fopen(path, private ? "rb" : "r+b");
+    if (d->fp == NULL && !private)
+    {
+        d->fp = fopen(path, "rb");
+        d->readonly = 1;
+    }
+    if (d->fp == NULL || fseek(d->fp, 0, SEEK_END) != 0)
+    {
+        if (d->fp != NULL)
+            fclose(d->fp);
+        return -1;
+    }
+    d->size = (unsigned long)ftell(d->fp);
+    if (d->size == 0)
+        return 0;
+
+#ifdef DISK_MMAP
+    {
+        void *map = mmap(NULL, d->size, d->readonly ? PROT_READ : PROT_READ | PROT_WRITE,
+            private ? MAP_PRIVATE : MAP_SHARED, fileno(d->fp), 0);
+
+        if (map == MAP_FAILED)
+        {
+            fclose(d->fp);
+            return -1;
+        }
+        d->data = (unsigned char *)map;
+    }
+#else
+    d->data = (unsigned char *)malloc(d->size);
+    if (d->data == NULL || fseek(d->fp, 0, SEEK_SET) != 0 || fread(d->data, 1, d->size, d->fp) != d->size)
+    {
+        free(d->data);
+        fclose(d->fp);
+        return -1;
+    }
+#endif
+
+    return 0;
+}
+
+/* maps the registers at base, returns -1 if the device table is full */
+int disk_attach(MIPS_disk *d, MIPS_state *state, MIPS_mem *mem, unsigned int base)
+{
+    d->state = state;
+    d->mem = mem;
+    d->base = base;
+    d->sector = d->address = d->count = 0;
+    d->status = d->control = 0;
+
+    return mem_map(mem, base, 0x1c, disk_read, disk_write, d);
+}
+
+void disk_close(MIPS_disk *d)
+{
+    disk_flush(d);
+#ifdef DISK_MMAP
+    if (d->data != NULL)
+        munmap(d->data, d->size);
+#else
+    free(d->data);
+#endif
+    if (d->fp != NULL)
+        fclose(d->fp);
+    d->data = NULL;
+    d->fp = NULL;
+}
+
+#endif
@@ -0,0 +1,233 @@
+/* MIPS Emulator - ELF32 big-endian loader */
+/* Copyright 2024 Daniil Dunaef */
+
+#ifndef MIPS_ELF
+#define MIPS_ELF
+
+#include <stdio.h>
+#include <string.h>
+#include "mips.h"
+#include "mips_machine.h"
+
+/* @note Loads the PT_LOAD segments of a big-endian MIPS ELF32 executable
+    at their virtual addresses, with the MMU on at the physical address
+    kseg0/kseg1 gives them or else at their p_paddr. Nothing is written
+    for the part of a segment past its file size, untouched pages already
+    read as zero, so .bss costs nothing until the guest writes it.
+    elf_load() maps the file privately; whole pages of segments that are
+    not writable point straight into the mapping instead of being copied,
+    everything else is copied. The mapping becomes the backing of guest
+    memory (see mips_snapshot.h), if memory already has one or the host
+    has no mmap the file is read and copied like elf_load_image() does.
+    pc is set to e_entry, $gp to the PT_MIPS_REGINFO value or the _gp
+    symbol and $sp to the _stack/__stack/_sp symbol when present.
+*/
+
+#define ELF_PT_LOAD 1
+#define ELF_PT_MIPS_REGINFO 0x70000000
+#define ELF_SHT_SYMTAB 2
+#define ELF_PF_W 2
+#define ELF_EM_MIPS 8
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#define ELF_MMAP
+#endif
+
+unsigned int elf_half(const unsigned char *p)
+{
+    return p[0] << 8 | p[1];
+}
+
+unsigned int elf_word(const unsigned char *p)
+{
+    return (unsigned int)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+/* 1 if the buffer holds a big-endian MIPS ELF32 executable */
+int elf_check(const unsigned char *image, unsigned long size)
+{
+    return size >= 52 && memcmp(image, "\177ELF", 4) == 0 &&
+        image[4] == 1 && image[5] == 2 && elf_half(image + 18) == ELF_EM_MIPS;
+}
+
+/* value of a symbol from .symtab, returns 0 if it is not there */
+int elf_symbol(const unsigned char *image, unsigned long size, const char *name, unsigned int *value)
+{
+    unsigned int shoff = elf_word(image + 32);
+    unsigned int shentsize = elf_half(image + 46);
+    unsigned int shnum = elf_half(image + 48);
+    unsigned int i, j;
+
+    if (shoff == 0 || shentsize < 40 || shoff > size || (unsigned long)shnum * shentsize > size - shoff)
+        return 0;
+
+    for (i = 0; i < shnum; i++)
+    {
+        const unsigned char *sh = image + shoff + i * shentsize;
+        const unsigned char *strsh;
+        unsigned int offset = elf_word(sh + 16);
+        unsigned int len = elf_word(sh + 20);
+        unsigned int link = elf_word(sh + 24);
+        unsigned int stroff, strsize;
+
+        if (elf_word(sh + 4) != ELF_SHT_SYMTAB || link >= shnum)
+            continue;
+        strsh = image + shoff + link * shentsize;
+        stroff = elf_word(strsh + 16);
+        strsize = elf_word(strsh + 20);
+        if (offset > size || len > size - offset || stroff > size || strsize > size - stroff)
+            continue;
+
+        for (j = 0; j + 16 <= len; j += 16)
+        {
+            const unsigned char *sym = image + offset + j;
+            unsigned int st_name = elf_word(sym);
+
+            if (st_name < strsize && strncmp((const char *)image + stroff + st_name, name, strsize - st_name) == 0)
+            {
+                *value = elf_word(sym + 4);
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+/* loads the segments, whole read-only pages are attached from image when
+   attach is set. Returns 0 on success, -1 on a malformed file */
+int elf_segments(MIPS_machine *m, const unsigned char *image, unsigned long size, int attach)
+{
+    unsigned int phoff = elf_word(image + 28);
+    unsigned int phentsize = elf_half(image + 42);
+    unsigned int phnum = elf_half(image + 44);
+    unsigned int value;
+    unsigned int i;
+
+    if (!elf_check(image, size) || phentsize < 32 || phoff > size || (unsigned long)phnum * phentsize > size - phoff)
+        return -1;
+
+    for (i = 0; i < phnum; i++)
+    {
+        const unsigned char *ph = image + phoff + i * phentsize;
+        unsigned int offset = elf_word(ph + 4);
+        unsigned int vaddr = elf_word(ph + 8);
+        unsigned int filesz = elf_word(ph + 16);
+        unsigned int flags = elf_word(ph + 24);
+
+        if (elf_word(ph) == ELF_PT_MIPS_REGINFO && filesz >= 24 && offset <= size - 24)
+            m->state.regs[28] = elf_word(image + offset + 20); /* ri_gp_value */
+
+        if (elf_word(ph) != ELF_PT_LOAD)
+            continue;
+        if (offset > size || filesz > size - offset)
+            return -1;
+
+        /* with the MMU memory is physical, kseg0/kseg1 segments go where those map */
+        if (m->state.mmu)
+            vaddr = vaddr - MMU_KSEG0 < MMU_KSEG2 - MMU_KSEG0 ? vaddr & 0x1fffffff : elf_word(ph + 12);
+
+        /* read-only pages share the file, the kernel copies them on write */
+        if (attach && !(flags & ELF_PF_W) && (offset & (MEM_PAGE_SIZE - 1)) == (vaddr & (MEM_PAGE_SIZE - 1)))
+        {
+            while (filesz > 0 && (vaddr & (MEM_PAGE_SIZE - 1)) != 0)
+            {
+                unsigned int chunk = MEM_PAGE_SIZE - (vaddr & (MEM_PAGE_SIZE - 1));
+
+                if (chunk > filesz)
+                    chunk = filesz;
+                mem_load(&m->mem, vaddr, image + offset, chunk);
+                vaddr += chunk;
+                offset += chunk;
+                filesz -= chunk;
+            }
+            while (filesz >= MEM_PAGE_SIZE)
+            {
+                if (mem_attach(&m->mem, vaddr, (unsigned char *)image + offset) != 0)
+                    mem_load(&m->mem, vaddr, image + offset, MEM_PAGE_SIZE);
+                vaddr += MEM_PAGE_SIZE;
+                offset += MEM_PAGE_SIZE;
+                filesz -= MEM_PAGE_SIZE;
+            }
+        }
+
+        /* the rest of p_memsz is .bss and stays untouched */
+        mem_load(&m->mem, vaddr, image + offset, filesz);
+    }
+
+    if (elf_symbol(image, size, "_gp", &value))
+        m->state.regs[28] = value;
+    if (elf_symbol(image, size, "_stack", &value) || elf_symbol(image, size, "__stack", &value) ||
+        elf_symbol(image, size, "_sp", &value))
+        m->state.regs[29] = value;
+
+    m->state.pc = elf_word(image + 24);
+
+    return 0;
+}
+
+/* loads from a buffer the caller keeps, everything is copied */
+int elf_load_image(MIPS_machine *m, const unsigned char *image, unsigned long size)
+{
+    return elf_segments(m, image, size, 0);
+}
+
+#ifdef ELF_MMAP
+void elf_unmap(void *backing, unsigned long size)
+{
+    munmap(backing, size);
+}
+#endif
+
+/* returns 0 on success, -1 if the file can not be read or is not a MIPS ELF */
+int elf_load(MIPS_machine *m, const char *path)
+{
+    FILE *fp = fopen(path, "rb");
+    unsigned char *image;
+    long size;
+    int ret;
+
+    if (fp == NULL)
+        return -1;
+
+    fseek(fp, 0, SEEK_END);
+    size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    if (size <= 0)
+    {
+        fclose(fp);
+        return -1;
+    }
+
+#ifdef ELF_MMAP
+    if (m->mem.backing == NULL)
+    {
+        void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fileno(fp), 0);
+
+        if (map != MAP_FAILED)
+        {
+            fclose(fp);
+            m->mem.backing = (unsigned char *)map;
+            m->mem.backingsize = size;
+            m->mem.unback = elf_unmap;
+            return elf_segments(m, m->mem.backing, size, 1);
+        }
+    }
+#endif
+
+    image = (unsigned char *)malloc(size);
+    if (image == NULL || fread(image, 1, size, fp) != (unsigned long)size)
+    {
+        free(image);
+        fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+
+    ret = elf_load_image(m, image, size);
+    free(image);
+
+    return ret;
+}
+
+#endif
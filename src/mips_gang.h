@@ -0,0 +1,681 @@
+/* MIPS Emulator - guests run side by side on vector registers */
+/* Copyright 2024 Daniil Dunaef */
+
+#ifndef MIPS_GANG
+#define MIPS_GANG
+
+#include <string.h>
+#include "mips.h"
+#include "mips_machine.h"
+
+/* @note A gang runs up to GANG_LANES machines of one program that differ
+    in their data, fuzzing inputs for one. The lanes that sit at the same
+    pc form the group: their registers live in a structure of arrays, one
+    vector of GANG_LANES words per guest register, and every instruction
+    is fetched and decoded once and runs for all of them. ALU ops, shifts,
+    hi/lo moves and movz/movn are vector ops (GNU C vector extensions,
+    plain loops over the lanes elsewhere), multu and loads and stores go
+    lane by lane, each lane into its own memory, branches and jr compare
+    across the lanes.
+    Lanes whose branch goes the other way leave the group, the larger side
+    stays. Lanes outside the group run execute() on their own machine, the
+    lowest pc first, and join again when they reach the pc of the group,
+    which is where both sides of an if meet again.
+    Instructions that can stop the guest, trap or touch CP0 (syscall,
+    break, jr $ra, the traps, div, madd, mfc0/mtc0, eret) and lwl/lwr run
+    alone for every lane. So do lanes with a pending exception or the MMU
+    on, loads and stores of a lane that go to a device, and a lane leaves
+    the group before an event falls due for it.
+    Only pages that hold the same bytes in every lane run as a group. A
+    page is compared once and marked with mem_code() in every lane, a
+    store from any lane into it comes back through the codewrite hook and
+    the page is compared again. The hook belongs to the gang while
+    gang_run() runs, so lanes must be ENGINE_INTERP machines.
+    Every lane counts clock, retired instructions and its performance
+    counters as if it had run alone, results are those of ENGINE_INTERP.
+*/
+
+#define GANG_LANES 8 /* machines per gang, at most 32 */
+#define GANG_PAGES 64 /* code pages known to be the same or not, power of two */
+#define GANG_SOLO 256 /* instructions a lane runs alone on a page that differs */
+#define GANG_NONE 0xffffffff
+
+#if defined(__GNUC__) && !defined(__STRICT_ANSI__)
+#define GANG_SIMD
+#endif
+
+#ifdef GANG_SIMD
+typedef unsigned int MIPS_vec __attribute__((vector_size(4 * GANG_LANES)));
+#define GANG_AT(v, l) ((v)[l])
+/* d = e for all lanes, GANG_X(v) is a whole vector in e */
+#define GANG_MAP(d, e) ((d) = (e))
+#define GANG_X(v) (v)
+#define GANG_LESS(a, b) ((MIPS_vec)((a) < (b)) & 1)
+#define GANG_SELECT(c, a, b) (((a) & (MIPS_vec)(c)) | ((b) & ~(MIPS_vec)(c)))
+#else
+typedef struct _MIPS_vec
+{
+    unsigned int lane[GANG_LANES];
+} MIPS_vec;
+#define GANG_AT(v, l) ((v).lane[l])
+#define GANG_MAP(d, e) for (l = 0; l < GANG_LANES; l++) (d).lane[l] = (e)
+#define GANG_X(v) ((v).lane[l])
+#define GANG_LESS(a, b) ((a) < (b))
+#define GANG_SELECT(c, a, b) ((c) ? (a) : (b))
+#endif
+
+typedef struct _MIPS_gang
+{
+    MIPS_vec regs[32];
+    MIPS_vec hi, lo;
+    unsigned int pc; /* of the group */
+    unsigned int in; /* lanes in the group, one bit each */
+    int lead; /* a lane of the group, instructions come from its memory */
+    unsigned int page; /* page of pc while it is known to be the same in every lane */
+    unsigned long steps; /* instructions the group ran */
+    unsigned long branches, loads, stores; /* taken branches, loads and stores among them */
+    unsigned long limit; /* steps at which a lane runs out of budget or has an event due */
+    MIPS_machine *lanes[GANG_LANES]; /* NULL for an unused lane */
+    unsigned int budget[GANG_LANES]; /* instructions left */
+    int stopped[GANG_LANES]; /* execute() returned 5 */
+    unsigned long joined[GANG_LANES][4]; /* steps, branches, loads, stores when the lane joined */
+    unsigned int pages[GANG_PAGES]; /* page << 1 | 1 if it is the same in every lane */
+    void (*codewrite[GANG_LANES])(void *cache, unsigned int address); /* hooks of the lanes */
+    void *cache[GANG_LANES];
+    unsigned long grouped; /* lane instructions run in the group */
+    unsigned long alone; /* and by a lane on its own */
+} MIPS_gang;
+
+const unsigned char gang_zero[MEM_PAGE_SIZE] = {0};
+
+void gang_init(MIPS_gang *g)
+{
+    memset(g, 0, sizeof(MIPS_gang));
+}
+
+/* adds an ENGINE_INTERP machine that may run budget instructions,
+   returns its lane or -1 if the gang is full */
+int gang_add(MIPS_gang *g, MIPS_machine *m, unsigned int budget)
+{
+    int l;
+
+    for (l = 0; l < GANG_LANES; l++)
+        if (g->lanes[l] == NULL)
+        {
+            g->lanes[l] = m;
+            g->budget[l] = budget;
+            g->stopped[l] = 0;
+            return l;
+        }
+    return -1;
+}
+
+/* a lane that runs on its own and may run more */
+int gang_ready(MIPS_gang *g, int l)
+{
+    return g->lanes[l] != NULL && !g->stopped[l] && g->budget[l] > 0 && !(g->in & 1u << l);
+}
+
+/* 1 if every lane holds the same bytes in the page of pc and none of them
+   is I/O space. The pages are marked so that stores bring them back here */
+int gang_same(MIPS_gang *g, unsigned int pc)
+{
+    unsigned int page = pc >> MEM_PAGE_SHIFT;
+    unsigned int *slot = &g->pages[page & (GANG_PAGES - 1)];
+    const unsigned char *first = NULL;
+    int same = 1;
+    int l;
+
+    if (*slot >> 1 == page)
+        return *slot & 1;
+
+    for (l = 0; l < GANG_LANES; l++)
+    {
+        MIPS_mem *mem;
+        const unsigned char *p;
+
+        if (g->lanes[l] == NULL)
+            continue;
+        mem = &g->lanes[l]->mem;
+        mem_code(mem, pc);
+        p = mem_page(mem, pc);
+        if (p == NULL)
+            p = gang_zero;
+        if (mem_io(mem, pc) != 0)
+            same = 0;
+        else if (first == NULL)
+            first = p;
+        else if (same && p != first && memcmp(p, first, MEM_PAGE_SIZE) != 0)
+            same = 0;
+    }
+
+    *slot = page << 1 | same;
+    return same;
+}
+
+/* mem->codewrite of the lanes while the gang runs */
+void gang_store(void *cache, unsigned int address)
+{
+    MIPS_gang *g = (MIPS_gang *)cache;
+    unsigned int page = address >> MEM_PAGE_SHIFT;
+
+    if (g->pages[page & (GANG_PAGES - 1)] >> 1 == page)
+        g->pages[page & (GANG_PAGES - 1)] = GANG_NONE;
+    if (g->page == page)
+        g->page = GANG_NONE;
+}
+
+/* one instruction of a lane on its own */
+void gang_step(MIPS_gang *g, int l)
+{
+    MIPS_machine *m = g->lanes[l];
+
+    if (execute(&m->state, mem_fetch(&m->mem, m->state.pc), &m->mem) == 5)
+        g->stopped[l] = 1;
+    m->retired++;
+    g->budget[l]--;
+    g->alone++;
+}
+
+/* lane l could not join at its pc, it runs one instruction alone and more
+   while its code differs from the other lanes */
+void gang_solo(MIPS_gang *g, int l)
+{
+    MIPS_machine *m = g->lanes[l];
+    int n = GANG_SOLO;
+
+    do
+        gang_step(g, l);
+    while (--n > 0 && gang_ready(g, l) && !gang_same(g, m->state.pc));
+}
+
+/* lane l joins the group at its pc, returns 0 if it has to run alone */
+int gang_join(MIPS_gang *g, int l)
+{
+    MIPS_machine *m = g->lanes[l];
+    unsigned long room = g->budget[l];
+    int r;
+
+    if (m->state.exception != 0 || m->state.mmu || m->state.clock + 1 >= m->state.next || !gang_same(g, m->state.pc))
+        return 0;
+    if (m->state.next - m->state.clock - 1 < room)
+        room = m->state.next - m->state.clock - 1;
+
+    if (g->in == 0)
+    {
+        g->pc = m->state.pc;
+        g->lead = l;
+        g->page = m->state.pc >> MEM_PAGE_SHIFT;
+        g->limit = ~0UL;
+    }
+    if (g->steps + room < g->limit)
+        g->limit = g->steps + room;
+
+    for (r = 0; r < 32; r++)
+        GANG_AT(g->regs[r], l) = m->state.regs[r];
+    GANG_AT(g->hi, l) = m->state.hi;
+    GANG_AT(g->lo, l) = m->state.lo;
+    g->joined[l][0] = g->steps;
+    g->joined[l][1] = g->branches;
+    g->joined[l][2] = g->loads;
+    g->joined[l][3] = g->stores;
+    g->in |= 1u << l;
+
+    return 1;
+}
+
+/* lane l goes back to its machine at pc with what it ran in the group */
+void gang_leave(MIPS_gang *g, int l, unsigned int pc)
+{
+    MIPS_machine *m = g->lanes[l];
+    unsigned long n = g->steps - g->joined[l][0];
+    int r;
+
+    for (r = 0; r < 32; r++)
+        m->state.regs[r] = GANG_AT(g->regs[r], l);
+    m->state.hi = GANG_AT(g->hi, l);
+    m->state.lo = GANG_AT(g->lo, l);
+    m->state.pc = pc;
+    m->state.clock += n;
+    m->state.branches += g->branches - g->joined[l][1];
+    m->state.loads += g->loads - g->joined[l][2];
+    m->state.stores += g->stores - g->joined[l][3];
+    m->retired += n;
+    g->budget[l] -= n;
+    g->grouped += n;
+    g->in &= ~(1u << l);
+
+    if (g->lead == l && g->in != 0)
+        while (!(g->in & 1u << g->lead))
+            g->lead = (g->lead + 1) % GANG_LANES;
+}
+
+/* lane l leaves in the middle of the instruction at the group's pc and
+   finishes it alone, next is where its pc goes */
+void gang_finish(MIPS_gang *g, int l, unsigned int next)
+{
+    MIPS_machine *m = g->lanes[l];
+
+    gang_leave(g, l, next - 4);
+    cp0_update(&m->state);
+    m->retired++;
+    g->budget[l]--;
+    g->grouped++;
+}
+
+/* lane l leaves before the instruction at pc and runs it alone, returns
+   where its pc went */
+unsigned int gang_alone(MIPS_gang *g, int l, unsigned int pc)
+{
+    gang_leave(g, l, pc);
+    gang_step(g, l);
+    return g->lanes[l]->state.pc;
+}
+
+/* every lane leaves at the group's pc */
+void gang_split(MIPS_gang *g)
+{
+    int l;
+
+    for (l = 0; l < GANG_LANES; l++)
+        if (g->in & 1u << l)
+            gang_leave(g, l, g->pc);
+}
+
+/* every lane runs the instruction at pc alone */
+void gang_each(MIPS_gang *g, unsigned int pc)
+{
+    int l;
+
+    for (l = 0; l < GANG_LANES; l++)
+        if (g->in & 1u << l)
+            gang_alone(g, l, pc);
+}
+
+/* a branch of the group to target, taken by the lanes in taken, g->pc
+   already is the next instruction. The larger side stays, returns the pc
+   of the lanes that left */
+unsigned int gang_branch(MIPS_gang *g, unsigned int taken, unsigned int target)
+{
+    unsigned int next = g->pc;
+    unsigned int stay, n = 0, k = 0;
+    int l;
+
+    if (taken == 0)
+        return GANG_NONE;
+    if (taken == g->in)
+    {
+        g->branches++;
+        g->pc = target;
+        return GANG_NONE;
+    }
+
+    for (l = 0; l < GANG_LANES; l++)
+    {
+        n += g->in >> l & 1;
+        k += taken >> l & 1;
+    }
+    stay = k * 2 >= n ? taken : g->in & ~taken;
+
+    for (l = 0; l < GANG_LANES; l++)
+    {
+        if (!(g->in & ~stay & 1u << l))
+            continue;
+        if (taken & 1u << l)
+            g->lanes[l]->state.branches++;
+        gang_finish(g, l, taken & 1u << l ? target : next);
+    }
+
+    if (stay == taken)
+    {
+        g->branches++;
+        g->pc = target;
+        return next;
+    }
+    return target;
+}
+
+/* jr/jalr of the group, lanes that go elsewhere than the lead leave */
+unsigned int gang_jump(MIPS_gang *g, unsigned int rs, int link)
+{
+    unsigned int target = GANG_AT(g->regs[rs], g->lead);
+    unsigned int left = GANG_NONE;
+    int l;
+
+    /* jalr links to its own target */
+    if (link)
+        g->regs[31] = g->regs[rs];
+
+    for (l = 0; l < GANG_LANES; l++)
+    {
+        unsigned int to = GANG_AT(g->regs[rs], l);
+
+        if (!(g->in & 1u << l) || to == target)
+            continue;
+        g->lanes[l]->state.branches++;
+        gang_finish(g, l, to);
+        if (to < left)
+            left = to;
+    }
+
+    g->branches++;
+    g->pc = target;
+    return left;
+}
+
+/* the group runs until it reaches minout, the lowest pc of a lane outside
+   it, or has to break up */
+void gang_vector(MIPS_gang *g, unsigned int minout)
+{
+    unsigned int address, left;
+    int l;
+
+    while (g->in != 0 && g->pc < minout && g->steps < g->limit)
+    {
+        unsigned int pc = g->pc;
+        unsigned int instruction, rs, rt, rd, shift, immediate;
+        unsigned int taken = 0;
+
+        if (pc >> MEM_PAGE_SHIFT != g->page)
+        {
+            if (!gang_same(g, pc))
+                break;
+            g->page = pc >> MEM_PAGE_SHIFT;
+        }
+
+        instruction = mem_fetch(&g->lanes[g->lead]->mem, pc);
+        rs = instruction >> 21 & 0x1f;
+        rt = instruction >> 16 & 0x1f;
+        rd = instruction >> 11 & 0x1f;
+        shift = instruction >> 6 & 0x1f;
+        immediate = instruction & 0xffff;
+        left = GANG_NONE;
+        g->pc = pc + 4;
+
+        switch (instruction >> 26 & 0x3f)
+        {
+            case 0x00:
+                switch (instruction & 0x3f)
+                {
+                    case 0x00: /* sll */
+                        GANG_MAP(g->regs[rd], GANG_X(g->regs[rt]) << shift);
+                    break;
+                    case 0x02: /* srl */
+                    case 0x03: /* sra, execute() shifts in zeros as well */
+                        GANG_MAP(g->regs[rd], GANG_X(g->regs[rt]) >> shift);
+                    break;
+                    case 0x04: /* sllv */
+                        GANG_MAP(g->regs[rd], GANG_X(g->regs[rt]) << (GANG_X(g->regs[rs]) & 0x1f));
+                    break;
+                    case 0x06: /* srlv */
+                    case 0x07: /* srav */
+                        GANG_MAP(g->regs[rd], GANG_X(g->regs[rt]) >> (GANG_X(g->regs[rs]) & 0x1f));
+                    break;
+                    case 0x08: /* jr, jr $ra stops the guest */
+                        if (rs == 31)
+                        {
+                            gang_each(g, pc);
+                            return;
+                        }
+                        left = gang_jump(g, rs, 0);
+                    break;
+                    case 0x09: /* jalr */
+                        left = gang_jump(g, rs, 1);
+                    break;
+                    case 0x0a: /* movz */
+                        GANG_MAP(g->regs[rd], GANG_SELECT(GANG_X(g->regs[rt]) == 0, GANG_X(g->regs[rs]), GANG_X(g->regs[rd])));
+                    break;
+                    case 0x0b: /* movn */
+                        GANG_MAP(g->regs[rd], GANG_SELECT(GANG_X(g->regs[rt]) != 0, GANG_X(g->regs[rs]), GANG_X(g->regs[rd])));
+                    break;
+                    case 0x10: /* mfhi */
+                        g->regs[rd] = g->hi;
+                    break;
+                    case 0x11: /* mthi */
+                        g->hi = g->regs[rs];
+                    break;
+                    case 0x12: /* mflo */
+                        g->regs[rd] = g->lo;
+                    break;
+                    case 0x13: /* mtlo */
+                        g->lo = g->regs[rs];
+                    break;
+                    case 0x18: /* mult, the same as multu in execute() */
+                    case 0x19: /* multu */
+                        for (l = 0; l < GANG_LANES; l++)
+                        {
+                            unsigned long long product = (unsigned long long)GANG_AT(g->regs[rs], l) * GANG_AT(g->regs[rt], l);
+                            GANG_AT(g->lo, l) = (unsigned int)product;
+                            GANG_AT(g->hi, l) = (unsigned int)(product >> 32);
+                        }
+                    break;
+                    case 0x20: /* add, never overflows in execute() */
+                    case 0x21: /* addu */
+                        GANG_MAP(g->regs[rd], GANG_X(g->regs[rs]) + GANG_X(g->regs[rt]));
+                    break;
+                    case 0x22: /* sub */
+                    case 0x23: /* subu */
+                        GANG_MAP(g->regs[rd], GANG_X(g->regs[rs]) - GANG_X(g->regs[rt]));
+                    break;
+                    case 0x24: /* and */
+                        GANG_MAP(g->regs[rd], GANG_X(g->regs[rs]) & GANG_X(g->regs[rt]));
+                    break;
+                    case 0x25: /* or */
+                        GANG_MAP(g->regs[rd], GANG_X(g->regs[rs]) | GANG_X(g->regs[rt]));
+                    break;
+                    case 0x26: /* xor */
+                        GANG_MAP(g->regs[rd], GANG_X(g->regs[rs]) ^ GANG_X(g->regs[rt]));
+                    break;
+                    case 0x27: /* nor */
+                        GANG_MAP(g->regs[rd], ~(GANG_X(g->regs[rs]) | GANG_X(g->regs[rt])));
+                    break;
+                    case 0x2a: /* slt, unsigned like sltu in execute() */
+                    case 0x2b: /* sltu */
+                        GANG_MAP(g->regs[rd], GANG_LESS(GANG_X(g->regs[rs]), GANG_X(g->regs[rt])));
+                    break;
+                    default:
+                        gang_each(g, pc);
+                        return;
+                }
+            break;
+            case 0x01: /* bltz never and bgez always taken, chosen by the value of rt */
+                for (l = 0; l < GANG_LANES; l++)
+                    if (g->in & 1u << l && GANG_AT(g->regs[rt], l) == 1)
+                        taken |= 1u << l;
+                left = gang_branch(g, taken, pc + (immediate << 2));
+            break;
+            case 0x02: /* j */
+            case 0x03: /* jal */
+                address = ((instruction & 0x3ffffff) << 2 | (pc & 0xf) << 28) + 4;
+                if (instruction >> 26 == 0x03)
+                    for (l = 0; l < GANG_LANES; l++)
+                        GANG_AT(g->regs[31], l) = address;
+                g->branches++;
+                g->pc = address;
+            break;
+            case 0x04: /* beq */
+            case 0x05: /* bne */
+            case 0x06: /* blez, unsigned: equal to zero */
+            case 0x07: /* bgtz, unsigned: not zero */
+                for (l = 0; l < GANG_LANES; l++)
+                {
+                    unsigned int a = GANG_AT(g->regs[rs], l);
+                    unsigned int b = instruction >> 27 & 1 ? 0 : GANG_AT(g->regs[rt], l);
+                    if (g->in & 1u << l && (a == b) == !(instruction >> 26 & 1))
+                        taken |= 1u << l;
+                }
+                left = gang_branch(g, taken, pc + (immediate << 2));
+            break;
+            case 0x08: /* addi, immediates are zero extended */
+            case 0x09: /* addiu */
+                GANG_MAP(g->regs[rt], GANG_X(g->regs[rs]) + immediate);
+            break;
+            case 0x0a: /* slti */
+            case 0x0b: /* sltiu */
+                GANG_MAP(g->regs[rt], GANG_LESS(GANG_X(g->regs[rs]), immediate));
+            break;
+            case 0x0c: /* andi */
+                GANG_MAP(g->regs[rt], GANG_X(g->regs[rs]) & immediate);
+            break;
+            case 0x0d: /* ori */
+                GANG_MAP(g->regs[rt], GANG_X(g->regs[rs]) | immediate);
+            break;
+            case 0x0e: /* xori */
+                GANG_MAP(g->regs[rt], GANG_X(g->regs[rs]) ^ immediate);
+            break;
+            case 0x0f: /* lui, execute() leaves 0 */
+                g->regs[rt] = g->regs[0];
+            break;
+            case 0x20: /* lb */
+            case 0x21: /* lh */
+            case 0x23: /* lw */
+            case 0x24: /* lbu */
+            case 0x25: /* lhu */
+                for (l = 0; l < GANG_LANES; l++)
+                {
+                    MIPS_mem *mem = &g->lanes[l]->mem;
+
+                    if (!(g->in & 1u << l))
+                        continue;
+                    address = GANG_AT(g->regs[rs], l) + immediate;
+                    if (mem_io(mem, address) != 0)
+                    {
+                        if (gang_alone(g, l, pc) < left)
+                            left = g->lanes[l]->state.pc;
+                        continue;
+                    }
+                    switch (instruction >> 26 & 0x3f)
+                    {
+                        case 0x20:
+                            GANG_AT(g->regs[rt], l) = loadmemb(mem, address);
+                        break;
+                        case 0x21:
+                            GANG_AT(g->regs[rt], l) = loadmemh(mem, address);
+                        break;
+                        case 0x23:
+                            GANG_AT(g->regs[rt], l) = loadmemw(mem, address);
+                        break;
+                        case 0x24:
+                            GANG_AT(g->regs[rt], l) = loadmembu(mem, address);
+                        break;
+                        case 0x25:
+                            GANG_AT(g->regs[rt], l) = loadmemhu(mem, address);
+                        break;
+                    }
+                }
+                g->loads++;
+            break;
+            case 0x28: /* sb */
+            case 0x29: /* sh */
+            case 0x2b: /* sw */
+                for (l = 0; l < GANG_LANES; l++)
+                {
+                    MIPS_mem *mem = &g->lanes[l]->mem;
+
+                    if (!(g->in & 1u << l))
+                        continue;
+                    address = GANG_AT(g->regs[rs], l) + immediate;
+                    if (mem_io(mem, address) != 0)
+                    {
+                        if (gang_alone(g, l, pc) < left)
+                            left = g->lanes[l]->state.pc;
+                        continue;
+                    }
+                    if (instruction >> 26 == 0x28)
+                        storememb(mem, address, GANG_AT(g->regs[rt], l));
+                    else if (instruction >> 26 == 0x29)
+                        storememh(mem, address, GANG_AT(g->regs[rt], l));
+                    else
+                        storememw(mem, address, GANG_AT(g->regs[rt], l));
+                }
+                g->stores++;
+            break;
+            default:
+                gang_each(g, pc);
+                return;
+        }
+
+        /* the epilogue of execute(), events are never due in the group */
+        memset(&g->regs[0], 0, sizeof(MIPS_vec));
+        g->steps++;
+        if (left < minout)
+            minout = left;
+    }
+
+    /* a page that differs or a lane that needs to run alone */
+    if (g->in != 0 && g->pc < minout)
+        gang_split(g);
+}
+
+/* runs every lane until it stops or has used up its budget, returns the
+   number of lanes that stopped */
+int gang_run(MIPS_gang *g)
+{
+    int stopped = 0;
+    int l;
+
+    for (l = 0; l < GANG_PAGES; l++)
+        g->pages[l] = GANG_NONE;
+    g->page = GANG_NONE;
+    g->in = 0;
+
+    for (l = 0; l < GANG_LANES; l++)
+    {
+        if (g->lanes[l] == NULL)
+            continue;
+        g->codewrite[l] = g->lanes[l]->mem.codewrite;
+        g->cache[l] = g->lanes[l]->mem.cache;
+        g->lanes[l]->mem.codewrite = gang_store;
+        g->lanes[l]->mem.cache = g;
+    }
+
+    for (;;)
+    {
+        unsigned int pc = g->pc;
+        unsigned int minout = GANG_NONE;
+        int any = g->in != 0;
+
+        /* without a group the lowest pc goes first */
+        for (l = 0; g->in == 0 && l < GANG_LANES; l++)
+            if (gang_ready(g, l) && (!any || g->lanes[l]->state.pc < pc))
+            {
+                pc = g->lanes[l]->state.pc;
+                any = 1;
+            }
+        if (!any)
+            break;
+
+        /* lanes behind catch up, at pc they join or run alone */
+        for (l = 0; l < GANG_LANES; l++)
+        {
+            MIPS_machine *m = g->lanes[l];
+
+            while (gang_ready(g, l) && m->state.pc < pc)
+                gang_step(g, l);
+            if (gang_ready(g, l) && m->state.pc == pc && !gang_join(g, l))
+                gang_solo(g, l);
+            if (gang_ready(g, l) && m->state.pc < minout)
+                minout = m->state.pc;
+        }
+
+        if (g->in != 0)
+            gang_vector(g, minout);
+    }
+
+    for (l = 0; l < GANG_LANES; l++)
+    {
+        MIPS_machine *m = g->lanes[l];
+
+        if (m == NULL)
+            continue;
+        m->mem.codewrite = g->codewrite[l];
+        m->mem.cache = g->cache[l];
+        m->state.cp0regs[9] = cp0_count(&m->state);
+        perf_sync(&m->state, &m->mem);
+        stopped += g->stopped[l];
+    }
+
+    return stopped;
+}
+
+#endif
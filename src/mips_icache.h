@@ -0,0 +1,934 @@
+/* MIPS Emulator - predecoded instruction cache */
+/* Copyright 2024 Daniil Dunaef */
+
+#ifndef MIPS_ICACHE
+#define MIPS_ICACHE
+
+#include <string.h>
+#include "mips.h"
+
+/* @note Every cached entry keeps the fields that execute() would extract
+    with decodeR()/decodeI()/decodeJ() plus a handler for its opcode/funct,
+    so a cache hit skips both the memory fetch and the decode.
+    Handlers mirror the cases of execute() one to one; execute() stays the
+    reference implementation.
+    Fetches mark their page with mem_code(), the owner must point
+    mem->codewrite at icache_store() so that stores into such a page drop
+    its entries.
+    icache_run() is threaded on GNU C: every entry also gets the number
+    of a label in the run loop, common instructions are inlined there and
+    each one jumps straight to the next. Their epilogue only counts the
+    clock and moves the pc; events, pending exceptions and writes to $zero
+    (which predecode sends to the handler) take the full cp0_update().
+    Strict C89 builds loop over icache_step() instead.
+*/
+
+#define ICACHE_SIZE 4096 /* entries, power of two and >= 1024 */
+#define ICACHE_PAGE_SHIFT 12
+
+#if defined(__GNUC__) && !defined(__STRICT_ANSI__)
+#define ICACHE_THREADED
+#endif
+
+/* labels of the threaded loop, see icache_run() */
+#define ICACHE_CALL 0
+#define ICACHE_NOP 1
+#define ICACHE_SLL 2
+#define ICACHE_SRL 3
+#define ICACHE_SLLV 4
+#define ICACHE_SRLV 5
+#define ICACHE_JR 6
+#define ICACHE_JALR 7
+#define ICACHE_MFHI 8
+#define ICACHE_MFLO 9
+#define ICACHE_ADDU 10
+#define ICACHE_SUBU 11
+#define ICACHE_AND 12
+#define ICACHE_OR 13
+#define ICACHE_XOR 14
+#define ICACHE_NOR 15
+#define ICACHE_SLT 16
+#define ICACHE_J 17
+#define ICACHE_JAL 18
+#define ICACHE_BEQ 19
+#define ICACHE_BNE 20
+#define ICACHE_BLEZ 21
+#define ICACHE_BGTZ 22
+#define ICACHE_ADDIU 23
+#define ICACHE_SLTI 24
+#define ICACHE_ANDI 25
+#define ICACHE_ORI 26
+#define ICACHE_XORI 27
+#define ICACHE_LB 28
+#define ICACHE_LH 29
+#define ICACHE_LW 30
+#define ICACHE_LBU 31
+#define ICACHE_LHU 32
+#define ICACHE_SB 33
+#define ICACHE_SH 34
+#define ICACHE_SW 35
+#define ICACHE_THREADS 36
+
+struct _MIPS_decoded;
+
+typedef int (*MIPS_handler)(MIPS_state *state, const struct _MIPS_decoded *d, MIPS_mem *mem);
+
+typedef struct _MIPS_decoded
+{
+    unsigned int pc;
+    unsigned int instruction;
+    MIPS_handler handler;
+    unsigned int address;
+    unsigned short immediate;
+    unsigned char opcode;
+    unsigned char rs;
+    unsigned char rt;
+    unsigned char rd;
+    unsigned char shift;
+    unsigned char funct;
+    unsigned char thread; /* label of icache_run(), ICACHE_CALL for the handler */
+} MIPS_decoded;
+
+typedef struct _MIPS_icache
+{
+    MIPS_decoded entries[ICACHE_SIZE];
+    MIPS_decoded uncached; /* fetches from MMIO are never cached */
+} MIPS_icache;
+
+/* R format */
+int op_sll(MIPS_state *state, const MIPS_decoded *d, MIPS_mem *mem)
+{
+    state->regs[d->rd] = state->regs[d->rt] << d->shift;
+    return 0;
+}
+
+int op_srl(MIPS_state *state, const MIPS_decoded *d, MIPS_mem *mem)
+{
+    state->regs[d->rd] = state->regs[d->rt] >> d->shift;
+    return 0;
+}
+
+int op_sra(MIPS_state *state, const MIPS_decoded *d, MIPS_mem *mem)
+{
+    state->regs[d->rd] = (unsigned)state->regs[d->rt] >> d->shift;
+    return 0;
+}
+
+int op_sllv(MIPS_state *state, const MIPS_decoded *d, MIPS_mem *mem)
+{
+    state->regs[d->rd] = state->regs[d->rt] << (state->regs[d->rs] & 0x1f);
+    return 0;
+}
+
+int op_srlv(MIPS_state *state, const MIPS_decoded *d, MIPS_mem *mem)
+{
+    state->regs[d->rd] = state->regs[d->rt] >> (state->regs[d->rs] & 0x1f);
+    return 0;
+}
+
+int op_srav(MIPS_state *state, const MIPS_decoded *d, MIPS_mem *mem)
+{
+    state->regs[d->rd] = state->regs[d->rt] >> (state->regs[d->rs] & 0x1f);
+    return 0;
+}
+
+int op_jr(MIPS_state *state, const MIPS_decoded *d, MIPS_mem *mem)
+{
+    state->branches++;
+    state->pc = state->regs[d->rs] - 4;
+    if (d->rs == 31)
+    {
+        state->stop = STOP_HALT;
+        return 5;
+    }
+    return 0;
+}
+
+int op_jalr(MIPS_state *state, const MIPS_decoded *d, MIPS_mem *mem)
+{
+    state->branches++;
+    state->pc = state->regs[d->rs] - 4;
+    state->regs[31] = state->pc + 4;
+    return 0;
+}
+
+int op_movz(MIPS_state *state, const MIPS_decoded *d, MIPS_mem *mem)
+{
+    if (state->regs[d->rt] == 0)
+        state->regs[d->rd] = state->regs[d->rs];
+    return 0;
+}
+
+int op_movn(MIPS_state *state, const MIPS_decoded *d, MIPS_mem *mem)
+{
+    if (state->regs[d->rt] != 0)
+        state->regs[d->rd] = state->regs[d->rs];
+    return 0;
+}
+
+int op_syscall(MIPS_state *state, const MIPS_decoded *d, MIPS_mem *mem)
+{
+    if (syscall_handler(state, mem) == 5)
+        return 5;
+    state->pc = 0xbfc0380;
+    return 0;
+}
+
+int op_break(MIPS_state *state, const MIPS_decoded *d, MIPS_mem *mem)
+{
+    state->stop = STOP_BREAK;
+    return 5;
+}
+
+int op_mfhi(MIPS_state *state, const MIPS_decoded *d, MIPS_mem *mem)
+{
+    state->regs[d->rd] = state->hi;
+    return 0;
+}
+
+int op_mthi(MIPS_state *state, const MIPS_decoded *d, MIPS_mem *mem)
+{
+    state->hi = state->regs[d->rs];
+    return 0;
+}
+
+int op_mflo(MIPS_state *state, const MIPS_decoded *d, MIPS_mem *mem)
+{
+    state->regs[d->rd] = state->lo;
+    return 0;
+}
+
+int op_mtlo(MIPS_state *state, const MIPS_decoded *d, MIPS_mem *mem)
+{
+    state->lo = state->regs[d->rs];
+    return 0;
+}
+
+int op_mult(MIPS_state *state, const MIPS_decoded *d, MIPS_mem *mem)
+{
+    state->lo = (state->regs[d->rs] * state->regs[d->rt]) & 0xffffffff;
+    state->hi = ((long long)state->regs[d->rs] * (long long)state->regs[d->rt] >> 32) & 0xffffffff;
+    return 0;
+}
+
+int op_multu(MIPS_state *state, const MIPS_decoded *d, MIPS_mem *mem)
+{
+    state->lo = ((unsigned)state->regs[d->rs] * (unsigned)state->regs[d->rt]) & 0xffffffff;
+    state->hi = ((unsigned long long)state->regs[d->rs] * (unsigned long long)state->regs[d->rt] >> 32) & 0xffffffff;
+    return 0;
+}
+
+int op_div(MIPS_state *state, const MIPS_decoded *d, MIPS_mem *mem)
+{
+    state->lo = state->regs[d->rs] / state->regs[d->rt];
+    state->hi = state->regs[d->rs] % state->regs[d->rt];
+    return 0;
+}
+
+int op_divu(MIPS_state *state, const MIPS_decoded *d, MIPS_mem *mem)
+{
+    state->lo = (unsigned)state->regs[d->rs] / (unsigned)state->regs[d->rt];
+    state->hi = (unsigned)state->regs[d->rs] % (unsigned)state->regs[d->rt];
+    return 0;
+}
+
+int op_madd(MIPS_state *state, const MIPS_decoded *d, MIPS_mem *mem)
+{
+    long long temp = (state->hi | state->lo) + ((long long)state->regs[d->rs] * (long long)state->regs[d->rt]);
+    state->lo = temp & 0xffffffff;
+    state->hi = (temp << 32) & 0xffffffff;
+    return 0;
+}
+
+int op_add(MIPS_state *state, const MIPS_decoded *d, MIPS_mem *mem)
+{
+    if ((state->regs[d->rs] > 0 && state->regs[d->rt] > 0 && (state->regs[d->rs] + state->regs[d->rt]) < 0) ||
+    (state->regs[d->rs] < 0 && state->regs[d->rt] < 0 && (state->regs[d->rs] + state->regs[d->rt]) > 0))
+        state->exception = 12;
+    state->regs[d->rd] = state->regs[d->rs] + state->regs[d->rt];
+    return 0;
+}
+
+int op_addu(MIPS_state *state, const MIPS_decoded *d, MIPS_mem *mem)
+{
+    state->regs[d->rd] = (unsigned)state->regs[d->rs] + (unsigned)state->regs[d->rt];
+    return 0;
+}
+
+int op_sub(MIPS_state *state, const MIPS_decoded *d, MIPS_mem *mem)
+{
+    if ((state->regs[d->rs] > 0 && state->regs[d->rt] < 0 && (state->regs[d->rs] + state->regs[d->rt]) < 0) ||
+    (state->regs[d->rs] < 0 && state->regs[d->rt] > 0 && (state->regs[d->rs] + state->regs[d->rt]) > 0))
+        state->exception = 12;
+    state->regs[d->rd] = state->regs[d->rs] - state->regs[d->rt];
+    return 0;
+}
+
+int op_subu(MIPS_state *state, const MIPS_decoded *d, MIPS_mem *mem)
+{
+    state->regs[d->rd] = (unsigned)state->regs[d->rs] - (unsigned)state->regs[d->rt];
+    return 0;
+}
+
+int op_and(MIPS_state *state, const MIPS_decoded *d, MIPS_mem *mem)
+{
+    state->regs[d->rd] = state->regs[d->rs] & state->regs[d->rt];
+    return 0;
+}
+
+int op_or(MIPS_state *state, const MIPS_decoded *d, MIPS_mem *mem)
+{
+    state->regs[d->rd] = state->regs[d->rs] | state->regs[d->rt];
+    return 0;
+}
+
+int op_xor(MIPS_state *state, const MIPS_decoded *d, MIPS_mem *mem)
+{
+    state->regs[d->rd] = state->regs[d->rs] ^ state->regs[d->rt];
+    return 0;
+}
+
+int op_nor(MIPS_state *state, const MIPS_decoded *d, MIPS_mem *mem)
+{
+    state->regs[d->rd] = ~(state->regs[d->rs] | state->regs[d->rt]);
+    return 0;
+}
+
+int op_slt(MIPS_state *state, const MIPS_decoded *d, MIPS_mem *mem)
+{
+    state->regs[d->rd] = state->regs[d->rs] < state->regs[d->rt] ? 1 : 0;
+    return 0;
+}
+
+int op_sltu(MIPS_state *state, const MIPS_decoded *d, MIPS_mem *mem)
+{
+    state->regs[d->rd] = (unsigned)state->regs[d->rs] < (unsigned)state->regs[d->rt] ? 1 : 0;
+    return 0;
+}
+
+int op_tge(MIPS_state *state, const MIPS_decoded *d, MIPS_mem *mem)
+{
+    if (state->regs[d->rs] >= state->regs[d->rt])
+        state->exception = 1;
+    return 0;
+}
+
+int op_tgeu(MIPS_state *state, const MIPS_decoded *d, MIPS_mem *mem)
+{
+    if ((unsigned)state->regs[d->rs] >= (unsigned)state->regs[d->rt])
+        state->exception = 1;
+    return 0;
+}
+
+int op_tlt(MIPS_state *state, const MIPS_decoded *d, MIPS_mem *mem)
+{
+    if (state->regs[d->rs] < state->regs[d->rt])
+        state->exception = 1;
+    return 0;
+}
+
+int op_tltu(MIPS_state *state, const MIPS_decoded *d, MIPS_mem *mem)
+{
+    if ((unsigned)state->regs[d->rs] < (unsigned)state->regs[d->rt])
+        state->exception = 1;
+    return 0;
+}
+
+int op_teq(MIPS_state *state, const MIPS_decoded *d, MIPS_mem *mem)
+{
+    if (state->regs[d->rs] == state->regs[d->rt])
+        state->exception = 12;
+    return 0;
+}
+
+int op_tne(MIPS_state *state, const MIPS_decoded *d, MIPS_mem *mem)
+{
+    if (state->regs[d->rs] != state->regs[d->rt])
+        state->exception = 12;
+    return 0;
+}
+
+/* I and J format */
+int op_nop(MIPS_state *state, const MIPS_decoded *d, MIPS_mem *mem)
+{
+    return 0;
+}
+
+int op_regimm(MIPS_state *state, const MIPS_decoded *d, MIPS_mem *mem)
+{
+    if (state->regs[d->rt] == 0) /* bltz */
+    {
+        if (state->regs[d->rs] < 0)
+        {
+            state->branches++;
+            state->pc += (d->immediate << 2) - 4;
+        }
+    }
+    else if (state->regs[d->rt] == 1) /* bgez */
+    {
+        if (state->regs[d->rs] >= 0)
+        {
+            state->branches++;
+            state->pc += (d->immediate << 2) - 4;
+        }
+    }
+    return 0;
+}
+
+int op_j(MIPS_state *state, const MIPS_decoded *d, MIPS_mem *mem)
+{
+    state->branches++;
+    state->pc = (d->address << 2) | ((state->pc & 0xf) << 28);
+    return 0;
+}
+
+int op_jal(MIPS_state *state, const MIPS_decoded *d, MIPS_mem *mem)
+{
+    state->branches++;
+    state->pc = (d->address << 2) | ((state->pc & 0xf) << 28);
+    state->regs[31] = state->pc + 4;
+    return 0;
+}
+
+int op_beq(MIPS_state *state, const MIPS_decoded *d, MIPS_mem *mem)
+{
+    if (state->regs[d->rs] == state->regs[d->rt])
+    {
+        state->branches++;
+        state->pc += (d->immediate << 2) - 4;
+    }
+    return 0;
+}
+
+int op_bne(MIPS_state *state, const MIPS_decoded *d, MIPS_mem *mem)
+{
+    if (state->regs[d->rs] != state->regs[d->rt])
+    {
+        state->branches++;
+        state->pc += (d->immediate << 2) - 4;
+    }
+    return 0;
+}
+
+int op_blez(MIPS_state *state, const MIPS_decoded *d, MIPS_mem *mem)
+{
+    if (state->regs[d->rs] <= 0)
+    {
+        state->branches++;
+        state->pc += (d->immediate << 2) - 4;
+    }
+    return 0;
+}
+
+int op_bgtz(MIPS_state *state, const MIPS_decoded *d, MIPS_mem *mem)
+{
+    if (state->regs[d->rs] > 0)
+    {
+        state->branches++;
+        state->pc += (d->immediate << 2) - 4;
+    }
+    return 0;
+}
+
+int op_addi(MIPS_state *state, const MIPS_decoded *d, MIPS_mem *mem)
+{
+    state->regs[d->rt] = state->regs[d->rs] + d->immediate;
+    return 0;
+}
+
+int op_addiu(MIPS_state *state, const MIPS_decoded *d, MIPS_mem *mem)
+{
+    state->regs[d->rt] = (unsigned)state->regs[d->rs] + d->immediate;
+    return 0;
+}
+
+int op_slti(MIPS_state *state, const MIPS_decoded *d, MIPS_mem *mem)
+{
+    state->regs[d->rt] = state->regs[d->rs] < d->immediate ? 1 : 0;
+    return 0;
+}
+
+int op_sltiu(MIPS_state *state, const MIPS_decoded *d, MIPS_mem *mem)
+{
+    state->regs[d->rt] = (unsigned)state->regs[d->rs] < d->immediate ? 1 : 0;
+    return 0;
+}
+
+int op_andi(MIPS_state *state, const MIPS_decoded *d, MIPS_mem *mem)
+{
+    state->regs[d->rt] = state->regs[d->rs] & d->immediate;
+    return 0;
+}
+
+int op_ori(MIPS_state *state, const MIPS_decoded *d, MIPS_mem *mem)
+{
+    state->regs[d->rt] = state->regs[d->rs] | d->immediate;
+    return 0;
+}
+
+int op_xori(MIPS_state *state, const MIPS_decoded *d, MIPS_mem *mem)
+{
+    state->regs[d->rt] = state->regs[d->rs] ^ d->immediate;
+    return 0;
+}
+
+int op_lui(MIPS_state *state, const MIPS_decoded *d, MIPS_mem *mem)
+{
+    state->regs[d->rt] = d->immediate << 16;
+    state->regs[d->rt] &= 0xffff;
+    return 0;
+}
+
+int op_cop0(MIPS_state *state, const MIPS_decoded *d, MIPS_mem *mem)
+{
+    if (state->mmu)
+        cp0_mmu(state, mem, d->instruction);
+    else if (state->regs[d->rs] == 0) /* mfc0 */
+        state->regs[d->rt] = cp0_load(state, mem, d->rd);
+    else if (state->regs[d->rs] == 4 &&  /* mtc0 (only kernel can write to certain cp0 registers) */
+    (((state->regs[d->rd] == 0 || state->regs[d->rd] == 1 || state->regs[d->rd] == 2 || state->regs[d->rd] == 4 || state->regs[d->rd] == 8 ||
+    state->regs[d->rd] == 10 || state->regs[d->rd] == 12 || state->regs[d->rd] == 13 || state->regs[d->rd] == 14 || state->regs[d->rd] == 15) && state->mode == 1) || state->mode == 0))
+        cp0_store(state, mem, d->rd, state->regs[d->rt]);
+    return 0;
+}
+
+int op_eret(MIPS_state *state, const MIPS_decoded *d, MIPS_mem *mem)
+{
+    cp0_eret(state);
+    return 0;
+}
+
+int op_lb(MIPS_state *state, const MIPS_decoded *d, MIPS_mem *mem)
+{
+    state->loads++;
+    state->regs[d->rt] = loadmemb(mem, state->regs[d->rs] + d->immediate);
+    return 0;
+}
+
+int op_lh(MIPS_state *state, const MIPS_decoded *d, MIPS_mem *mem)
+{
+    state->loads++;
+    state->regs[d->rt] = loadmemh(mem, state->regs[d->rs] + d->immediate);
+    return 0;
+}
+
+int op_lwl(MIPS_state *state, const MIPS_decoded *d, MIPS_mem *mem)
+{
+    state->loads++;
+    state->regs[d->rt] = (loadmemw(mem, (state->regs[d->rs] + d->immediate & 0xfffffffc)) << (8 * (3 - (state->regs[d->rs] + d->immediate & 0xfffffffc) & 0x03)));
+    return 0;
+}
+
+int op_lw(MIPS_state *state, const MIPS_decoded *d, MIPS_mem *mem)
+{
+    state->loads++;
+    state->regs[d->rt] = loadmemw(mem, state->regs[d->rs] + d->immediate);
+    return 0;
+}
+
+int op_lbu(MIPS_state *state, const MIPS_decoded *d, MIPS_mem *mem)
+{
+    state->loads++;
+    state->regs[d->rt] = loadmembu(mem, state->regs[d->rs] + d->immediate);
+    return 0;
+}
+
+int op_lhu(MIPS_state *state, const MIPS_decoded *d, MIPS_mem *mem)
+{
+    state->loads++;
+    state->regs[d->rt] = loadmemhu(mem, state->regs[d->rs] + d->immediate);
+    return 0;
+}
+
+int op_lwr(MIPS_state *state, const MIPS_decoded *d, MIPS_mem *mem)
+{
+    state->loads++;
+    state->regs[d->rt] = (loadmemw(mem, (state->regs[d->rs] + d->immediate & 0xfffffffc)) >> (8 * ((state->regs[d->rs] + d->immediate & 0xfffffffc) & 0x03)));
+    return 0;
+}
+
+int op_sb(MIPS_state *state, const MIPS_decoded *d, MIPS_mem *mem)
+{
+    state->stores++;
+    storememb(mem, state->regs[d->rs] + d->immediate, state->regs[d->rt]);
+    return 0;
+}
+
+int op_sh(MIPS_state *state, const MIPS_decoded *d, MIPS_mem *mem)
+{
+    state->stores++;
+    storememh(mem, state->regs[d->rs] + d->immediate, state->regs[d->rt]);
+    return 0;
+}
+
+int op_sw(MIPS_state *state, const MIPS_decoded *d, MIPS_mem *mem)
+{
+    state->stores++;
+    storememw(mem, state->regs[d->rs] + d->immediate, state->regs[d->rt]);
+    return 0;
+}
+
+/* funct table for opcode 0x00 */
+const MIPS_handler special_handlers[64] =
+{
+    op_sll,  op_nop,   op_srl,  op_sra,  op_sllv,    op_nop,   op_srlv, op_srav, /* 0x00 */
+    op_jr,   op_jalr,  op_movz, op_movn, op_syscall, op_break, op_nop,  op_nop,  /* 0x08 */
+    op_mfhi, op_mthi,  op_mflo, op_mtlo, op_nop,     op_nop,   op_nop,  op_nop,  /* 0x10 */
+    op_mult, op_multu, op_div,  op_divu, op_madd,    op_nop,   op_nop,  op_nop,  /* 0x18 */
+    op_add,  op_addu,  op_sub,  op_subu, op_and,     op_or,    op_xor,  op_nor,  /* 0x20 */
+    op_nop,  op_nop,   op_slt,  op_sltu, op_nop,     op_nop,   op_nop,  op_nop,  /* 0x28 */
+    op_tge,  op_tgeu,  op_tlt,  op_tltu, op_teq,     op_nop,   op_tne,  op_nop,  /* 0x30 */
+    op_nop,  op_nop,   op_nop,  op_nop,  op_nop,     op_nop,   op_nop,  op_nop   /* 0x38 */
+};
+
+/* opcode table, 0x00 dispatches through special_handlers */
+const MIPS_handler opcode_handlers[64] =
+{
+    op_nop,  op_regimm, op_j,    op_jal,   op_beq,  op_bne,  op_blez, op_bgtz, /* 0x00 */
+    op_addi, op_addiu,  op_slti, op_sltiu, op_andi, op_ori,  op_xori, op_lui,  /* 0x08 */
+    op_cop0, op_nop,    op_nop,  op_nop,   op_nop,  op_nop,  op_nop,  op_nop,  /* 0x10 */
+    op_eret, op_nop,    op_nop,  op_nop,   op_nop,  op_nop,  op_nop,  op_nop,  /* 0x18 */
+    op_lb,   op_lh,     op_lwl,  op_lw,    op_lbu,  op_lhu,  op_lwr,  op_nop,  /* 0x20 */
+    op_sb,   op_sh,     op_nop,  op_sw,    op_nop,  op_nop,  op_nop,  op_nop,  /* 0x28 */
+    op_nop,  op_nop,    op_nop,  op_nop,   op_nop,  op_nop,  op_nop,  op_nop,  /* 0x30 */
+    op_nop,  op_nop,    op_nop,  op_nop,   op_nop,  op_nop,  op_nop,  op_nop   /* 0x38 */
+};
+
+/* funct and opcode tables of labels, entries that write a register name it
+   in the high bit so predecode can send writes to $zero to the handler */
+#define ICACHE_RD 0x80
+#define ICACHE_RT 0x40
+
+const unsigned char special_threads[64] =
+{
+    ICACHE_SLL | ICACHE_RD, ICACHE_NOP, ICACHE_SRL | ICACHE_RD, ICACHE_SRL | ICACHE_RD, /* 0x00 */
+    ICACHE_SLLV | ICACHE_RD, ICACHE_NOP, ICACHE_SRLV | ICACHE_RD, ICACHE_SRLV | ICACHE_RD,
+    ICACHE_JR, ICACHE_JALR, ICACHE_CALL, ICACHE_CALL, ICACHE_CALL, ICACHE_CALL, ICACHE_NOP, ICACHE_NOP, /* 0x08 */
+    ICACHE_MFHI | ICACHE_RD, ICACHE_CALL, ICACHE_MFLO | ICACHE_RD, ICACHE_CALL, ICACHE_NOP, ICACHE_NOP, ICACHE_NOP, ICACHE_NOP, /* 0x10 */
+    ICACHE_CALL, ICACHE_CALL, ICACHE_CALL, ICACHE_CALL, ICACHE_CALL, ICACHE_NOP, ICACHE_NOP, ICACHE_NOP, /* 0x18 */
+    ICACHE_CALL, ICACHE_ADDU | ICACHE_RD, ICACHE_CALL, ICACHE_SUBU | ICACHE_RD, /* 0x20 */
+    ICACHE_AND | ICACHE_RD, ICACHE_OR | ICACHE_RD, ICACHE_XOR | ICACHE_RD, ICACHE_NOR | ICACHE_RD,
+    ICACHE_NOP, ICACHE_NOP, ICACHE_SLT | ICACHE_RD, ICACHE_SLT | ICACHE_RD, ICACHE_NOP, ICACHE_NOP, ICACHE_NOP, ICACHE_NOP, /* 0x28 */
+    ICACHE_CALL, ICACHE_CALL, ICACHE_CALL, ICACHE_CALL, ICACHE_CALL, ICACHE_NOP, ICACHE_CALL, ICACHE_NOP, /* 0x30 */
+    ICACHE_NOP, ICACHE_NOP, ICACHE_NOP, ICACHE_NOP, ICACHE_NOP, ICACHE_NOP, ICACHE_NOP, ICACHE_NOP /* 0x38 */
+};
+
+const unsigned char opcode_threads[64] =
+{
+    ICACHE_CALL, ICACHE_CALL, ICACHE_J, ICACHE_JAL, ICACHE_BEQ, ICACHE_BNE, ICACHE_BLEZ, ICACHE_BGTZ, /* 0x00 */
+    ICACHE_ADDIU | ICACHE_RT, ICACHE_ADDIU | ICACHE_RT, ICACHE_SLTI | ICACHE_RT, ICACHE_SLTI | ICACHE_RT, /* 0x08 */
+    ICACHE_ANDI | ICACHE_RT, ICACHE_ORI | ICACHE_RT, ICACHE_XORI | ICACHE_RT, ICACHE_CALL,
+    ICACHE_CALL, ICACHE_NOP, ICACHE_NOP, ICACHE_NOP, ICACHE_NOP, ICACHE_NOP, ICACHE_NOP, ICACHE_NOP, /* 0x10 */
+    ICACHE_CALL, ICACHE_NOP, ICACHE_NOP, ICACHE_NOP, ICACHE_NOP, ICACHE_NOP, ICACHE_NOP, ICACHE_NOP, /* 0x18 */
+    ICACHE_LB | ICACHE_RT, ICACHE_LH | ICACHE_RT, ICACHE_CALL, ICACHE_LW | ICACHE_RT, /* 0x20 */
+    ICACHE_LBU | ICACHE_RT, ICACHE_LHU | ICACHE_RT, ICACHE_CALL, ICACHE_NOP,
+    ICACHE_SB, ICACHE_SH, ICACHE_NOP, ICACHE_SW, ICACHE_NOP, ICACHE_NOP, ICACHE_NOP, ICACHE_NOP, /* 0x28 */
+    ICACHE_NOP, ICACHE_NOP, ICACHE_NOP, ICACHE_NOP, ICACHE_NOP, ICACHE_NOP, ICACHE_NOP, ICACHE_NOP, /* 0x30 */
+    ICACHE_NOP, ICACHE_NOP, ICACHE_NOP, ICACHE_NOP, ICACHE_NOP, ICACHE_NOP, ICACHE_NOP, ICACHE_NOP /* 0x38 */
+};
+
+void predecode(MIPS_decoded *d, unsigned int instruction, unsigned int pc)
+{
+    d->pc = pc;
+    d->instruction = instruction;
+    d->opcode = (instruction >> 26) & 0x3f;
+    d->rs = (instruction >> 21) & 0x1f;
+    d->rt = (instruction >> 16) & 0x1f;
+    d->rd = (instruction >> 11) & 0x1f;
+    d->shift = (instruction >> 6) & 0x1f;
+    d->funct = instruction & 0x3f;
+    d->immediate = instruction & 0xffff;
+    d->address = instruction & 0x3ffffff;
+
+    if (d->opcode == 0x00)
+    {
+        d->handler = special_handlers[d->funct];
+        d->thread = special_threads[d->funct];
+    }
+    else
+    {
+        d->handler = opcode_handlers[d->opcode];
+        d->thread = opcode_threads[d->opcode];
+    }
+
+    /* loads to $zero still load, the rest is a nop */
+    if ((d->thread & ICACHE_RD && d->rd == 0) || (d->thread & ICACHE_RT && d->rt == 0))
+    {
+        d->thread &= ~(ICACHE_RD | ICACHE_RT);
+        d->thread = d->thread >= ICACHE_LB && d->thread <= ICACHE_LHU ? ICACHE_CALL : ICACHE_NOP;
+    }
+    d->thread &= ~(ICACHE_RD | ICACHE_RT);
+}
+
+void icache_init(MIPS_icache *c)
+{
+    memset(c, 0, sizeof(MIPS_icache));
+}
+
+/* drop every entry that was fetched from the given page */
+void icache_invalidate(MIPS_icache *c, unsigned int page)
+{
+    unsigned int base = (page << (ICACHE_PAGE_SHIFT - 2)) & (ICACHE_SIZE - 1);
+    unsigned int i;
+
+    for (i = 0; i < (1 << (ICACHE_PAGE_SHIFT - 2)); i++)
+    {
+        MIPS_decoded *d = &c->entries[base + i];
+        if (d->handler != NULL && d->pc >> ICACHE_PAGE_SHIFT == page)
+            d->handler = NULL;
+    }
+}
+
+/* mem->codewrite target, only called for pages marked with mem_code() */
+void icache_store(void *cache, unsigned int address)
+{
+    icache_invalidate((MIPS_icache *)cache, address >> ICACHE_PAGE_SHIFT);
+}
+
+const MIPS_decoded *icache_fetch(MIPS_icache *c, MIPS_mem *mem, unsigned int pc)
+{
+    MIPS_decoded *d = &c->entries[(pc >> 2) & (ICACHE_SIZE - 1)];
+
+    if (d->handler != NULL && d->pc == pc)
+        return d;
+
+    if (mem_uncached(mem, pc))
+    {
+        predecode(&c->uncached, mem_fetch(mem, pc), pc);
+        return &c->uncached;
+    }
+
+    predecode(d, mem_fetch(mem, pc), pc);
+    mem_code(mem, pc);
+
+    return d;
+}
+
+/* same contract as execute(): returns 5 to stop, the instruction word otherwise */
+int icache_step(MIPS_icache *c, MIPS_state *state, MIPS_mem *mem)
+{
+    const MIPS_decoded *d = icache_fetch(c, mem, state->pc);
+    unsigned int instruction = d->instruction;
+
+    if (d->handler(state, d, mem) == 5)
+        return 5;
+
+    cp0_update(state);
+
+    return instruction;
+}
+
+/* runs up to max instructions, returns 5 if the guest stopped,
+    the number of instructions run goes to *ran */
+int icache_run(MIPS_icache *c, MIPS_state *state, MIPS_mem *mem, unsigned int max, unsigned int *ran)
+{
+#ifdef ICACHE_THREADED
+    static const void *labels[ICACHE_THREADS] =
+    {
+        &&call, &&nop,  &&sll,  &&srl,  &&sllv, &&srlv, &&jr,   &&jalr,
+        &&mfhi, &&mflo, &&addu, &&subu, &&and,  &&or,   &&xor,  &&nor,
+        &&slt,  &&j,    &&jal,  &&beq,  &&bne,  &&blez, &&bgtz, &&addiu,
+        &&slti, &&andi, &&ori,  &&xori, &&lb,   &&lh,   &&lw,   &&lbu,
+        &&lhu,  &&sb,   &&sh,   &&sw
+    };
+    unsigned int *regs = state->regs;
+    const MIPS_decoded *d;
+    unsigned int left = max;
+
+/* epilogue of the inlined instructions, they never write $zero */
+#define ICACHE_NEXT \
+    if (++state->clock >= state->next || state->exception != 0) \
+        goto slow; \
+    state->pc += 4; \
+    if (--left == 0) \
+        goto done; \
+    d = icache_fetch(c, mem, state->pc); \
+    goto *labels[d->thread]
+
+    *ran = 0;
+    if (max == 0)
+        return 0;
+    d = icache_fetch(c, mem, state->pc);
+    goto *labels[d->thread];
+
+call:
+    if (d->handler(state, d, mem) == 5)
+    {
+        *ran = max - left + 1;
+        return 5;
+    }
+    state->clock++;
+slow:
+    cp0_finish(state);
+    if (state->stop != 0)
+    {
+        *ran = max - left + 1;
+        return 5;
+    }
+    if (--left == 0)
+        goto done;
+    d = icache_fetch(c, mem, state->pc);
+    goto *labels[d->thread];
+
+nop:
+    ICACHE_NEXT;
+sll:
+    regs[d->rd] = regs[d->rt] << d->shift;
+    ICACHE_NEXT;
+srl:
+    regs[d->rd] = regs[d->rt] >> d->shift;
+    ICACHE_NEXT;
+sllv:
+    regs[d->rd] = regs[d->rt] << (regs[d->rs] & 0x1f);
+    ICACHE_NEXT;
+srlv:
+    regs[d->rd] = regs[d->rt] >> (regs[d->rs] & 0x1f);
+    ICACHE_NEXT;
+jr:
+    state->branches++;
+    state->pc = regs[d->rs] - 4;
+    if (d->rs == 31)
+    {
+        state->stop = STOP_HALT;
+        *ran = max - left + 1;
+        return 5;
+    }
+    ICACHE_NEXT;
+jalr:
+    state->branches++;
+    state->pc = regs[d->rs] - 4;
+    regs[31] = state->pc + 4;
+    ICACHE_NEXT;
+mfhi:
+    regs[d->rd] = state->hi;
+    ICACHE_NEXT;
+mflo:
+    regs[d->rd] = state->lo;
+    ICACHE_NEXT;
+addu:
+    regs[d->rd] = regs[d->rs] + regs[d->rt];
+    ICACHE_NEXT;
+subu:
+    regs[d->rd] = regs[d->rs] - regs[d->rt];
+    ICACHE_NEXT;
+and:
+    regs[d->rd] = regs[d->rs] & regs[d->rt];
+    ICACHE_NEXT;
+or:
+    regs[d->rd] = regs[d->rs] | regs[d->rt];
+    ICACHE_NEXT;
+xor:
+    regs[d->rd] = regs[d->rs] ^ regs[d->rt];
+    ICACHE_NEXT;
+nor:
+    regs[d->rd] = ~(regs[d->rs] | regs[d->rt]);
+    ICACHE_NEXT;
+slt:
+    regs[d->rd] = regs[d->rs] < regs[d->rt] ? 1 : 0;
+    ICACHE_NEXT;
+j:
+    state->branches++;
+    state->pc = (d->address << 2) | ((state->pc & 0xf) << 28);
+    ICACHE_NEXT;
+jal:
+    state->branches++;
+    state->pc = (d->address << 2) | ((state->pc & 0xf) << 28);
+    regs[31] = state->pc + 4;
+    ICACHE_NEXT;
+beq:
+    if (regs[d->rs] == regs[d->rt])
+    {
+        state->branches++;
+        state->pc += (d->immediate << 2) - 4;
+    }
+    ICACHE_NEXT;
+bne:
+    if (regs[d->rs] != regs[d->rt])
+    {
+        state->branches++;
+        state->pc += (d->immediate << 2) - 4;
+    }
+    ICACHE_NEXT;
+blez:
+    if (regs[d->rs] <= 0)
+    {
+        state->branches++;
+        state->pc += (d->immediate << 2) - 4;
+    }
+    ICACHE_NEXT;
+bgtz:
+    if (regs[d->rs] > 0)
+    {
+        state->branches++;
+        state->pc += (d->immediate << 2) - 4;
+    }
+    ICACHE_NEXT;
+addiu:
+    regs[d->rt] = regs[d->rs] + d->immediate;
+    ICACHE_NEXT;
+slti:
+    regs[d->rt] = regs[d->rs] < d->immediate ? 1 : 0;
+    ICACHE_NEXT;
+andi:
+    regs[d->rt] = regs[d->rs] & d->immediate;
+    ICACHE_NEXT;
+ori:
+    regs[d->rt] = regs[d->rs] | d->immediate;
+    ICACHE_NEXT;
+xori:
+    regs[d->rt] = regs[d->rs] ^ d->immediate;
+    ICACHE_NEXT;
+lb:
+    state->loads++;
+    regs[d->rt] = loadmemb(mem, regs[d->rs] + d->immediate);
+    ICACHE_NEXT;
+lh:
+    state->loads++;
+    regs[d->rt] = loadmemh(mem, regs[d->rs] + d->immediate);
+    ICACHE_NEXT;
+lw:
+    state->loads++;
+    regs[d->rt] = loadmemw(mem, regs[d->rs] + d->immediate);
+    ICACHE_NEXT;
+lbu:
+    state->loads++;
+    regs[d->rt] = loadmembu(mem, regs[d->rs] + d->immediate);
+    ICACHE_NEXT;
+lhu:
+    state->loads++;
+    regs[d->rt] = loadmemhu(mem, regs[d->rs] + d->immediate);
+    ICACHE_NEXT;
+sb:
+    state->stores++;
+    storememb(mem, regs[d->rs] + d->immediate, regs[d->rt]);
+    ICACHE_NEXT;
+sh:
+    state->stores++;
+    storememh(mem, regs[d->rs] + d->immediate, regs[d->rt]);
+    ICACHE_NEXT;
+sw:
+    state->stores++;
+    storememw(mem, regs[d->rs] + d->immediate, regs[d->rt]);
+    ICACHE_NEXT;
+
+#undef ICACHE_NEXT
+
+done:
+    *ran = max;
+    return 0;
+#else
+    unsigned int i;
+
+    for (i = 0; i < max; i++)
+        if (icache_step(c, state, mem) == 5 || state->stop != 0)
+        {
+            *ran = i + 1;
+            return 5;
+        }
+
+    *ran = max;
+    return 0;
+#endif
+}
+
+#endif
@@ -0,0 +1,149 @@
+/* MIPS Emulator - idle loop detection */
+/* Copyright 2024 Daniil Dunaef */
+
+#ifndef MIPS_IDLE
+#define MIPS_IDLE
+
+#include <string.h>
+#include "mips.h"
+
+/* @note A guest waiting for the timer or a device spins in a short loop.
+    Every IDLE_PROBE instructions an event notes pc, registers and
+    counters and follows the guest one instruction at a time for up to
+    IDLE_SPAN instructions. If it comes back to the same pc with the same
+    registers, without a store, a syscall, an exception, a read of Count,
+    Random or a performance counter and without an event in between,
+    nothing can end the loop before the next event does. Without device
+    accesses in the loop the clock then jumps over as many whole iterations as fit before
+    that event, and their branches and loads are counted as if they ran:
+    Count, the counters and the point where the event fires are the same
+    as without the jump, on every engine. The skipped instructions do not
+    count against machine_run() budgets. A loop that polls a device is not
+    skipped, its reads may have side effects, it asks for a STOP_WAIT stop
+    instead so the host can wait for input. After a jump the next look is
+    right after the event, the guest most likely goes on waiting; when it
+    is busy then the probes back off from IDLE_SPAN to IDLE_PROBE again.
+    idle_start() schedules the probe, like uart_start() call it again after
+    anything that clears the event queue.
+*/
+
+#define IDLE_PROBE 0x4000 /* instructions between looks for an idle loop */
+#define IDLE_SPAN 32 /* longest loop found, in instructions */
+
+typedef struct _MIPS_idle
+{
+    MIPS_mem *mem;
+    int on;
+    unsigned int steps; /* instructions followed since the probe */
+    unsigned long wait; /* instructions to the next probe */
+    unsigned int pc, hi, lo;
+    unsigned int regs[32];
+    unsigned long clock, next;
+    unsigned long branches, loads, stores, mmio, traps, irqs, timereads, syscalls;
+    unsigned long loops; /* idle loops skipped */
+    unsigned long skipped; /* instructions they did not run */
+} MIPS_idle;
+
+void idle_follow(MIPS_state *state, void *user);
+
+/* notes where the guest is and starts following it */
+void idle_probe(MIPS_state *state, void *user)
+{
+    MIPS_idle *idle = (MIPS_idle *)user;
+
+    idle->steps = 0;
+    idle->pc = state->pc;
+    idle->hi = state->hi;
+    idle->lo = state->lo;
+    memcpy(idle->regs, state->regs, sizeof(idle->regs));
+    idle->clock = state->clock;
+    idle->next = state->next;
+    idle->branches = state->branches;
+    idle->loads = state->loads;
+    idle->stores = state->stores;
+    idle->mmio = idle->mem->mmio;
+    idle->traps = state->traps;
+    idle->irqs = state->irqs;
+    idle->timereads = state->timereads;
+    idle->syscalls = state->syscalls;
+
+    event_schedule(state, 1, idle_follow, idle);
+}
+
+/* the guest did something that may end the loop or that the host sees, a
+   syscall prints or writes guest memory without a store */
+int idle_busy(MIPS_idle *idle, MIPS_state *state)
+{
+    return state->stores != idle->stores || state->traps != idle->traps || state->irqs != idle->irqs ||
+        state->timereads != idle->timereads || state->syscalls != idle->syscalls ||
+        state->next != idle->next || state->exception != 0;
+}
+
+/* back where the probe was with the same registers, $zero is only cleared after events */
+int idle_same(MIPS_idle *idle, MIPS_state *state)
+{
+    return state->pc == idle->pc && state->hi == idle->hi && state->lo == idle->lo &&
+        memcmp(state->regs + 1, idle->regs + 1, sizeof(idle->regs) - sizeof(idle->regs[0])) == 0;
+}
+
+/* jumps over the iterations that fit before the next event */
+void idle_skip(MIPS_idle *idle, MIPS_state *state)
+{
+    unsigned long period = state->clock - idle->clock;
+    unsigned long n = (state->next - 1 - state->clock) / period;
+
+    if (n == 0)
+        return;
+    state->branches += n * (state->branches - idle->branches);
+    state->loads += n * (state->loads - idle->loads);
+    state->clock += n * period;
+    idle->loops++;
+    idle->skipped += n * period;
+}
+
+void idle_follow(MIPS_state *state, void *user)
+{
+    MIPS_idle *idle = (MIPS_idle *)user;
+
+    if (!idle_busy(idle, state) && idle_same(idle, state))
+    {
+        if (idle->mem->mmio != idle->mmio)
+            stop_request(state, STOP_WAIT);
+        else if (state->next != ~0UL && state->next > state->clock)
+        {
+            idle_skip(idle, state);
+            idle->wait = IDLE_SPAN;
+            event_schedule(state, state->next - state->clock + 1, idle_probe, idle);
+            return;
+        }
+    }
+    else if (!idle_busy(idle, state) && state->pc != idle->pc && ++idle->steps < IDLE_SPAN)
+    {
+        event_schedule(state, 1, idle_follow, idle);
+        return;
+    }
+
+    event_schedule(state, idle->wait, idle_probe, idle);
+    if (idle->wait < IDLE_PROBE)
+        idle->wait *= 2;
+}
+
+void idle_init(MIPS_idle *idle, MIPS_mem *mem)
+{
+    memset(idle, 0, sizeof(MIPS_idle));
+    idle->mem = mem;
+    idle->on = 1;
+    idle->wait = IDLE_PROBE;
+}
+
+/* (re)schedules the probe, or cancels it with idle->on 0 */
+void idle_start(MIPS_idle *idle, MIPS_state *state)
+{
+    event_cancel(state, idle_probe, idle);
+    event_cancel(state, idle_follow, idle);
+    idle->wait = IDLE_PROBE;
+    if (idle->on)
+        event_schedule(state, IDLE_PROBE, idle_probe, idle);
+}
+
+#endif
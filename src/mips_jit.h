@@ -0,0 +1,620 @@
+/* MIPS Emulator - x86-64 code generator for hot blocks */
+/* Copyright 2024 Daniil Dunaef */
+
+#ifndef MIPS_JIT
+#define MIPS_JIT
+
+#include <stddef.h>
+#include "mips.h"
+#include "mips_icache.h"
+#include "mips_block.h"
+
+/* @note Only built for x86-64 Linux, jit_init() fails everywhere else and
+    the host keeps interpreting blocks.
+    Generated code keeps guest registers in MIPS_state (rbx) and finds
+    guest RAM through the soft TLB of mem (r12), so it runs the same with
+    the MMU on. ALU ops, shifts, multu, hi/lo moves, loads, stores and
+    beq/bne/blez/bgtz/j are emitted inline, other instructions call their
+    MIPS_handler. Native code stops and hands the rest of the
+    block to the interpreter before any other instruction that can raise an
+    exception, after lwl/lwr when their handler raised one or scheduled
+    an event that is due inside the block, before jr/jalr/jal/syscall/break/eret/CP0 moves, and when
+    a load or store misses the soft TLB (which covers MMIO and pages that
+    were never written or do not translate) or crosses a page, so those
+    always take the interpreter path. Pages with translated code and pages
+    not dirty yet never have the write tag (see mem_barrier()), so a store
+    needs no further check.
+*/
+
+#define JIT_SIZE (16 << 20) /* bytes of generated code before a flush */
+#define JIT_BLOCK_MAX 8192 /* worst case bytes for one block */
+#define JIT_THRESHOLD 64 /* block runs before it gets compiled */
+
+typedef struct _MIPS_jit
+{
+    unsigned char *code;
+    unsigned int size;
+    unsigned int used;
+    unsigned char *p; /* emit cursor */
+    unsigned int clocked; /* instructions of the block charged to the clock */
+} MIPS_jit;
+
+#if defined(__x86_64__) && defined(__linux__)
+
+#include <sys/mman.h>
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS 0x20 /* hidden by -std=c89 */
+#endif
+
+#define JIT_REG(r) (offsetof(MIPS_state, regs) + (r) * 4)
+#define JIT_PC offsetof(MIPS_state, pc)
+#define JIT_HI offsetof(MIPS_state, hi)
+#define JIT_LO offsetof(MIPS_state, lo)
+#define JIT_COUNTER(c) offsetof(MIPS_state, c)
+#define JIT_CLOCK offsetof(MIPS_state, clock)
+#define JIT_NEXT offsetof(MIPS_state, next)
+
+#define JIT_EAX 0
+#define JIT_ECX 1
+#define JIT_EDX 2
+
+void jit_emit1(MIPS_jit *j, unsigned int b)
+{
+    *j->p++ = b & 0xff;
+}
+
+void jit_emit4(MIPS_jit *j, unsigned int v)
+{
+    jit_emit1(j, v);
+    jit_emit1(j, v >> 8);
+    jit_emit1(j, v >> 16);
+    jit_emit1(j, v >> 24);
+}
+
+void jit_emit8(MIPS_jit *j, unsigned long v)
+{
+    jit_emit4(j, v & 0xffffffff);
+    jit_emit4(j, (v >> 16) >> 16);
+}
+
+/* op r32, [rbx + disp32] */
+void jit_rm(MIPS_jit *j, unsigned int op, int reg, unsigned int off)
+{
+    jit_emit1(j, op);
+    jit_emit1(j, 0x83 | reg << 3);
+    jit_emit4(j, off);
+}
+
+/* mov r32, [rbx + off] */
+void jit_load(MIPS_jit *j, int reg, unsigned int off)
+{
+    jit_rm(j, 0x8b, reg, off);
+}
+
+/* mov [rbx + off], r32, writes to $zero are dropped */
+void jit_store(MIPS_jit *j, int reg, unsigned int off)
+{
+    if (off == JIT_REG(0))
+        return;
+    jit_rm(j, 0x89, reg, off);
+}
+
+/* mov dword [rbx + off], imm32 */
+void jit_storeimm(MIPS_jit *j, unsigned int off, unsigned int imm)
+{
+    jit_emit1(j, 0xc7);
+    jit_emit1(j, 0x83);
+    jit_emit4(j, off);
+    jit_emit4(j, imm);
+}
+
+/* mov eax, n; pop r13; pop r12; pop rbx; ret */
+void jit_exit(MIPS_jit *j, unsigned int n)
+{
+    jit_emit1(j, 0xb8);
+    jit_emit4(j, n);
+    jit_emit1(j, 0x41);
+    jit_emit1(j, 0x5d);
+    jit_emit1(j, 0x41);
+    jit_emit1(j, 0x5c);
+    jit_emit1(j, 0x5b);
+    jit_emit1(j, 0xc3);
+}
+
+/* inc qword [rbx + off], for the performance counters */
+void jit_count(MIPS_jit *j, unsigned int off)
+{
+    jit_emit1(j, 0x48);
+    jit_emit1(j, 0xff);
+    jit_emit1(j, 0x83);
+    jit_emit4(j, off);
+}
+
+#define JIT_EXIT_SIZE 11 /* bytes emitted by jit_exit() */
+#define JIT_BAIL_SIZE 21 /* bytes emitted by jit_bail() */
+
+/* leave native code before instruction n of the block */
+void jit_bail(MIPS_jit *j, const MIPS_block *b, unsigned int n)
+{
+    jit_storeimm(j, JIT_PC, b->pc + n * 4);
+    jit_exit(j, n);
+}
+
+/* eax = guest address */
+void jit_address(MIPS_jit *j, const MIPS_block *b, unsigned int n)
+{
+    const MIPS_decoded *d = &b->code[n];
+
+    jit_load(j, JIT_EAX, JIT_REG(d->rs));
+    jit_emit1(j, 0x05); /* add eax, imm32 */
+    jit_emit4(j, d->immediate);
+}
+
+/* looks up the address in eax in the soft TLB of mem (r12), by its write
+   tag for stores, leaves the host page in rdx and the offset in eax.
+   Bails out on a miss and on accesses that cross into the next page */
+void jit_walk(MIPS_jit *j, const MIPS_block *b, unsigned int n, unsigned int size, int write)
+{
+    unsigned int entry = offsetof(MIPS_mem, stlb);
+
+    jit_emit1(j, 0x89); /* mov ecx, eax */
+    jit_emit1(j, 0xc1);
+    jit_emit1(j, 0xc1); /* shr ecx, MEM_PAGE_SHIFT */
+    jit_emit1(j, 0xe9);
+    jit_emit1(j, MEM_PAGE_SHIFT);
+    jit_emit1(j, 0x81); /* and ecx, MEM_STLB - 1 */
+    jit_emit1(j, 0xe1);
+    jit_emit4(j, MEM_STLB - 1);
+    jit_emit1(j, 0xc1); /* shl ecx, 4, entries are 16 bytes */
+    jit_emit1(j, 0xe1);
+    jit_emit1(j, 4);
+    jit_emit1(j, 0x89); /* mov edx, eax */
+    jit_emit1(j, 0xc2);
+    jit_emit1(j, 0x81); /* and edx, page */
+    jit_emit1(j, 0xe2);
+    jit_emit4(j, ~(MEM_PAGE_SIZE - 1));
+    jit_emit1(j, 0x41); /* cmp edx, [r12 + rcx + tag] */
+    jit_emit1(j, 0x3b);
+    jit_emit1(j, 0x94);
+    jit_emit1(j, 0x0c);
+    jit_emit4(j, entry + (write ? offsetof(MIPS_stlb, write) : offsetof(MIPS_stlb, read)));
+    jit_emit1(j, 0x74); /* je over the bail */
+    jit_emit1(j, JIT_BAIL_SIZE);
+    jit_bail(j, b, n);
+    jit_emit1(j, 0x49); /* mov rdx, [r12 + rcx + page] */
+    jit_emit1(j, 0x8b);
+    jit_emit1(j, 0x94);
+    jit_emit1(j, 0x0c);
+    jit_emit4(j, entry + offsetof(MIPS_stlb, page));
+
+    jit_emit1(j, 0x25); /* and eax, page mask */
+    jit_emit4(j, MEM_PAGE_SIZE - 1);
+    if (size > 1)
+    {
+        jit_emit1(j, 0x3d); /* cmp eax, last offset */
+        jit_emit4(j, MEM_PAGE_SIZE - size);
+        jit_emit1(j, 0x76); /* jbe over the bail */
+        jit_emit1(j, JIT_BAIL_SIZE);
+        jit_bail(j, b, n);
+    }
+}
+
+/* call the interpreter handler for instruction n, with the clock it would
+   see in block_exec() */
+void jit_call(MIPS_jit *j, const MIPS_block *b, unsigned int n)
+{
+    const MIPS_decoded *d = &b->code[n];
+
+    if (n > j->clocked)
+    {
+        jit_emit1(j, 0x48); /* add qword [rbx + clock], imm32 */
+        jit_rm(j, 0x81, 0, JIT_CLOCK);
+        jit_emit4(j, n - j->clocked);
+        j->clocked = n;
+    }
+    jit_storeimm(j, JIT_PC, d->pc);
+    jit_emit1(j, 0x48); /* mov rdi, rbx */
+    jit_emit1(j, 0x89);
+    jit_emit1(j, 0xdf);
+    jit_emit1(j, 0x48); /* mov rsi, d */
+    jit_emit1(j, 0xbe);
+    jit_emit8(j, (unsigned long)d);
+    jit_emit1(j, 0x4c); /* mov rdx, r12 */
+    jit_emit1(j, 0x89);
+    jit_emit1(j, 0xe2);
+    jit_emit1(j, 0x48); /* mov rax, handler */
+    jit_emit1(j, 0xb8);
+    jit_emit8(j, (unsigned long)d->handler);
+    jit_emit1(j, 0xff); /* call rax */
+    jit_emit1(j, 0xd0);
+    jit_storeimm(j, JIT_REG(0), 0);
+}
+
+/* leave native code after instruction n if its handler raised an exception
+   or made an event due before the end of the block, pc is still its own */
+void jit_raised(MIPS_jit *j, const MIPS_block *b, unsigned int n)
+{
+    jit_emit1(j, 0x83); /* cmp dword [rbx + exception], 0 */
+    jit_emit1(j, 0xbb);
+    jit_emit4(j, offsetof(MIPS_state, exception));
+    jit_emit1(j, 0x00);
+    jit_emit1(j, 0x75); /* jne to the exit */
+    jit_emit1(j, 22);
+    jit_emit1(j, 0x48); /* mov rax, [rbx + clock] */
+    jit_rm(j, 0x8b, JIT_EAX, JIT_CLOCK);
+    jit_emit1(j, 0x48); /* add rax, instructions left */
+    jit_emit1(j, 0x05);
+    jit_emit4(j, b->len - n);
+    jit_emit1(j, 0x48); /* cmp rax, [rbx + next] */
+    jit_rm(j, 0x3b, JIT_EAX, JIT_NEXT);
+    jit_emit1(j, 0x76); /* jbe over the exit */
+    jit_emit1(j, JIT_EXIT_SIZE);
+    jit_exit(j, n + 1);
+}
+
+/* [rdx + rax] addressing for ecx, after an optional prefix */
+void jit_guest(MIPS_jit *j, unsigned int op)
+{
+    jit_emit1(j, op);
+    jit_emit1(j, 0x0c);
+    jit_emit1(j, 0x02);
+}
+
+/* pc = taken ? target : d->pc, for the two-way branches */
+void jit_branch(MIPS_jit *j, const MIPS_decoded *d, unsigned int cmov)
+{
+    jit_emit1(j, 0xb8); /* mov eax, not taken */
+    jit_emit4(j, d->pc);
+    jit_emit1(j, 0xb9); /* mov ecx, taken */
+    jit_emit4(j, d->pc + ((d->immediate << 2) - 4));
+    jit_emit1(j, 0x0f); /* cmovcc eax, ecx */
+    jit_emit1(j, cmov);
+    jit_emit1(j, 0xc1);
+    jit_rm(j, 0x89, JIT_EAX, JIT_PC);
+    jit_emit1(j, 0x0f); /* setcc cl, same condition */
+    jit_emit1(j, cmov + 0x50);
+    jit_emit1(j, 0xc1);
+    jit_emit1(j, 0x0f); /* movzx ecx, cl */
+    jit_emit1(j, 0xb6);
+    jit_emit1(j, 0xc9);
+    jit_emit1(j, 0x48); /* add [rbx + branches], rcx */
+    jit_rm(j, 0x01, JIT_ECX, JIT_COUNTER(branches));
+}
+
+/* emits instruction n, returns 0 if native code has to stop before it */
+int jit_instruction(MIPS_jit *j, const MIPS_block *b, unsigned int n)
+{
+    const MIPS_decoded *d = &b->code[n];
+    unsigned int alu = 0;
+
+    switch (d->opcode)
+    {
+        case 0x00:
+            switch (d->funct)
+            {
+                case 0x00: /* sll */
+                case 0x02: /* srl */
+                case 0x03: /* sra, logical in execute() */
+                    jit_load(j, JIT_EAX, JIT_REG(d->rt));
+                    jit_emit1(j, 0xc1);
+                    jit_emit1(j, d->funct == 0x00 ? 0xe0 : 0xe8);
+                    jit_emit1(j, d->shift);
+                    jit_store(j, JIT_EAX, JIT_REG(d->rd));
+                    return 1;
+                case 0x04: /* sllv */
+                case 0x06: /* srlv */
+                case 0x07: /* srav, logical in execute() */
+                    jit_load(j, JIT_ECX, JIT_REG(d->rs));
+                    jit_load(j, JIT_EAX, JIT_REG(d->rt));
+                    jit_emit1(j, 0xd3);
+                    jit_emit1(j, d->funct == 0x04 ? 0xe0 : 0xe8);
+                    jit_store(j, JIT_EAX, JIT_REG(d->rd));
+                    return 1;
+                case 0x10: /* mfhi */
+                    jit_load(j, JIT_EAX, JIT_HI);
+                    jit_store(j, JIT_EAX, JIT_REG(d->rd));
+                    return 1;
+                case 0x11: /* mthi */
+                    jit_load(j, JIT_EAX, JIT_REG(d->rs));
+                    jit_store(j, JIT_EAX, JIT_HI);
+                    return 1;
+                case 0x12: /* mflo */
+                    jit_load(j, JIT_EAX, JIT_LO);
+                    jit_store(j, JIT_EAX, JIT_REG(d->rd));
+                    return 1;
+                case 0x13: /* mtlo */
+                    jit_load(j, JIT_EAX, JIT_REG(d->rs));
+                    jit_store(j, JIT_EAX, JIT_LO);
+                    return 1;
+                case 0x19: /* multu */
+                    jit_load(j, JIT_EAX, JIT_REG(d->rs));
+                    jit_rm(j, 0xf7, 4, JIT_REG(d->rt)); /* mul dword [rt] */
+                    jit_store(j, JIT_EAX, JIT_LO);
+                    jit_store(j, JIT_EDX, JIT_HI);
+                    return 1;
+                case 0x21: /* addu */
+                    alu = 0x03;
+                break;
+                case 0x23: /* subu */
+                    alu = 0x2b;
+                break;
+                case 0x24: /* and */
+                    alu = 0x23;
+                break;
+                case 0x25: /* or */
+                case 0x27: /* nor */
+                    alu = 0x0b;
+                break;
+                case 0x26: /* xor */
+                    alu = 0x33;
+                break;
+                case 0x2a: /* slt, unsigned in execute() */
+                case 0x2b: /* sltu */
+                    jit_load(j, JIT_EAX, JIT_REG(d->rs));
+                    jit_rm(j, 0x3b, JIT_EAX, JIT_REG(d->rt));
+                    jit_emit1(j, 0x0f); /* setb al */
+                    jit_emit1(j, 0x92);
+                    jit_emit1(j, 0xc0);
+                    jit_emit1(j, 0x0f); /* movzx eax, al */
+                    jit_emit1(j, 0xb6);
+                    jit_emit1(j, 0xc0);
+                    jit_store(j, JIT_EAX, JIT_REG(d->rd));
+                    return 1;
+                case 0x0a: /* movz */
+                case 0x0b: /* movn */
+                case 0x18: /* mult */
+                case 0x1a: /* div */
+                case 0x1b: /* divu */
+                case 0x1c: /* madd */
+                    jit_call(j, b, n);
+                    return 1;
+                case 0x08: /* jr */
+                case 0x09: /* jalr */
+                case 0x0c: /* syscall */
+                case 0x0d: /* break */
+                case 0x20: /* add */
+                case 0x22: /* sub */
+                case 0x30: /* tge */
+                case 0x31: /* tgeu */
+                case 0x32: /* tlt */
+                case 0x33: /* tltu */
+                case 0x34: /* teq */
+                case 0x36: /* tne */
+                    return 0;
+                default: /* no-op in execute() */
+                    return 1;
+            }
+            jit_load(j, JIT_EAX, JIT_REG(d->rs));
+            jit_rm(j, alu, JIT_EAX, JIT_REG(d->rt));
+            if (d->funct == 0x27)
+            {
+                jit_emit1(j, 0xf7); /* not eax */
+                jit_emit1(j, 0xd0);
+            }
+            jit_store(j, JIT_EAX, JIT_REG(d->rd));
+            return 1;
+        case 0x02: /* j */
+            jit_count(j, JIT_COUNTER(branches));
+            jit_storeimm(j, JIT_PC, (d->address << 2) | ((d->pc & 0xf) << 28));
+            return 1;
+        case 0x04: /* beq */
+        case 0x05: /* bne */
+            jit_load(j, JIT_EAX, JIT_REG(d->rs));
+            jit_rm(j, 0x3b, JIT_EAX, JIT_REG(d->rt));
+            jit_branch(j, d, d->opcode == 0x04 ? 0x44 : 0x45);
+            return 1;
+        case 0x06: /* blez, regs are unsigned so this is == 0 */
+        case 0x07: /* bgtz, != 0 */
+            jit_emit1(j, 0x83); /* cmp dword [rs], 0 */
+            jit_emit1(j, 0xbb);
+            jit_emit4(j, JIT_REG(d->rs));
+            jit_emit1(j, 0x00);
+            jit_branch(j, d, d->opcode == 0x06 ? 0x44 : 0x45);
+            return 1;
+        case 0x08: /* addi, no overflow check in execute() */
+        case 0x09: /* addiu */
+            alu = 0x05;
+        break;
+        case 0x0a: /* slti, unsigned in execute() */
+        case 0x0b: /* sltiu */
+            jit_load(j, JIT_EAX, JIT_REG(d->rs));
+            jit_emit1(j, 0x3d); /* cmp eax, imm32 */
+            jit_emit4(j, d->immediate);
+            jit_emit1(j, 0x0f); /* setb al */
+            jit_emit1(j, 0x92);
+            jit_emit1(j, 0xc0);
+            jit_emit1(j, 0x0f); /* movzx eax, al */
+            jit_emit1(j, 0xb6);
+            jit_emit1(j, 0xc0);
+            jit_store(j, JIT_EAX, JIT_REG(d->rt));
+            return 1;
+        case 0x0c: /* andi */
+            alu = 0x25;
+        break;
+        case 0x0d: /* ori */
+            alu = 0x0d;
+        break;
+        case 0x0e: /* xori */
+            alu = 0x35;
+        break;
+        case 0x0f: /* lui, execute() masks the result to 0 */
+            if (d->rt != 0)
+                jit_storeimm(j, JIT_REG(d->rt), 0);
+            return 1;
+        case 0x20: /* lb */
+        case 0x21: /* lh */
+        case 0x23: /* lw */
+        case 0x24: /* lbu */
+        case 0x25: /* lhu */
+            jit_address(j, b, n);
+            jit_walk(j, b, n, d->opcode == 0x23 ? 4 : d->opcode == 0x21 || d->opcode == 0x25 ? 2 : 1, 0);
+            jit_count(j, JIT_COUNTER(loads));
+            if (d->opcode == 0x23)
+            {
+                jit_guest(j, 0x8b); /* mov ecx, [rdx + rax] */
+                jit_emit1(j, 0x0f); /* bswap ecx */
+                jit_emit1(j, 0xc9);
+            }
+            else if (d->opcode == 0x21 || d->opcode == 0x25)
+            {
+                jit_emit1(j, 0x0f); /* movzx ecx, word [rdx + rax] */
+                jit_guest(j, 0xb7);
+                jit_emit1(j, 0x66); /* rol cx, 8 */
+                jit_emit1(j, 0xc1);
+                jit_emit1(j, 0xc1);
+                jit_emit1(j, 0x08);
+            }
+            else
+            {
+                jit_emit1(j, 0x0f); /* movsx/movzx ecx, byte [rdx + rax] */
+                jit_guest(j, d->opcode == 0x20 ? 0xbe : 0xb6);
+            }
+            jit_store(j, JIT_ECX, JIT_REG(d->rt));
+            return 1;
+        case 0x28: /* sb */
+        case 0x29: /* sh */
+        case 0x2b: /* sw */
+            jit_address(j, b, n);
+            jit_walk(j, b, n, d->opcode == 0x2b ? 4 : d->opcode == 0x29 ? 2 : 1, 1);
+            jit_count(j, JIT_COUNTER(stores));
+            if (d->opcode == 0x28)
+            {
+                jit_load(j, JIT_ECX, JIT_REG(d->rt));
+                jit_guest(j, 0x88); /* mov [rdx + rax], cl */
+                return 1;
+            }
+            jit_load(j, JIT_ECX, JIT_REG(d->rt));
+            if (d->opcode == 0x29)
+            {
+                jit_emit1(j, 0x66); /* rol cx, 8 */
+                jit_emit1(j, 0xc1);
+                jit_emit1(j, 0xc1);
+                jit_emit1(j, 0x08);
+                jit_emit1(j, 0x66); /* mov [rdx + rax], cx */
+            }
+            else
+            {
+                jit_emit1(j, 0x0f); /* bswap ecx */
+                jit_emit1(j, 0xc9);
+            }
+            jit_guest(j, 0x89); /* mov [rdx + rax], ecx */
+            return 1;
+        case 0x22: /* lwl */
+        case 0x26: /* lwr */
+            jit_call(j, b, n);
+            jit_raised(j, b, n);
+            return 1;
+        default:
+            if (d->handler == op_nop)
+                return 1;
+            return 0;
+    }
+
+    /* I format ALU with zero extended immediate */
+    jit_load(j, JIT_EAX, JIT_REG(d->rs));
+    jit_emit1(j, alu);
+    jit_emit4(j, d->immediate);
+    jit_store(j, JIT_EAX, JIT_REG(d->rt));
+    return 1;
+}
+
+/* drop all native code, called when the buffer is full */
+void jit_flush(MIPS_jit *j, MIPS_blockcache *c)
+{
+    unsigned int i;
+
+    for (i = 0; i < BLOCK_CACHE_SIZE; i++)
+    {
+        c->blocks[i].native = NULL;
+        c->blocks[i].hits = 0;
+    }
+    j->used = 0;
+}
+
+MIPS_native jit_compile(MIPS_blockcache *c, MIPS_block *b)
+{
+    MIPS_jit *j = (MIPS_jit *)c->jit;
+    unsigned char *start;
+    unsigned int n;
+
+    if (j->used + JIT_BLOCK_MAX > j->size)
+        jit_flush(j, c);
+
+    start = j->code + j->used;
+    j->p = start;
+    j->clocked = 0;
+
+    jit_emit1(j, 0x53); /* push rbx */
+    jit_emit1(j, 0x41); /* push r12 */
+    jit_emit1(j, 0x54);
+    jit_emit1(j, 0x41); /* push r13, keeps the stack aligned for calls */
+    jit_emit1(j, 0x55);
+    jit_emit1(j, 0x48); /* mov rbx, rdi */
+    jit_emit1(j, 0x89);
+    jit_emit1(j, 0xfb);
+    jit_emit1(j, 0x49); /* mov r12, rsi */
+    jit_emit1(j, 0x89);
+    jit_emit1(j, 0xf4);
+
+    for (n = 0; n < b->len; n++)
+        if (!jit_instruction(j, b, n))
+            break;
+
+    if (n == 0)
+        return NULL;
+
+    if (n == b->len)
+    {
+        /* the epilogue advances pc past the last instruction */
+        if (!block_ends(&b->code[n - 1]))
+            jit_storeimm(j, JIT_PC, b->code[n - 1].pc);
+        jit_exit(j, n);
+    }
+    else
+        jit_bail(j, b, n);
+
+    j->used += j->p - start;
+
+    return (MIPS_native)start;
+}
+
+/* attaches a code buffer to c, returns 0 on success */
+int jit_init(MIPS_jit *j, MIPS_blockcache *c, unsigned int threshold)
+{
+    void *code = mmap(NULL, JIT_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (code == MAP_FAILED)
+        return -1;
+
+    j->code = (unsigned char *)code;
+    j->size = JIT_SIZE;
+    j->used = 0;
+    j->p = j->code;
+
+    c->jit = j;
+    c->compile = jit_compile;
+    c->threshold = threshold;
+
+    return 0;
+}
+
+void jit_free(MIPS_jit *j)
+{
+    munmap(j->code, j->size);
+}
+
+#else
+
+int jit_init(MIPS_jit *j, MIPS_blockcache *c, unsigned int threshold)
+{
+    return -1;
+}
+
+void jit_free(MIPS_jit *j)
+{
+}
+
+#endif
+
+#endif
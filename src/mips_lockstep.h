@@ -0,0 +1,532 @@
+/* MIPS Emulator - differential lockstep between engines */
+/* Copyright 2024 Daniil Dunaef */
+
+#ifndef MIPS_LOCKSTEP
+#define MIPS_LOCKSTEP
+
+#include <stdio.h>
+#include <string.h>
+#include "mips.h"
+#include "mips_machine.h"
+
+/* @note Runs a machine under test next to a reference machine on the
+    reference execute() switch. Every step the machine under test runs up
+    to n instructions, the reference runs as many as it retired, then the
+    processor state and the pages the reference stored to are compared.
+    Those pages are the dirty set of the reference's memory (see
+    mem_barrier()), lockstep owns it and cleans it every step. Stray
+    stores of the machine under test to other pages are found by a compare
+    of all of memory every LOCKSTEP_FULL steps and at the end
+    (lockstep_finish()).
+    Guest console input read or polled by the machine under test is fed
+    to the reference again, polls chunk by chunk so the reference sees
+    them split the same way. The reference's console output is dropped.
+    Guest files are only touched by the machine under test, the reference
+    gets the results of its calls and the bytes it read.
+    A trace is the same comparison taken apart: lockstep_record() writes
+    the state hash and the hash of the dirty pages after every step of the
+    reference, lockstep_replay() runs any engine through the same steps
+    and checks it against them. Nondeterministic input is not part of a
+    trace, the guest must not read the console.
+*/
+
+#define LOCKSTEP_PAGES 64 /* dirty pages per step before a full compare */
+#define LOCKSTEP_FULL 65536 /* steps between full compares */
+#define LOCKSTEP_INPUT 4096 /* console bytes the reference lags behind */
+#define LOCKSTEP_FILES 65536 /* file results and bytes the reference lags behind */
+#define LOCKSTEP_MAGIC "MIPSLOCK"
+#define LOCKSTEP_VERSION 1
+#define LOCKSTEP_ALL 0xffffffff /* record covers all of memory */
+
+typedef struct _MIPS_lockstep
+{
+    MIPS_machine *ref; /* ENGINE_INTERP */
+    MIPS_machine *dut; /* NULL while recording or replaying */
+    unsigned int dirty[LOCKSTEP_PAGES]; /* page numbers stored to in this step */
+    unsigned int ndirty; /* LOCKSTEP_ALL after an overflow */
+    MIPS_io io; /* console of the machine under test */
+    char input[LOCKSTEP_INPUT]; /* read by the machine under test, not yet by the reference */
+    unsigned int inhead;
+    unsigned int inlen;
+    unsigned char polled[LOCKSTEP_INPUT]; /* polls as a count byte and the bytes */
+    unsigned int pollhead;
+    unsigned int polllen;
+    unsigned char files[LOCKSTEP_FILES]; /* results of file calls, bytes read after theirs */
+    unsigned int filehead;
+    unsigned int filelen;
+    unsigned long steps;
+} MIPS_lockstep;
+
+unsigned char lockstep_zero[MEM_PAGE_SIZE];
+
+/* FNV-1a over the big-endian bytes, so traces move between hosts */
+unsigned int lockstep_hash(unsigned int h, unsigned int word)
+{
+    h = (h ^ (word >> 24)) * 16777619u;
+    h = (h ^ (word >> 16 & 0xff)) * 16777619u;
+    h = (h ^ (word >> 8 & 0xff)) * 16777619u;
+    return (h ^ (word & 0xff)) * 16777619u;
+}
+
+unsigned int lockstep_state_hash(MIPS_state *state)
+{
+    unsigned int h = 2166136261u;
+    int i;
+
+    h = lockstep_hash(h, state->pc);
+    h = lockstep_hash(h, state->hi);
+    h = lockstep_hash(h, state->lo);
+    for (i = 0; i < 32; i++)
+        h = lockstep_hash(h, state->regs[i]);
+    for (i = 0; i < 32; i++)
+        h = lockstep_hash(h, state->cp0regs[i]);
+    for (i = 0; i < 8; i++)
+        h = lockstep_hash(h, state->interrupts[i]);
+    h = lockstep_hash(h, state->exception);
+    return lockstep_hash(h, state->mode);
+}
+
+unsigned int lockstep_page_hash(unsigned int h, MIPS_mem *mem, unsigned int page)
+{
+    unsigned char *p = mem_page(mem, page << MEM_PAGE_SHIFT);
+    int i;
+
+    if (p == NULL)
+        p = lockstep_zero;
+
+    h = lockstep_hash(h, page);
+    for (i = 0; i < MEM_PAGE_SIZE; i++)
+        h = (h ^ p[i]) * 16777619u;
+    return h;
+}
+
+/* all pages that are not zero, in address order */
+unsigned int lockstep_memory_hash(MIPS_mem *mem)
+{
+    unsigned int h = 2166136261u;
+    unsigned int i, j;
+
+    for (i = 0; i < MEM_TABLES; i++)
+    {
+        if (mem->tables[i] == NULL)
+            continue;
+        for (j = 0; j < (1 << MEM_TABLE_BITS); j++)
+            if (mem->tables[i][j] != NULL && memcmp(mem->tables[i][j], lockstep_zero, MEM_PAGE_SIZE) != 0)
+                h = lockstep_page_hash(h, mem, i << MEM_TABLE_BITS | j);
+    }
+    return h;
+}
+
+unsigned int lockstep_dirty_hash(MIPS_lockstep *ls, MIPS_mem *mem)
+{
+    unsigned int h = 2166136261u;
+    unsigned int i;
+
+    if (ls->ndirty == LOCKSTEP_ALL)
+        return lockstep_memory_hash(mem);
+    for (i = 0; i < ls->ndirty; i++)
+        h = lockstep_page_hash(h, mem, ls->dirty[i]);
+    return h;
+}
+
+/* takes the pages the reference stored to in this step from its dirty
+   set and starts the next one */
+void lockstep_dirty(MIPS_lockstep *ls)
+{
+    MIPS_mem *mem = &ls->ref->mem;
+
+    if (mem->ndirty > LOCKSTEP_PAGES)
+        ls->ndirty = LOCKSTEP_ALL;
+    else
+        for (ls->ndirty = 0; ls->ndirty < mem->ndirty; ls->ndirty++)
+            ls->dirty[ls->ndirty] = mem->dirtylog[ls->ndirty];
+    mem_clean(mem);
+}
+
+/* console of the machine under test, keeps what it read for the reference */
+int lockstep_dut_read(void *user, char *buf, unsigned int len)
+{
+    MIPS_lockstep *ls = (MIPS_lockstep *)user;
+    unsigned int i;
+    int n;
+
+    if (ls->io.read == NULL)
+        return 0;
+    if (len > LOCKSTEP_INPUT - ls->inlen)
+        len = LOCKSTEP_INPUT - ls->inlen;
+
+    n = ls->io.read(ls->io.user, buf, len);
+    for (i = 0; n > 0 && i < (unsigned int)n; i++)
+        ls->input[(ls->inhead + ls->inlen++) % LOCKSTEP_INPUT] = buf[i];
+    return n;
+}
+
+int lockstep_dut_poll(void *user, char *buf, unsigned int len)
+{
+    MIPS_lockstep *ls = (MIPS_lockstep *)user;
+    unsigned int i;
+    int n;
+
+    if (ls->io.poll == NULL || ls->polllen == LOCKSTEP_INPUT)
+        return 0;
+    if (len > LOCKSTEP_INPUT - ls->polllen - 1)
+        len = LOCKSTEP_INPUT - ls->polllen - 1;
+    if (len > 255)
+        len = 255;
+
+    n = ls->io.poll(ls->io.user, buf, len);
+    if (n <= 0)
+        return 0;
+    ls->polled[(ls->pollhead + ls->polllen++) % LOCKSTEP_INPUT] = n;
+    for (i = 0; i < (unsigned int)n; i++)
+        ls->polled[(ls->pollhead + ls->polllen++) % LOCKSTEP_INPUT] = buf[i];
+    return n;
+}
+
+void lockstep_push(MIPS_lockstep *ls, const unsigned char *buf, unsigned int len)
+{
+    unsigned int i;
+
+    for (i = 0; i < len; i++)
+        ls->files[(ls->filehead + ls->filelen++) % LOCKSTEP_FILES] = buf[i];
+}
+
+void lockstep_pop(MIPS_lockstep *ls, unsigned char *buf, unsigned int len)
+{
+    unsigned int i;
+
+    for (i = 0; i < len; i++, ls->filelen--)
+    {
+        buf[i] = ls->files[ls->filehead];
+        ls->filehead = (ls->filehead + 1) % LOCKSTEP_FILES;
+    }
+}
+
+int lockstep_dut_file(void *user, int op, int fd, char *buf, unsigned int len)
+{
+    MIPS_lockstep *ls = (MIPS_lockstep *)user;
+    unsigned char result[4];
+    int n;
+
+    if (ls->io.file == NULL || ls->filelen > LOCKSTEP_FILES - 5)
+        return -1;
+    if (op == IO_READ && len > LOCKSTEP_FILES - ls->filelen - 4)
+        len = LOCKSTEP_FILES - ls->filelen - 4;
+
+    n = ls->io.file(ls->io.user, op, fd, buf, len);
+    result[0] = (unsigned int)n >> 24;
+    result[1] = (unsigned int)n >> 16;
+    result[2] = (unsigned int)n >> 8;
+    result[3] = (unsigned int)n;
+    lockstep_push(ls, result, 4);
+    if (op == IO_READ && n > 0)
+        lockstep_push(ls, (unsigned char *)buf, n);
+    return n;
+}
+
+int lockstep_dut_write(void *user, const char *buf, unsigned int len)
+{
+    MIPS_lockstep *ls = (MIPS_lockstep *)user;
+
+    return ls->io.write != NULL ? ls->io.write(ls->io.user, buf, len) : (int)len;
+}
+
+int lockstep_ref_read(void *user, char *buf, unsigned int len)
+{
+    MIPS_lockstep *ls = (MIPS_lockstep *)user;
+    unsigned int i;
+
+    for (i = 0; i < len && ls->inlen > 0; i++, ls->inlen--)
+    {
+        buf[i] = ls->input[ls->inhead];
+        ls->inhead = (ls->inhead + 1) % LOCKSTEP_INPUT;
+    }
+    return i;
+}
+
+/* the next poll of the machine under test, nothing if it is not there yet */
+int lockstep_ref_poll(void *user, char *buf, unsigned int len)
+{
+    MIPS_lockstep *ls = (MIPS_lockstep *)user;
+    unsigned int n, i;
+
+    if (ls->polllen == 0 || ls->polled[ls->pollhead] > len)
+        return 0;
+    n = ls->polled[ls->pollhead];
+    for (i = 0; i <= n; i++, ls->polllen--)
+    {
+        if (i > 0)
+            buf[i - 1] = ls->polled[ls->pollhead];
+        ls->pollhead = (ls->pollhead + 1) % LOCKSTEP_INPUT;
+    }
+    return n;
+}
+
+int lockstep_ref_file(void *user, int op, int fd, char *buf, unsigned int len)
+{
+    MIPS_lockstep *ls = (MIPS_lockstep *)user;
+    unsigned char result[4];
+    int n;
+
+    if (ls->filelen < 4)
+        return -1;
+    lockstep_pop(ls, result, 4);
+    n = (int)((unsigned int)result[0] << 24 | result[1] << 16 | result[2] << 8 | result[3]);
+    if (op == IO_READ && n > 0)
+        lockstep_pop(ls, (unsigned char *)buf, (unsigned int)n <= len ? (unsigned int)n : len);
+    return n;
+}
+
+int lockstep_ref_write(void *user, const char *buf, unsigned int len)
+{
+    return len;
+}
+
+/* ref must run ENGINE_INTERP, dut may be NULL for a trace.
+   Both must hold the same image, the console of dut is kept */
+void lockstep_init(MIPS_lockstep *ls, MIPS_machine *ref, MIPS_machine *dut)
+{
+    memset(ls, 0, sizeof(MIPS_lockstep));
+    ls->ref = ref;
+    ls->dut = dut;
+
+    mem_clean(&ref->mem);
+
+    if (dut != NULL)
+    {
+        ls->io = dut->mem.io;
+        dut->mem.io.user = ls;
+        dut->mem.io.read = lockstep_dut_read;
+        dut->mem.io.poll = lockstep_dut_poll;
+        dut->mem.io.file = lockstep_dut_file;
+        dut->mem.io.write = lockstep_dut_write;
+        ref->mem.io.user = ls;
+        ref->mem.io.read = lockstep_ref_read;
+        ref->mem.io.poll = lockstep_ref_poll;
+        ref->mem.io.file = lockstep_ref_file;
+        ref->mem.io.write = lockstep_ref_write;
+    }
+}
+
+int lockstep_same_state(MIPS_state *a, MIPS_state *b)
+{
+    return a->pc == b->pc && a->hi == b->hi && a->lo == b->lo &&
+        memcmp(a->regs, b->regs, sizeof(a->regs)) == 0 &&
+        memcmp(a->cp0regs, b->cp0regs, sizeof(a->cp0regs)) == 0 &&
+        memcmp(a->interrupts, b->interrupts, sizeof(a->interrupts)) == 0 &&
+        a->exception == b->exception && a->mode == b->mode && a->clock == b->clock;
+}
+
+void lockstep_word(FILE *out, const char *name, unsigned int ref, unsigned int dut)
+{
+    if (ref != dut)
+        fprintf(out, "%s: 0x%08x | 0x%08x\n", name, ref, dut);
+}
+
+void lockstep_page_diff(FILE *out, MIPS_mem *ref, MIPS_mem *dut, unsigned int page)
+{
+    unsigned char *a = mem_page(ref, page << MEM_PAGE_SHIFT);
+    unsigned char *b = mem_page(dut, page << MEM_PAGE_SHIFT);
+    int i;
+
+    if (a == NULL)
+        a = lockstep_zero;
+    if (b == NULL)
+        b = lockstep_zero;
+
+    for (i = 0; i < MEM_PAGE_SIZE; i++)
+        if (a[i] != b[i])
+        {
+            fprintf(out, "memory 0x%08x: 0x%02x | 0x%02x\n", page << MEM_PAGE_SHIFT | i, a[i], b[i]);
+            return;
+        }
+}
+
+/* prints every difference as "what: reference | machine under test" */
+void lockstep_diff(MIPS_lockstep *ls, FILE *out)
+{
+    MIPS_state *a = &ls->ref->state;
+    MIPS_state *b = &ls->dut->state;
+    char name[16];
+    unsigned int i, j;
+
+    fprintf(out, "\n--------LOCKSTEP DIVERGENCE--------\n");
+    fprintf(out, "step %lu, retired %lu | %lu\n", ls->steps, ls->ref->retired, ls->dut->retired);
+
+    lockstep_word(out, "pc", a->pc, b->pc);
+    lockstep_word(out, "hi", a->hi, b->hi);
+    lockstep_word(out, "lo", a->lo, b->lo);
+    for (i = 0; i < 32; i++)
+    {
+        sprintf(name, "$%u", i);
+        lockstep_word(out, name, a->regs[i], b->regs[i]);
+    }
+    for (i = 0; i < 32; i++)
+    {
+        sprintf(name, "cp0 $%u", i);
+        lockstep_word(out, name, a->cp0regs[i], b->cp0regs[i]);
+    }
+    for (i = 0; i < 8; i++)
+    {
+        sprintf(name, "interrupt %u", i + 1);
+        lockstep_word(out, name, a->interrupts[i], b->interrupts[i]);
+    }
+    lockstep_word(out, "exception", a->exception, b->exception);
+    lockstep_word(out, "mode", a->mode, b->mode);
+
+    /* every page either of them has */
+    for (i = 0; i < MEM_TABLES; i++)
+    {
+        if (ls->ref->mem.tables[i] == NULL && ls->dut->mem.tables[i] == NULL)
+            continue;
+        for (j = 0; j < (1 << MEM_TABLE_BITS); j++)
+            lockstep_page_diff(out, &ls->ref->mem, &ls->dut->mem, i << MEM_TABLE_BITS | j);
+    }
+}
+
+/* runs one step of up to n instructions. Returns 0, 5 if both stopped
+   or -1 on the first divergence */
+int lockstep_step(MIPS_lockstep *ls, unsigned int n)
+{
+    unsigned long retired = ls->dut->retired;
+    int ret = machine_run(ls->dut, n);
+    int full;
+
+    if (machine_run(ls->ref, ls->dut->retired - retired) != ret)
+        return -1;
+    lockstep_dirty(ls);
+    if (ls->ref->retired != ls->dut->retired || !lockstep_same_state(&ls->ref->state, &ls->dut->state))
+        return -1;
+
+    full = ++ls->steps % LOCKSTEP_FULL == 0 || ls->ndirty == LOCKSTEP_ALL;
+    if (full)
+        ls->ndirty = LOCKSTEP_ALL;
+    if (ls->ndirty != 0 && lockstep_dirty_hash(ls, &ls->ref->mem) != lockstep_dirty_hash(ls, &ls->dut->mem))
+        return -1;
+
+    return ret;
+}
+
+/* compares all of memory, -1 if it differs */
+int lockstep_finish(MIPS_lockstep *ls)
+{
+    return lockstep_memory_hash(&ls->ref->mem) == lockstep_memory_hash(&ls->dut->mem) ? 0 : -1;
+}
+
+void lockstep_put(FILE *fp, unsigned int word)
+{
+    fputc(word >> 24, fp);
+    fputc(word >> 16 & 0xff, fp);
+    fputc(word >> 8 & 0xff, fp);
+    fputc(word & 0xff, fp);
+}
+
+int lockstep_get(FILE *fp, unsigned int *word)
+{
+    unsigned char b[4];
+
+    if (fread(b, 1, 4, fp) != 4)
+        return -1;
+    *word = (unsigned int)b[0] << 24 | b[1] << 16 | b[2] << 8 | b[3];
+    return 0;
+}
+
+/* trace header */
+void lockstep_begin(FILE *fp, unsigned int interval)
+{
+    fwrite(LOCKSTEP_MAGIC, 1, 8, fp);
+    lockstep_put(fp, LOCKSTEP_VERSION);
+    lockstep_put(fp, interval);
+}
+
+/* runs the reference one step of up to n instructions and writes a record:
+   instructions, state hash, dirty page count, dirty page hash, page numbers.
+   Returns like machine_run() */
+int lockstep_record(MIPS_lockstep *ls, unsigned int n, FILE *fp)
+{
+    unsigned long retired = ls->ref->retired;
+    int ret;
+    unsigned int i;
+
+    ret = machine_run(ls->ref, n);
+    lockstep_dirty(ls);
+
+    lockstep_put(fp, (unsigned int)(ls->ref->retired - retired));
+    lockstep_put(fp, lockstep_state_hash(&ls->ref->state));
+    lockstep_put(fp, ls->ndirty);
+    lockstep_put(fp, lockstep_dirty_hash(ls, &ls->ref->mem));
+    for (i = 0; ls->ndirty != LOCKSTEP_ALL && i < ls->ndirty; i++)
+        lockstep_put(fp, ls->dirty[i]);
+    ls->steps++;
+
+    return ret;
+}
+
+/* last record, all of memory */
+void lockstep_end(MIPS_lockstep *ls, FILE *fp)
+{
+    lockstep_put(fp, 0);
+    lockstep_put(fp, lockstep_state_hash(&ls->ref->state));
+    lockstep_put(fp, LOCKSTEP_ALL);
+    lockstep_put(fp, lockstep_memory_hash(&ls->ref->mem));
+}
+
+/* checks m against a trace, prints the first divergence to out.
+   Returns 0 when the whole trace matched, -1 otherwise */
+int lockstep_replay(MIPS_machine *m, FILE *fp, FILE *out)
+{
+    MIPS_lockstep ls;
+    char magic[8];
+    unsigned int version, interval;
+    unsigned int n, state, ndirty, hash;
+    unsigned long step;
+
+    if (fread(magic, 1, 8, fp) != 8 || memcmp(magic, LOCKSTEP_MAGIC, 8) != 0 ||
+        lockstep_get(fp, &version) != 0 || version != LOCKSTEP_VERSION || lockstep_get(fp, &interval) != 0)
+    {
+        fprintf(out, "Not a lockstep trace\n");
+        return -1;
+    }
+
+    memset(&ls, 0, sizeof(MIPS_lockstep));
+    for (step = 0; lockstep_get(fp, &n) == 0; step++)
+    {
+        unsigned long retired = m->retired;
+
+        if (lockstep_get(fp, &state) != 0 || lockstep_get(fp, &ndirty) != 0 || lockstep_get(fp, &hash) != 0)
+            break;
+        for (ls.ndirty = 0; ndirty != LOCKSTEP_ALL && ls.ndirty < ndirty; ls.ndirty++)
+            if (ls.ndirty >= LOCKSTEP_PAGES || lockstep_get(fp, &ls.dirty[ls.ndirty]) != 0)
+                break;
+        if (ndirty != LOCKSTEP_ALL && ls.ndirty != ndirty)
+            break;
+        ls.ndirty = ndirty;
+
+        machine_run(m, n);
+        if (m->retired - retired != n)
+        {
+            fprintf(out, "step %lu: stopped after %lu of %u instructions\n", step, m->retired - retired, n);
+            return -1;
+        }
+        if (lockstep_state_hash(&m->state) != state)
+        {
+            fprintf(out, "step %lu: state differs after %lu instructions, pc 0x%08x\n", step, m->retired, m->state.pc);
+            return -1;
+        }
+        if (lockstep_dirty_hash(&ls, &m->mem) != hash)
+        {
+            fprintf(out, "step %lu: memory differs after %lu instructions, pc 0x%08x\n", step, m->retired, m->state.pc);
+            return -1;
+        }
+        if (n == 0 && ndirty == LOCKSTEP_ALL)
+        {
+            fprintf(out, "trace matched, %lu steps of %u, %lu instructions\n", step, interval, m->retired);
+            return 0;
+        }
+    }
+
+    fprintf(out, "step %lu: trace is truncated\n", step);
+    return -1;
+}
+
+#endif
@@ -0,0 +1,361 @@
+/* MIPS Emulator - self-contained machine instances */
+/* Copyright 2024 Daniil Dunaef */
+
+#ifndef MIPS_MACHINE
+#define MIPS_MACHINE
+
+#include <stdlib.h>
+#include <time.h>
+#include "mips.h"
+#include "mips_icache.h"
+#include "mips_block.h"
+#include "mips_jit.h"
+#include "mips_idle.h"
+
+/* @note A machine owns its registers, memory, devices, host I/O callbacks
+    and the caches of its execution engine, nothing is shared between two
+    machines. Only the cache of the selected engine is allocated.
+    machine_slice() is the run call for hosts that multiplex guests: it
+    runs up to a budget and a host deadline and says why it stopped, with
+    the guest halted, at a break, after an exception (with STOP_FAULT in
+    m->stops) or spinning on an empty UART (STOP_WAIT, on by default),
+    when the host should look for input before it goes on. The deadline is
+    checked every MACHINE_CHUNK instructions. A guest stopped by halt or
+    break stays stopped only as long as the host does not run it again.
+*/
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/time.h>
+#define MACHINE_TIMEOFDAY
+#endif
+
+#define MACHINE_CHUNK 0x10000 /* instructions between deadline checks */
+
+#define ENGINE_INTERP 0 /* reference execute() */
+#define ENGINE_ICACHE 1
+#define ENGINE_BLOCK 2
+#define ENGINE_JIT 3
+#define ENGINE_GANG 4 /* batches only, ENGINE_INTERP machines run as a gang */
+
+/* guest performance counters, see perf_counter() */
+typedef struct _MIPS_counters
+{
+    unsigned long retired;
+    unsigned long branches; /* taken branches and jumps */
+    unsigned long loads;
+    unsigned long stores;
+    unsigned long mmio; /* loads and stores that went to a device */
+    unsigned long exceptions;
+    unsigned long interrupts;
+} MIPS_counters;
+
+#define MACHINE_REPORT_RAM 0x20000000 /* a report keeps the first MACHINE_REPORT_SIZE bytes from here */
+#define MACHINE_REPORT_SIZE 0x400
+
+/* what is left of a machine once it is destroyed, see machine_report() */
+typedef struct _MIPS_report
+{
+    unsigned int regs[32];
+    unsigned int pc;
+    unsigned int cp0regs[32];
+    unsigned long retired; /* instructions run by machine_run() */
+    MIPS_counters counters;
+    unsigned char ram[MACHINE_REPORT_SIZE];
+} MIPS_report;
+
+typedef struct _MIPS_machine
+{
+    MIPS_state state;
+    MIPS_mem mem;
+    int engine;
+    unsigned long retired; /* instructions run by machine_run() */
+    unsigned int stops; /* 1 << STOP_WAIT and 1 << STOP_FAULT if machine_slice() takes them */
+    MIPS_icache *icache;
+    MIPS_blockcache *blocks;
+    MIPS_jit jit;
+    MIPS_idle idle;
+} MIPS_machine;
+
+/* power-on register state. With the MMU pc is the reset vector in kseg1,
+   $sp points into kseg0, interrupts are off and no TLB entry matches */
+void machine_reset(MIPS_machine *m)
+{
+    int i;
+
+    for (i = 0; i < 32; i++)
+        m->state.regs[i] = 0;
+    for (i = 0; i < 32; i++)
+        m->state.cp0regs[i] = 0;
+    for (i = 0; i < 8; i++)
+        m->state.interrupts[i] = 0;
+
+    m->state.hi = 0;
+    m->state.lo = 0;
+    m->state.exception = 0;
+    m->state.mode = 0;
+    m->state.pc = 0;
+    m->state.regs[29] = (1 << 24) - 4096;
+    m->state.cp0regs[11] = 0x00ff0000;
+    m->state.cp0regs[12] = 0x0000ff01;
+    m->state.clock = 0;
+    m->state.branches = 0;
+    m->state.loads = 0;
+    m->state.stores = 0;
+    m->state.traps = 0;
+    m->state.irqs = 0;
+    m->mem.mmio = 0;
+    m->state.nevents = 0;
+    m->state.next = ~0UL;
+    for (i = 0; i < MMU_TLB; i++)
+    {
+        m->state.tlb[i].hi = MMU_KSEG0 + i * 0x2000;
+        m->state.tlb[i].lo0 = 0;
+        m->state.tlb[i].lo1 = 0;
+        m->state.tlb[i].mask = 0;
+    }
+    m->state.fault = 0;
+    m->state.faultreg = 0;
+    m->state.pending = 0;
+    m->state.stop = 0;
+    m->state.yield = 0;
+    if (m->state.mmu)
+    {
+        m->state.pc = MMU_RESET;
+        m->state.regs[29] |= MMU_KSEG0;
+        m->state.cp0regs[12] &= ~0x01;
+    }
+    mem_flushtlb(&m->mem);
+    cp0_sync(&m->state);
+    idle_start(&m->idle, &m->state);
+    m->retired = 0;
+}
+
+/* returns NULL if out of memory, falls back to ENGINE_BLOCK without a JIT */
+MIPS_machine *machine_create(int engine, const MIPS_io *io)
+{
+    MIPS_machine *m = (MIPS_machine *)calloc(1, sizeof(MIPS_machine));
+
+    if (m == NULL)
+        return NULL;
+
+    mem_init(&m->mem);
+    if (io != NULL)
+        m->mem.io = *io;
+
+    if (engine == ENGINE_ICACHE)
+    {
+        m->icache = (MIPS_icache *)malloc(sizeof(MIPS_icache));
+        if (m->icache == NULL)
+        {
+            free(m);
+            return NULL;
+        }
+        icache_init(m->icache);
+        m->mem.codewrite = icache_store;
+        m->mem.cache = m->icache;
+    }
+    else if (engine == ENGINE_BLOCK || engine == ENGINE_JIT)
+    {
+        m->blocks = (MIPS_blockcache *)malloc(sizeof(MIPS_blockcache));
+        if (m->blocks == NULL)
+        {
+            free(m);
+            return NULL;
+        }
+        block_init(m->blocks);
+        m->mem.codewrite = block_store;
+        m->mem.cache = m->blocks;
+
+        if (engine == ENGINE_JIT && jit_init(&m->jit, m->blocks, JIT_THRESHOLD) != 0)
+            engine = ENGINE_BLOCK;
+    }
+
+    m->engine = engine;
+    m->stops = 1 << STOP_WAIT;
+    idle_init(&m->idle, &m->mem);
+    machine_reset(m);
+
+    return m;
+}
+
+void machine_destroy(MIPS_machine *m)
+{
+    if (m->engine == ENGINE_JIT)
+        jit_free(&m->jit);
+    free(m->icache);
+    free(m->blocks);
+    mem_free(&m->mem);
+    free(m);
+}
+
+/* drops all translated code, needed after guest memory is replaced */
+void machine_flush(MIPS_machine *m)
+{
+    if (m->icache != NULL)
+        icache_init(m->icache);
+
+    if (m->blocks != NULL)
+    {
+        unsigned int threshold = m->blocks->threshold;
+        MIPS_native (*compile)(MIPS_blockcache *c, MIPS_block *b) = m->blocks->compile;
+        void *jit = m->blocks->jit;
+
+        block_init(m->blocks);
+        m->blocks->threshold = threshold;
+        m->blocks->compile = compile;
+        m->blocks->jit = jit;
+        m->jit.used = 0;
+    }
+    memset(m->mem.code, 0, sizeof(m->mem.code));
+}
+
+/* switches the MMU on or off, the machine starts over from reset */
+void machine_mmu(MIPS_machine *m, int on)
+{
+    m->state.mmu = on;
+    m->mem.mmu = on ? &m->state : NULL;
+    machine_flush(m);
+    machine_reset(m);
+}
+
+/* switches idle loop skipping on or off, see mips_idle.h */
+void machine_idle(MIPS_machine *m, int on)
+{
+    m->idle.on = on;
+    idle_start(&m->idle, &m->state);
+}
+
+/* copies an image into guest memory */
+void machine_load(MIPS_machine *m, unsigned int address, const unsigned char *image, unsigned int len)
+{
+    mem_load(&m->mem, address, image, len);
+}
+
+/* maps a device, see mem_map() */
+int machine_map(MIPS_machine *m, unsigned int base, unsigned int size,
+    unsigned int (*read)(void *user, unsigned int address, int size),
+    void (*write)(void *user, unsigned int address, int size, unsigned int value),
+    void *user)
+{
+    return mem_map(&m->mem, base, size, read, write, user);
+}
+
+/* runs up to max instructions, returns 5 if the guest stopped itself */
+int machine_run(MIPS_machine *m, unsigned int max)
+{
+    unsigned int i;
+    int ret = 0;
+
+    m->state.stop = 0;
+
+    switch (m->engine)
+    {
+        case ENGINE_INTERP:
+            for (i = 0; i < max; i++)
+                if (execute(&m->state, mem_fetch(&m->mem, m->state.pc), &m->mem) == 5 || m->state.stop != 0)
+                {
+                    i++;
+                    ret = 5;
+                    break;
+                }
+        break;
+        case ENGINE_ICACHE:
+            ret = icache_run(m->icache, &m->state, &m->mem, max, &i);
+        break;
+        case ENGINE_BLOCK:
+        case ENGINE_JIT:
+            ret = block_run(m->blocks, &m->state, &m->mem, max, &i);
+        break;
+        default:
+            i = 0;
+    }
+
+    m->retired += i;
+    m->state.cp0regs[9] = cp0_count(&m->state);
+    perf_sync(&m->state, &m->mem);
+
+    return ret;
+}
+
+/* host time in microseconds for machine_slice() deadlines */
+unsigned long machine_now(void)
+{
+#ifdef MACHINE_TIMEOFDAY
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (unsigned long)tv.tv_sec * 1000000 + tv.tv_usec;
+#else
+    return (unsigned long)time(NULL) * 1000000;
+#endif
+}
+
+/* runs up to max instructions and, unless deadline is 0, until machine_now()
+   passes it. Returns why it stopped, STOP_BUDGET if it ran them all */
+int machine_slice(MIPS_machine *m, unsigned int max, unsigned long deadline)
+{
+    int why = STOP_BUDGET;
+
+    m->state.yield = m->stops;
+    while (max > 0)
+    {
+        unsigned long retired = m->retired;
+
+        /* also before the first chunk, a host that waits between slices
+           may already be past it */
+        if (deadline != 0 && machine_now() >= deadline)
+        {
+            why = STOP_DEADLINE;
+            break;
+        }
+        if (machine_run(m, deadline != 0 && max > MACHINE_CHUNK ? MACHINE_CHUNK : max) == 5)
+        {
+            why = m->state.stop;
+            break;
+        }
+        max -= (unsigned int)(m->retired - retired);
+    }
+
+    /* a request that came with the last instruction */
+    if (why == STOP_BUDGET && m->state.stop != 0)
+        why = m->state.stop;
+    m->state.yield = 0;
+    event_cancel(&m->state, stop_event, NULL);
+
+    return why;
+}
+
+const char *machine_why(int why)
+{
+    static const char *names[] = {"budget exhausted", "halted", "breakpoint", "fault", "waiting on I/O", "deadline"};
+
+    return why >= 0 && why <= STOP_DEADLINE ? names[why] : "unknown";
+}
+
+/* reads the performance counters of m */
+void machine_counters(MIPS_machine *m, MIPS_counters *c)
+{
+    c->retired = perf_counter(&m->state, &m->mem, PERF_RETIRED);
+    c->branches = perf_counter(&m->state, &m->mem, PERF_BRANCHES);
+    c->loads = perf_counter(&m->state, &m->mem, PERF_LOADS);
+    c->stores = perf_counter(&m->state, &m->mem, PERF_STORES);
+    c->mmio = perf_counter(&m->state, &m->mem, PERF_MMIO);
+    c->exceptions = perf_counter(&m->state, &m->mem, PERF_EXCEPTIONS);
+    c->interrupts = perf_counter(&m->state, &m->mem, PERF_INTERRUPTS);
+}
+
+/* copies the state a host prints at the end of a run */
+void machine_report(MIPS_machine *m, MIPS_report *r)
+{
+    unsigned int i;
+
+    memcpy(r->regs, m->state.regs, sizeof(r->regs));
+    r->pc = m->state.pc;
+    memcpy(r->cp0regs, m->state.cp0regs, sizeof(r->cp0regs));
+    r->retired = m->retired;
+    machine_counters(m, &r->counters);
+    for (i = 0; i < MACHINE_REPORT_SIZE; i++)
+        r->ram[i] = mem_readb(&m->mem, MACHINE_REPORT_RAM + i);
+}
+
+#endif
@@ -0,0 +1,301 @@
+/* MIPS Emulator - instruction level profiler */
+/* Copyright 2024 Daniil Dunaef */
+
+#ifndef MIPS_PROFILE_H
+#define MIPS_PROFILE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "mips.h"
+
+/* @note The host calls profile_retire() after every instruction, so the
+    profiler costs nothing unless it is used. It counts instructions per
+    pc and per opcode/funct and keeps a call tree: jal/jalr enter a child
+    of the running function, jr $ra returns to its parent. Every retired
+    instruction is charged to the function running it.
+    RAM/MMIO accesses and interrupt_handler() calls are counted by the
+    core itself when it is built with MIPS_PROFILE, profile_flat() prints
+    them next to the histograms. profile_stacks() writes the call tree in
+    the collapsed format flamegraph tools read, one line per call path.
+*/
+
+#define PROFILE_BUCKETS 4096 /* call tree hash, power of two */
+#define PROFILE_TOP 32 /* hottest pcs in the flat profile */
+
+typedef struct _MIPS_frame
+{
+    unsigned int function; /* entry pc */
+    int parent;
+    int next; /* hash chain */
+    unsigned long self; /* instructions retired in this call path */
+} MIPS_frame;
+
+typedef struct _MIPS_profile
+{
+    unsigned long **pcs[1 << (32 - MEM_PAGE_SHIFT - MEM_TABLE_BITS)]; /* one counter per word */
+    unsigned long opcodes[64];
+    unsigned long functs[64];
+    unsigned long instructions;
+    MIPS_frame *frames;
+    int nframes;
+    int capframes;
+    int buckets[PROFILE_BUCKETS];
+    int current; /* frame of the running function */
+} MIPS_profile;
+
+const char *profile_opnames[64] = {
+    "special", "bgez/bltz", "j", "jal", "beq", "bne", "blez", "bgtz",
+    "addi", "addiu", "slti", "sltiu", "andi", "ori", "xori", "lui",
+    "mfc0/mtc0", 0, 0, 0, 0, 0, 0, 0,
+    "eret", 0, 0, 0, 0, 0, 0, 0,
+    "lb", "lh", "lwl", "lw", "lbu", "lhu", "lwr", 0,
+    "sb", "sh", 0, "sw", 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0
+};
+
+const char *profile_functnames[64] = {
+    "sll", 0, "srl", "sra", "sllv", 0, "srlv", "srav",
+    "jr", "jalr", "movz", "movn", "syscall", "break", 0, 0,
+    "mfhi", "mthi", "mflo", "mtlo", 0, 0, 0, 0,
+    "mult", "multu", "div", "divu", "madd", 0, 0, 0,
+    "add", "addu", "sub", "subu", "and", "or", "xor", "nor",
+    0, 0, "slt", "sltu", 0, 0, 0, 0,
+    "tge", "tgeu", "tlt", "tltu", "teq", 0, "tne", 0,
+    0, 0, 0, 0, 0, 0, 0, 0
+};
+
+/* finds or adds the frame for calling function from parent, -1 if out of memory */
+int profile_frame(MIPS_profile *p, int parent, unsigned int function)
+{
+    unsigned int h = (function >> 2 ^ (unsigned int)parent * 0x9e3779b1u) & (PROFILE_BUCKETS - 1);
+    int i;
+
+    for (i = p->buckets[h]; i >= 0; i = p->frames[i].next)
+        if (p->frames[i].function == function && p->frames[i].parent == parent)
+            return i;
+
+    if (p->nframes == p->capframes)
+    {
+        int cap = p->capframes ? p->capframes * 2 : 256;
+        MIPS_frame *frames = (MIPS_frame *)realloc(p->frames, cap * sizeof(MIPS_frame));
+
+        if (frames == NULL)
+            return -1;
+        p->frames = frames;
+        p->capframes = cap;
+    }
+
+    i = p->nframes++;
+    p->frames[i].function = function;
+    p->frames[i].parent = parent;
+    p->frames[i].self = 0;
+    p->frames[i].next = p->buckets[h];
+    p->buckets[h] = i;
+
+    return i;
+}
+
+/* entry is the pc execution starts at, returns NULL if out of memory */
+MIPS_profile *profile_create(unsigned int entry)
+{
+    MIPS_profile *p = (MIPS_profile *)calloc(1, sizeof(MIPS_profile));
+    int i;
+
+    if (p == NULL)
+        return NULL;
+
+    for (i = 0; i < PROFILE_BUCKETS; i++)
+        p->buckets[i] = -1;
+
+    p->current = profile_frame(p, -1, entry);
+    if (p->current < 0)
+    {
+        free(p);
+        return NULL;
+    }
+
+    return p;
+}
+
+void profile_free(MIPS_profile *p)
+{
+    int i, j;
+
+    for (i = 0; i < (1 << (32 - MEM_PAGE_SHIFT - MEM_TABLE_BITS)); i++)
+    {
+        if (p->pcs[i] == NULL)
+            continue;
+        for (j = 0; j < (1 << MEM_TABLE_BITS); j++)
+            free(p->pcs[i][j]);
+        free(p->pcs[i]);
+    }
+    free(p->frames);
+    free(p);
+}
+
+/* accounts one retired instruction, next is the pc after it */
+void profile_retire(MIPS_profile *p, unsigned int pc, unsigned int instruction, unsigned int next)
+{
+    unsigned long ***table = &p->pcs[pc >> (MEM_PAGE_SHIFT + MEM_TABLE_BITS)];
+    unsigned long **page;
+    unsigned int opcode = instruction >> 26;
+    unsigned int funct = instruction & 0x3f;
+
+    p->instructions++;
+    p->opcodes[opcode]++;
+    if (opcode == 0)
+        p->functs[funct]++;
+
+    if (*table == NULL)
+        *table = (unsigned long **)calloc(1 << MEM_TABLE_BITS, sizeof(unsigned long *));
+    if (*table != NULL)
+    {
+        page = &(*table)[(pc >> MEM_PAGE_SHIFT) & ((1 << MEM_TABLE_BITS) - 1)];
+        if (*page == NULL)
+            *page = (unsigned long *)calloc(MEM_PAGE_SIZE / 4, sizeof(unsigned long));
+        if (*page != NULL)
+            (*page)[(pc & (MEM_PAGE_SIZE - 1)) >> 2]++;
+    }
+
+    p->frames[p->current].self++;
+
+    if (opcode == 0x03 || (opcode == 0 && funct == 0x09)) /* jal, jalr */
+    {
+        int frame = profile_frame(p, p->current, next);
+        if (frame >= 0)
+            p->current = frame;
+    }
+    else if (opcode == 0 && funct == 0x08 && (instruction >> 21 & 0x1f) == 31) /* jr $ra */
+    {
+        if (p->frames[p->current].parent >= 0)
+            p->current = p->frames[p->current].parent;
+    }
+}
+
+typedef struct _MIPS_hot
+{
+    unsigned int pc;
+    unsigned long count;
+} MIPS_hot;
+
+int profile_hotter(const void *a, const void *b)
+{
+    const MIPS_hot *x = (const MIPS_hot *)a;
+    const MIPS_hot *y = (const MIPS_hot *)b;
+
+    if (x->count != y->count)
+        return x->count < y->count ? 1 : -1;
+    return x->pc < y->pc ? -1 : x->pc > y->pc;
+}
+
+void profile_line(FILE *out, const char *name, unsigned long count, unsigned long total)
+{
+    fprintf(out, "%-12s %12lu %6.2f%%\n", name, count, total ? 100.0 * count / total : 0.0);
+}
+
+void profile_flat(MIPS_profile *p, MIPS_state *state, MIPS_mem *mem, FILE *out)
+{
+    MIPS_hot hot[PROFILE_TOP + 1];
+    MIPS_hot ops[128];
+    char name[32];
+    int nhot = 0;
+    int nops = 0;
+    int i, j, k;
+
+    fprintf(out, "\n--------PROFILE--------\n");
+    fprintf(out, "instructions: %lu\n", p->instructions);
+#ifdef MIPS_PROFILE
+    fprintf(out, "RAM loads: %lu\nRAM stores: %lu\n", mem->ramloads, mem->ramstores);
+    fprintf(out, "MMIO loads: %lu\nMMIO stores: %lu\n", mem->ioloads, mem->iostores);
+    for (i = 0; i < 8; i++)
+        if (state->raised[i] != 0)
+            fprintf(out, "interrupt %d: %lu\n", i + 1, state->raised[i]);
+    for (i = 0; i < 32; i++)
+        if (state->exceptions[i] != 0)
+            fprintf(out, "exception %d: %lu\n", i, state->exceptions[i]);
+#endif
+
+    /* opcodes, SPECIAL is split by funct */
+    for (i = 1; i < 64; i++)
+        if (p->opcodes[i] != 0)
+        {
+            ops[nops].pc = i;
+            ops[nops++].count = p->opcodes[i];
+        }
+    for (i = 0; i < 64; i++)
+        if (p->functs[i] != 0)
+        {
+            ops[nops].pc = 64 + i;
+            ops[nops++].count = p->functs[i];
+        }
+    qsort(ops, nops, sizeof(MIPS_hot), profile_hotter);
+
+    fprintf(out, "\n--------OPCODES--------\n");
+    for (i = 0; i < nops; i++)
+    {
+        const char *op = ops[i].pc < 64 ? profile_opnames[ops[i].pc] : profile_functnames[ops[i].pc - 64];
+
+        if (op == NULL)
+        {
+            sprintf(name, ops[i].pc < 64 ? "op 0x%02x" : "funct 0x%02x", ops[i].pc & 0x3f);
+            op = name;
+        }
+        profile_line(out, op, ops[i].count, p->instructions);
+    }
+
+    /* keep the PROFILE_TOP hottest pcs, insertion into a sorted array */
+    for (i = 0; i < (1 << (32 - MEM_PAGE_SHIFT - MEM_TABLE_BITS)); i++)
+    {
+        if (p->pcs[i] == NULL)
+            continue;
+        for (j = 0; j < (1 << MEM_TABLE_BITS); j++)
+        {
+            if (p->pcs[i][j] == NULL)
+                continue;
+            for (k = 0; k < MEM_PAGE_SIZE / 4; k++)
+            {
+                unsigned long count = p->pcs[i][j][k];
+                int n;
+
+                if (count == 0 || (nhot == PROFILE_TOP && count <= hot[nhot - 1].count))
+                    continue;
+                for (n = nhot < PROFILE_TOP ? nhot++ : nhot - 1; n > 0 && hot[n - 1].count < count; n--)
+                    hot[n] = hot[n - 1];
+                hot[n].pc = (unsigned int)i << (MEM_PAGE_SHIFT + MEM_TABLE_BITS) | j << MEM_PAGE_SHIFT | k << 2;
+                hot[n].count = count;
+            }
+        }
+    }
+
+    fprintf(out, "\n--------HOT PCS--------\n");
+    for (i = 0; i < nhot; i++)
+    {
+        sprintf(name, "0x%08x", hot[i].pc);
+        profile_line(out, name, hot[i].count, p->instructions);
+    }
+}
+
+/* collapsed stacks, "0x00000000;0x00000400 123" per call path */
+void profile_stacks(MIPS_profile *p, FILE *out)
+{
+    int path[256];
+    int i;
+
+    for (i = 0; i < p->nframes; i++)
+    {
+        int depth = 0;
+        int f;
+
+        if (p->frames[i].self == 0)
+            continue;
+
+        for (f = i; f >= 0 && depth < 256; f = p->frames[f].parent)
+            path[depth++] = f;
+        while (depth-- > 0)
+            fprintf(out, "0x%08x%s", p->frames[path[depth]].function, depth ? ";" : "");
+        fprintf(out, " %lu\n", p->frames[i].self);
+    }
+}
+
+#endif
@@ -0,0 +1,351 @@
+/* MIPS Emulator - record and replay of guest inputs */
+/* Copyright 2024 Daniil Dunaef */
+
+#ifndef MIPS_REPLAY
+#define MIPS_REPLAY
+
+#include <stdio.h>
+#include <string.h>
+#include "mips.h"
+
+/* @note Everything a guest can observe that does not follow from its
+    image comes in through the console read callback of MIPS_io or through
+    the read callback of a device. replay_attach() wraps both: recording
+    logs every result with the retired instruction count it was read at,
+    replaying hands the logged results back without calling the host, so
+    the run repeats bit for bit.
+    Console reads happen on instruction boundaries (syscall ends a block,
+    devices poll from events) and their counts are checked on replay.
+    Only polls that returned something are logged, a poll on replay takes
+    the next record if it is a poll logged at the same count.
+    Guest file calls are logged with their results and the bytes read, a
+    replay hands those back and leaves the host files alone.
+    Loads from a device can sit inside a block that already charged the
+    clock for the whole block, so those are matched by address and size
+    only and a log can be replayed with any engine.
+    Devices are wrapped if they are mapped before replay_attach(). Devices
+    that take their input from mem->io, like the UART, are mapped after,
+    they run on replay as well and only their polls come from the log.
+    A divergence is only noted in the replay, replay_report() prints it.
+*/
+
+#define REPLAY_MAGIC "MIPSINPT"
+#define REPLAY_VERSION 1
+#define REPLAY_CONSOLE 1
+#define REPLAY_MMIO 2
+#define REPLAY_POLL 3
+#define REPLAY_FILE 4
+
+struct _MIPS_replay;
+
+typedef struct _MIPS_replaydev
+{
+    struct _MIPS_replay *replay;
+    unsigned int (*read)(void *user, unsigned int address, int size);
+    void (*write)(void *user, unsigned int address, int size, unsigned int value);
+    void *user;
+} MIPS_replaydev;
+
+typedef struct _MIPS_replay
+{
+    FILE *fp;
+    int playing;
+    int diverged; /* the log ran out or did not match, reads return nothing */
+    unsigned long divergence; /* instruction count it diverged at */
+    const char *mismatch; /* the read that did not match, NULL if the log ran out */
+    MIPS_state *state;
+    MIPS_io io; /* the wrapped console */
+    MIPS_replaydev devices[MEM_DEVICES];
+    int kind; /* header of the next record, 0 if not read yet, EOF at the end */
+    unsigned long clock;
+    unsigned long inputs;
+} MIPS_replay;
+
+void replay_put(FILE *fp, unsigned int word)
+{
+    fputc(word >> 24, fp);
+    fputc(word >> 16 & 0xff, fp);
+    fputc(word >> 8 & 0xff, fp);
+    fputc(word & 0xff, fp);
+}
+
+unsigned int replay_get(FILE *fp, int *eof)
+{
+    unsigned char b[4];
+
+    if (fread(b, 1, 4, fp) != 4)
+    {
+        *eof = 1;
+        return 0;
+    }
+    return (unsigned int)b[0] << 24 | b[1] << 16 | b[2] << 8 | b[3];
+}
+
+/* kind, clock as two words, then the kind's own words */
+void replay_header(MIPS_replay *r, int kind)
+{
+    fputc(kind, r->fp);
+    replay_put(r->fp, (unsigned int)(r->state->clock >> 16 >> 16));
+    replay_put(r->fp, (unsigned int)r->state->clock);
+    r->inputs++;
+}
+
+/* reads the next record header unless that is done already */
+int replay_peek(MIPS_replay *r)
+{
+    int eof = 0;
+    unsigned long hi;
+
+    if (r->kind != 0)
+        return r->kind;
+    r->kind = getc(r->fp);
+    hi = replay_get(r->fp, &eof);
+    r->clock = hi << 16 << 16 | replay_get(r->fp, &eof);
+    if (eof)
+        r->kind = EOF;
+    return r->kind;
+}
+
+/* takes the next record header, 0 if it is of this kind */
+int replay_next(MIPS_replay *r, int kind, unsigned long *clock)
+{
+    if (r->diverged)
+        return -1;
+    if (replay_peek(r) == kind)
+    {
+        *clock = r->clock;
+        r->kind = 0;
+        return 0;
+    }
+
+    r->diverged = 1;
+    r->divergence = r->state->clock;
+    return -1;
+}
+
+void replay_diverge(MIPS_replay *r, const char *what)
+{
+    r->diverged = 1;
+    r->divergence = r->state->clock;
+    r->mismatch = what;
+}
+
+/* prints where a playback left its log, nothing if it did not */
+void replay_report(MIPS_replay *r, FILE *out)
+{
+    if (!r->diverged)
+        return;
+    if (r->mismatch == NULL)
+        fprintf(out, "Input log ends or does not match at %lu instructions\n", r->divergence);
+    else
+        fprintf(out, "Input log does not match at %lu instructions: %s\n", r->divergence, r->mismatch);
+}
+
+int replay_read(void *user, char *buf, unsigned int len)
+{
+    MIPS_replay *r = (MIPS_replay *)user;
+    unsigned long clock;
+    unsigned int want;
+    int n;
+    int eof = 0;
+
+    if (!r->playing)
+    {
+        n = r->io.read != NULL ? r->io.read(r->io.user, buf, len) : 0;
+        replay_header(r, REPLAY_CONSOLE);
+        replay_put(r->fp, len);
+        replay_put(r->fp, n > 0 ? n : 0);
+        if (n > 0)
+            fwrite(buf, 1, n, r->fp);
+        return n;
+    }
+
+    if (replay_next(r, REPLAY_CONSOLE, &clock) != 0)
+        return 0;
+    want = replay_get(r->fp, &eof);
+    n = replay_get(r->fp, &eof);
+    if (eof || clock != r->state->clock || want != len || (unsigned int)n > len)
+    {
+        replay_diverge(r, "console read");
+        return 0;
+    }
+    if (fread(buf, 1, n, r->fp) != (unsigned int)n)
+    {
+        replay_diverge(r, "console read");
+        return 0;
+    }
+    r->inputs++;
+
+    return n;
+}
+
+int replay_poll(void *user, char *buf, unsigned int len)
+{
+    MIPS_replay *r = (MIPS_replay *)user;
+    unsigned long clock;
+    unsigned int n;
+    int eof = 0;
+
+    if (!r->playing)
+    {
+        int got = r->io.poll != NULL ? r->io.poll(r->io.user, buf, len) : 0;
+
+        if (got <= 0)
+            return 0;
+        replay_header(r, REPLAY_POLL);
+        replay_put(r->fp, got);
+        fwrite(buf, 1, got, r->fp);
+        return got;
+    }
+
+    if (r->diverged || replay_peek(r) != REPLAY_POLL || r->clock != r->state->clock)
+        return 0;
+    replay_next(r, REPLAY_POLL, &clock);
+    n = replay_get(r->fp, &eof);
+    if (eof || n > len || fread(buf, 1, n, r->fp) != n)
+    {
+        replay_diverge(r, "console poll");
+        return 0;
+    }
+    r->inputs++;
+
+    return n;
+}
+
+int replay_file(void *user, int op, int fd, char *buf, unsigned int len)
+{
+    MIPS_replay *r = (MIPS_replay *)user;
+    unsigned long clock;
+    int eof = 0;
+    int n;
+
+    if (!r->playing)
+    {
+        n = r->io.file != NULL ? r->io.file(r->io.user, op, fd, buf, len) : -1;
+        replay_header(r, REPLAY_FILE);
+        replay_put(r->fp, op);
+        replay_put(r->fp, len);
+        replay_put(r->fp, n);
+        if (op == IO_READ && n > 0)
+            fwrite(buf, 1, n, r->fp);
+        return n;
+    }
+
+    if (replay_next(r, REPLAY_FILE, &clock) != 0)
+        return -1;
+    if (replay_get(r->fp, &eof) != (unsigned int)op || replay_get(r->fp, &eof) != len || clock != r->state->clock)
+    {
+        replay_diverge(r, "file call");
+        return -1;
+    }
+    n = (int)replay_get(r->fp, &eof);
+    if (eof || (op == IO_READ && n > 0 && ((unsigned int)n > len || fread(buf, 1, n, r->fp) != (unsigned int)n)))
+    {
+        replay_diverge(r, "file call");
+        return -1;
+    }
+    r->inputs++;
+
+    return n;
+}
+
+int replay_write(void *user, const char *buf, unsigned int len)
+{
+    MIPS_replay *r = (MIPS_replay *)user;
+
+    return r->io.write != NULL ? r->io.write(r->io.user, buf, len) : (int)len;
+}
+
+void replay_device_write(void *user, unsigned int address, int size, unsigned int value)
+{
+    MIPS_replaydev *dev = (MIPS_replaydev *)user;
+
+    if (dev->write != NULL)
+        dev->write(dev->user, address, size, value);
+}
+
+unsigned int replay_device_read(void *user, unsigned int address, int size)
+{
+    MIPS_replaydev *dev = (MIPS_replaydev *)user;
+    MIPS_replay *r = dev->replay;
+    unsigned long clock;
+    unsigned int value;
+    int eof = 0;
+
+    if (!r->playing)
+    {
+        value = dev->read(dev->user, address, size);
+        replay_header(r, REPLAY_MMIO);
+        replay_put(r->fp, address);
+        replay_put(r->fp, size);
+        replay_put(r->fp, value);
+        return value;
+    }
+
+    if (replay_next(r, REPLAY_MMIO, &clock) != 0)
+        return 0;
+    if (replay_get(r->fp, &eof) != address || replay_get(r->fp, &eof) != (unsigned int)size)
+    {
+        replay_diverge(r, "device read");
+        return 0;
+    }
+    value = replay_get(r->fp, &eof);
+    if (eof)
+    {
+        replay_diverge(r, "device read");
+        return 0;
+    }
+    r->inputs++;
+
+    return value;
+}
+
+/* wraps the console and the devices of mem. Recording writes the header,
+   playing checks it. Returns -1 if fp does not hold an input log */
+int replay_attach(MIPS_replay *r, MIPS_mem *mem, MIPS_state *state, FILE *fp, int playing)
+{
+    int i;
+
+    memset(r, 0, sizeof(MIPS_replay));
+    r->fp = fp;
+    r->playing = playing;
+    r->state = state;
+
+    if (playing)
+    {
+        char magic[8];
+        int eof = 0;
+
+        if (fread(magic, 1, 8, fp) != 8 || memcmp(magic, REPLAY_MAGIC, 8) != 0 || replay_get(fp, &eof) != REPLAY_VERSION)
+            return -1;
+    }
+    else
+    {
+        fwrite(REPLAY_MAGIC, 1, 8, fp);
+        replay_put(fp, REPLAY_VERSION);
+    }
+
+    r->io = mem->io;
+    mem->io.user = r;
+    mem->io.read = replay_read;
+    mem->io.poll = replay_poll;
+    mem->io.file = replay_file;
+    mem->io.write = replay_write;
+
+    for (i = 0; i < mem->ndevices; i++)
+    {
+        if (mem->devices[i].read == NULL)
+            continue;
+        r->devices[i].replay = r;
+        r->devices[i].read = mem->devices[i].read;
+        r->devices[i].write = mem->devices[i].write;
+        r->devices[i].user = mem->devices[i].user;
+        mem->devices[i].read = replay_device_read;
+        mem->devices[i].write = replay_device_write;
+        mem->devices[i].user = &r->devices[i];
+    }
+
+    return 0;
+}
+
+#endif
@@ -0,0 +1,333 @@
+/* MIPS Emulator - machine snapshots */
+/* Copyright 2024 Daniil Dunaef */
+
+#ifndef MIPS_SNAPSHOT
+#define MIPS_SNAPSHOT
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mips.h"
+#include "mips_machine.h"
+
+/* @note A snapshot is a 4KB header with the processor state, a directory
+    of guest page numbers padded to 4KB and then the pages themselves, so
+    every page sits at a page aligned file offset. Words are big-endian.
+    Only allocated pages that are not all zero are written.
+    On POSIX hosts a restore maps the file privately and points the page
+    table straight into the mapping, pages are read lazily by the kernel
+    and copied on the first guest store, so any number of machines can
+    start from the same warm snapshot. Elsewhere the pages are read in.
+    The MMU switch and the TLB come after the registers, snapshots from
+    before the MMU read as taken with it off.
+    snapshot_delta() writes an incremental snapshot: the path of its parent
+    sits in the second half of the header and only the pages in the dirty
+    set of guest memory are written, zero or not. That set starts over
+    after every save and restore, so a delta holds what changed since the
+    machine was restored from or saved to its parent. A restore restores
+    the parent first (a relative path is taken from the working directory)
+    and reads the pages of the delta over it.
+    Devices, host callbacks and events other than the CP0 timer are not
+    saved, the caller maps its devices again after a restore.
+*/
+
+#define SNAPSHOT_MAGIC "MIPSSNAP"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_PARENT (MEM_PAGE_SIZE / 2) /* header offset of the parent path */
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#define SNAPSHOT_MMAP
+#endif
+
+void snapshot_put(unsigned char *p, unsigned int value)
+{
+    p[0] = value >> 24;
+    p[1] = value >> 16;
+    p[2] = value >> 8;
+    p[3] = value;
+}
+
+unsigned int snapshot_get(const unsigned char *p)
+{
+    return (unsigned int)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+int snapshot_zero(const unsigned char *page)
+{
+    int i;
+
+    for (i = 0; i < MEM_PAGE_SIZE; i++)
+        if (page[i] != 0)
+            return 0;
+    return 1;
+}
+
+const unsigned char snapshot_blank[MEM_PAGE_SIZE] = {0};
+
+/* a full snapshot for parent NULL, else a delta against parent */
+int snapshot_write(MIPS_machine *m, const char *path, const char *parent)
+{
+    unsigned char header[MEM_PAGE_SIZE];
+    unsigned char *dir;
+    unsigned int npages = 0;
+    unsigned int dirsize;
+    unsigned int i, j;
+    unsigned char *p;
+    FILE *fp;
+
+    if (parent != NULL && strlen(parent) >= MEM_PAGE_SIZE - SNAPSHOT_PARENT)
+        return -1;
+
+    /* one directory entry per non-zero page, per dirty page for a delta */
+    dirsize = ((parent != NULL ? m->mem.ndirty : m->mem.pages) * 4 + MEM_PAGE_SIZE - 1) & ~(MEM_PAGE_SIZE - 1);
+    dir = (unsigned char *)calloc(dirsize ? dirsize : 1, 1);
+    if (dir == NULL)
+        return -1;
+
+    for (i = 0; parent != NULL && i < MEM_BITMAP; i++)
+    {
+        for (j = 0; m->mem.dirty[i] != 0 && j < 8; j++)
+            if (m->mem.dirty[i] >> j & 1)
+                snapshot_put(dir + 4 * npages++, i << 3 | j);
+    }
+    for (i = 0; parent == NULL && i < MEM_TABLES; i++)
+    {
+        if (m->mem.tables[i] == NULL)
+            continue;
+        for (j = 0; j < (1 << MEM_TABLE_BITS); j++)
+        {
+            unsigned char *page = m->mem.tables[i][j];
+            if (page != NULL && !snapshot_zero(page))
+                snapshot_put(dir + 4 * npages++, i << MEM_TABLE_BITS | j);
+        }
+    }
+    dirsize = (npages * 4 + MEM_PAGE_SIZE - 1) & ~(MEM_PAGE_SIZE - 1);
+
+    memset(header, 0, sizeof(header));
+    memcpy(header, SNAPSHOT_MAGIC, 8);
+    p = header + 8;
+    snapshot_put(p, SNAPSHOT_VERSION); p += 4;
+    snapshot_put(p, npages); p += 4;
+    snapshot_put(p, m->state.pc); p += 4;
+    snapshot_put(p, m->state.hi); p += 4;
+    snapshot_put(p, m->state.lo); p += 4;
+    for (i = 0; i < 32; i++, p += 4)
+        snapshot_put(p, m->state.regs[i]);
+    m->state.cp0regs[9] = cp0_count(&m->state);
+    perf_sync(&m->state, &m->mem);
+    for (i = 0; i < 32; i++, p += 4)
+        snapshot_put(p, m->state.cp0regs[i]);
+    memcpy(p, m->state.interrupts, 8); p += 8;
+    snapshot_put(p, m->state.exception); p += 4;
+    snapshot_put(p, m->state.mode); p += 4;
+    snapshot_put(p, (unsigned int)(m->state.clock >> 16 >> 16)); p += 4;
+    snapshot_put(p, (unsigned int)m->state.clock); p += 4;
+    snapshot_put(p, m->state.mmu); p += 4;
+    snapshot_put(p, m->state.fault); p += 4;
+    snapshot_put(p, m->state.faultreg); p += 4;
+    snapshot_put(p, m->state.faultval); p += 4;
+    snapshot_put(p, m->state.pending); p += 4;
+    for (i = 0; i < MMU_TLB; i++, p += 16)
+    {
+        snapshot_put(p, m->state.tlb[i].hi);
+        snapshot_put(p + 4, m->state.tlb[i].lo0);
+        snapshot_put(p + 8, m->state.tlb[i].lo1);
+        snapshot_put(p + 12, m->state.tlb[i].mask);
+    }
+    if (parent != NULL)
+        strcpy((char *)header + SNAPSHOT_PARENT, parent);
+
+    fp = fopen(path, "wb");
+    if (fp == NULL)
+    {
+        free(dir);
+        return -1;
+    }
+
+    fwrite(header, 1, sizeof(header), fp);
+    fwrite(dir, 1, dirsize, fp);
+    for (i = 0; i < npages; i++)
+    {
+        unsigned char *page = mem_page(&m->mem, snapshot_get(dir + 4 * i) << MEM_PAGE_SHIFT);
+        fwrite(page != NULL ? page : snapshot_blank, 1, MEM_PAGE_SIZE, fp);
+    }
+
+    free(dir);
+    if (ferror(fp))
+    {
+        fclose(fp);
+        return -1;
+    }
+    if (fclose(fp) != 0)
+        return -1;
+    mem_clean(&m->mem);
+    return 0;
+}
+
+/* returns 0 on success */
+int snapshot_save(MIPS_machine *m, const char *path)
+{
+    return snapshot_write(m, path, NULL);
+}
+
+/* saves only what changed since the machine was restored from or saved
+   to parent, returns 0 on success */
+int snapshot_delta(MIPS_machine *m, const char *path, const char *parent)
+{
+    return snapshot_write(m, path, parent);
+}
+
+#ifdef SNAPSHOT_MMAP
+void snapshot_unmap(void *backing, unsigned long size)
+{
+    munmap(backing, size);
+}
+#endif
+
+/* replaces state and memory of the machine, returns 0 on success.
+   On failure the machine is left with empty memory */
+int snapshot_restore(MIPS_machine *m, const char *path)
+{
+    unsigned char header[MEM_PAGE_SIZE];
+    unsigned char *dir;
+    unsigned int npages;
+    unsigned int dirsize;
+    unsigned int i;
+    unsigned char *p;
+    unsigned char *data = NULL;
+    FILE *fp = fopen(path, "rb");
+
+    if (fp == NULL)
+        return -1;
+
+    if (fread(header, 1, sizeof(header), fp) != sizeof(header) ||
+        memcmp(header, SNAPSHOT_MAGIC, 8) != 0 || snapshot_get(header + 8) != SNAPSHOT_VERSION)
+    {
+        fclose(fp);
+        return -1;
+    }
+
+    npages = snapshot_get(header + 12);
+    dirsize = (npages * 4 + MEM_PAGE_SIZE - 1) & ~(MEM_PAGE_SIZE - 1);
+    dir = (unsigned char *)malloc(dirsize ? dirsize : 1);
+    if (dir == NULL || fread(dir, 1, dirsize, fp) != dirsize)
+    {
+        free(dir);
+        fclose(fp);
+        return -1;
+    }
+
+    /* a delta goes over its parent */
+    header[MEM_PAGE_SIZE - 1] = 0;
+    if (header[SNAPSHOT_PARENT] != 0)
+    {
+        if (strcmp((const char *)header + SNAPSHOT_PARENT, path) == 0 ||
+            snapshot_restore(m, (const char *)header + SNAPSHOT_PARENT) != 0)
+        {
+            free(dir);
+            fclose(fp);
+            return -1;
+        }
+    }
+    else
+    {
+        mem_clear(&m->mem);
+        machine_flush(m);
+    }
+
+#ifdef SNAPSHOT_MMAP
+    if (header[SNAPSHOT_PARENT] == 0)
+    {
+        unsigned long size = sizeof(header) + dirsize + (unsigned long)npages * MEM_PAGE_SIZE;
+        void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fileno(fp), 0);
+
+        if (map != MAP_FAILED)
+        {
+            m->mem.backing = (unsigned char *)map;
+            m->mem.backingsize = size;
+            m->mem.unback = snapshot_unmap;
+            data = m->mem.backing + sizeof(header) + dirsize;
+        }
+    }
+#endif
+
+    for (i = 0; i < npages; i++)
+    {
+        unsigned int address = snapshot_get(dir + 4 * i) << MEM_PAGE_SHIFT;
+
+        if (data != NULL)
+        {
+            mem_attach(&m->mem, address, data + (unsigned long)i * MEM_PAGE_SIZE);
+            continue;
+        }
+
+        /* no mapping, read the page in */
+        p = mem_touch(&m->mem, address);
+        if (p == NULL)
+        {
+            if (fseek(fp, MEM_PAGE_SIZE, SEEK_CUR) != 0)
+                break;
+        }
+        else if (fread(p, 1, MEM_PAGE_SIZE, fp) != MEM_PAGE_SIZE)
+            break;
+    }
+
+    free(dir);
+    fclose(fp);
+
+    if (i < npages)
+    {
+        mem_clear(&m->mem);
+        return -1;
+    }
+
+    p = header + 16;
+    m->state.pc = snapshot_get(p); p += 4;
+    m->state.hi = snapshot_get(p); p += 4;
+    m->state.lo = snapshot_get(p); p += 4;
+    for (i = 0; i < 32; i++, p += 4)
+        m->state.regs[i] = snapshot_get(p);
+    for (i = 0; i < 32; i++, p += 4)
+        m->state.cp0regs[i] = snapshot_get(p);
+    memcpy(m->state.interrupts, p, 8); p += 8;
+    m->state.exception = snapshot_get(p); p += 4;
+    m->state.mode = snapshot_get(p); p += 4;
+    m->state.clock = (unsigned long)snapshot_get(p) << 16 << 16; p += 4;
+    m->state.clock |= snapshot_get(p); p += 4;
+    m->state.mmu = snapshot_get(p) != 0; p += 4;
+    m->mem.mmu = m->state.mmu ? &m->state : NULL;
+    m->state.fault = snapshot_get(p); p += 4;
+    m->state.faultreg = snapshot_get(p); p += 4;
+    m->state.faultval = snapshot_get(p); p += 4;
+    m->state.pending = snapshot_get(p); p += 4;
+    for (i = 0; i < MMU_TLB; i++, p += 16)
+    {
+        m->state.tlb[i].hi = snapshot_get(p);
+        m->state.tlb[i].lo0 = snapshot_get(p + 4);
+        m->state.tlb[i].lo1 = snapshot_get(p + 8);
+        m->state.tlb[i].mask = snapshot_get(p + 12);
+    }
+
+    /* the counters come back from their CP0 registers, 32 bits each */
+    m->state.branches = m->state.cp0regs[PERF_CP0 + PERF_BRANCHES];
+    m->state.loads = m->state.cp0regs[PERF_CP0 + PERF_LOADS];
+    m->state.stores = m->state.cp0regs[PERF_CP0 + PERF_STORES];
+    m->mem.mmio = m->state.cp0regs[PERF_CP0 + PERF_MMIO];
+    m->state.traps = m->state.cp0regs[PERF_CP0 + PERF_EXCEPTIONS];
+    m->state.irqs = m->state.cp0regs[PERF_CP0 + PERF_INTERRUPTS];
+
+    m->state.nevents = 0;
+    m->state.next = ~0UL;
+    cp0_sync(&m->state);
+    idle_start(&m->idle, &m->state);
+    m->retired = 0;
+    mem_clean(&m->mem);
+
+    return 0;
+}
+
+#endif
@@ -0,0 +1,341 @@
+/* MIPS Emulator - binary execution traces */
+/* Copyright 2024 Daniil Dunaef */
+
+#ifndef MIPS_TRACE
+#define MIPS_TRACE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mips.h"
+#include "mips_machine.h"
+
+/* @note trace_step() single steps a machine and records the pc, the
+    instruction word, the registers it changed and the address and data
+    of its load or store. Records are delta encoded: the pc only when it
+    is not the previous one plus 4, the instruction only when it is not
+    what the same pc held last time (a small cache on both sides), the
+    address as the difference to the previous one and values as varints,
+    so a typical record takes 2 to 5 bytes. Full mode streams them out
+    through a TRACE_BUFFER buffer, ring mode keeps the last size records
+    raw in memory and encodes them in trace_close(), so a dump of the last
+    instructions before a crash always decodes on its own.
+    The file is "MIPSTRAC", the version and the retired instruction count
+    before the first record, then the records. trace_read() decodes it
+    again, see tools/tracedump.c.
+*/
+
+#define TRACE_MAGIC "MIPSTRAC"
+#define TRACE_VERSION 1
+#define TRACE_BUFFER (1 << 16)
+#define TRACE_INSNS 4096 /* instruction cache of encoder and decoder, power of two */
+
+/* record tag */
+#define TRACE_PC 0x01
+#define TRACE_INSN 0x02
+#define TRACE_LOAD 0x04
+#define TRACE_STORE 0x08
+#define TRACE_REGS 0x30 /* count of register writes, 0 to 3 */
+#define TRACE_REGS_SHIFT 4
+
+#define TRACE_HI 32 /* register numbers of hi and lo */
+#define TRACE_LO 33
+
+typedef struct _MIPS_traceent
+{
+    unsigned int pc;
+    unsigned int instruction;
+    unsigned int address;
+    unsigned int data;
+    unsigned char flags; /* TRACE_LOAD or TRACE_STORE */
+    unsigned char nregs;
+    unsigned char reg[3];
+    unsigned int value[3];
+} MIPS_traceent;
+
+/* delta state, the encoder and the decoder keep the same */
+typedef struct _MIPS_tracectx
+{
+    unsigned int pc; /* expected pc of the next record */
+    unsigned int address;
+    unsigned int pcs[TRACE_INSNS];
+    unsigned int insns[TRACE_INSNS];
+} MIPS_tracectx;
+
+typedef struct _MIPS_trace
+{
+    FILE *fp;
+    unsigned char buf[TRACE_BUFFER];
+    unsigned int len;
+    MIPS_tracectx ctx;
+    MIPS_traceent *ring; /* NULL in full mode */
+    unsigned int size;
+    unsigned long count; /* records taken */
+    unsigned long clock; /* retired instructions before the first record */
+} MIPS_trace;
+
+void trace_reset(MIPS_tracectx *ctx)
+{
+    int i;
+
+    ctx->pc = 0;
+    ctx->address = 0;
+    for (i = 0; i < TRACE_INSNS; i++)
+        ctx->pcs[i] = 1; /* never a pc */
+}
+
+void trace_flush(MIPS_trace *t)
+{
+    fwrite(t->buf, 1, t->len, t->fp);
+    t->len = 0;
+}
+
+void trace_word(MIPS_trace *t, unsigned int word)
+{
+    t->buf[t->len++] = word >> 24;
+    t->buf[t->len++] = word >> 16;
+    t->buf[t->len++] = word >> 8;
+    t->buf[t->len++] = word;
+}
+
+void trace_varint(MIPS_trace *t, unsigned int value)
+{
+    while (value >= 0x80)
+    {
+        t->buf[t->len++] = (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    t->buf[t->len++] = value;
+}
+
+void trace_header(MIPS_trace *t, unsigned long clock)
+{
+    memcpy(t->buf + t->len, TRACE_MAGIC, 8);
+    t->len += 8;
+    trace_word(t, TRACE_VERSION);
+    trace_word(t, (unsigned int)(clock >> 16 >> 16));
+    trace_word(t, (unsigned int)clock);
+}
+
+void trace_encode(MIPS_trace *t, const MIPS_traceent *e)
+{
+    MIPS_tracectx *ctx = &t->ctx;
+    unsigned int slot = (e->pc >> 2) & (TRACE_INSNS - 1);
+    unsigned char tag = e->flags | e->nregs << TRACE_REGS_SHIFT;
+    int i;
+
+    /* worst case record is 1 + 4 + 4 + 10 + 3 * 6 bytes */
+    if (t->len > TRACE_BUFFER - 64)
+        trace_flush(t);
+
+    if (e->pc != ctx->pc)
+        tag |= TRACE_PC;
+    if (ctx->pcs[slot] != e->pc || ctx->insns[slot] != e->instruction)
+        tag |= TRACE_INSN;
+
+    t->buf[t->len++] = tag;
+    if (tag & TRACE_PC)
+        trace_word(t, e->pc);
+    if (tag & TRACE_INSN)
+        trace_word(t, e->instruction);
+    if (tag & (TRACE_LOAD | TRACE_STORE))
+    {
+        unsigned int delta = e->address - ctx->address;
+
+        /* zigzag, small steps either way stay short */
+        trace_varint(t, delta & 0x80000000 ? ~(delta << 1) : delta << 1);
+        trace_varint(t, e->data);
+        ctx->address = e->address;
+    }
+    for (i = 0; i < e->nregs; i++)
+    {
+        t->buf[t->len++] = e->reg[i];
+        trace_varint(t, e->value[i]);
+    }
+
+    ctx->pc = e->pc + 4;
+    ctx->pcs[slot] = e->pc;
+    ctx->insns[slot] = e->instruction;
+}
+
+/* ring keeps the last size records, 0 streams every record.
+   Returns -1 if out of memory */
+int trace_open(MIPS_trace *t, FILE *fp, unsigned int size, unsigned long clock)
+{
+    t->fp = fp;
+    t->len = 0;
+    t->size = size;
+    t->count = 0;
+    t->clock = clock;
+    t->ring = NULL;
+    trace_reset(&t->ctx);
+
+    if (size != 0)
+    {
+        t->ring = (MIPS_traceent *)malloc(size * sizeof(MIPS_traceent));
+        return t->ring != NULL ? 0 : -1;
+    }
+
+    trace_header(t, clock);
+    return 0;
+}
+
+/* writes what is left, the ring from its oldest record. Does not close fp */
+void trace_close(MIPS_trace *t)
+{
+    if (t->ring != NULL)
+    {
+        unsigned long first = t->count > t->size ? t->count - t->size : 0;
+        unsigned long i;
+
+        trace_header(t, t->clock + first);
+        for (i = first; i < t->count; i++)
+            trace_encode(t, &t->ring[i % t->size]);
+        free(t->ring);
+        t->ring = NULL;
+    }
+    trace_flush(t);
+    fflush(t->fp);
+}
+
+/* runs one instruction of m and records it, returns like machine_run() */
+int trace_step(MIPS_trace *t, MIPS_machine *m)
+{
+    MIPS_traceent local;
+    MIPS_traceent *e = t->ring != NULL ? &t->ring[t->count % t->size] : &local;
+    MIPS_state *state = &m->state;
+    unsigned int regs[34];
+    unsigned int opcode, rt;
+    int i, ret;
+
+    memcpy(regs, state->regs, sizeof(state->regs));
+    regs[TRACE_HI] = state->hi;
+    regs[TRACE_LO] = state->lo;
+
+    e->pc = state->pc;
+    e->instruction = mem_uncached(&m->mem, state->pc) ? 0 : mem_fetch(&m->mem, state->pc);
+    e->flags = 0;
+    e->nregs = 0;
+
+    /* loads and stores, the immediate is zero-extended like execute() does */
+    opcode = e->instruction >> 26;
+    rt = e->instruction >> 16 & 0x1f;
+    if (opcode >= 0x20 && opcode <= 0x2e)
+    {
+        e->flags = opcode < 0x28 ? TRACE_LOAD : TRACE_STORE;
+        e->address = state->regs[e->instruction >> 21 & 0x1f] + (e->instruction & 0xffff);
+        e->data = opcode == 0x28 ? state->regs[rt] & 0xff : opcode == 0x29 ? state->regs[rt] & 0xffff : state->regs[rt];
+    }
+
+    ret = machine_run(m, 1);
+
+    if (e->flags & TRACE_LOAD)
+        e->data = state->regs[rt];
+
+    for (i = 1; i < 34 && e->nregs < 3; i++)
+    {
+        unsigned int value = i == TRACE_HI ? state->hi : i == TRACE_LO ? state->lo : state->regs[i];
+
+        if (value != regs[i])
+        {
+            e->reg[e->nregs] = i;
+            e->value[e->nregs++] = value;
+        }
+    }
+
+    if (t->ring == NULL)
+        trace_encode(t, e);
+    t->count++;
+
+    return ret;
+}
+
+unsigned int trace_getword(FILE *fp, int *eof)
+{
+    unsigned char b[4];
+
+    if (fread(b, 1, 4, fp) != 4)
+        *eof = 1;
+    return (unsigned int)b[0] << 24 | b[1] << 16 | b[2] << 8 | b[3];
+}
+
+unsigned int trace_getvarint(FILE *fp, int *eof)
+{
+    unsigned int value = 0;
+    int shift = 0;
+    int c;
+
+    do
+    {
+        c = getc(fp);
+        if (c == EOF)
+        {
+            *eof = 1;
+            return 0;
+        }
+        value |= (unsigned int)(c & 0x7f) << shift;
+        shift += 7;
+    } while (c & 0x80 && shift < 35);
+
+    return value;
+}
+
+/* reads the header, returns -1 if fp does not hold a trace */
+int trace_begin(FILE *fp, MIPS_tracectx *ctx, unsigned long *clock)
+{
+    char magic[8];
+    int eof = 0;
+    unsigned int hi, lo;
+
+    if (fread(magic, 1, 8, fp) != 8 || memcmp(magic, TRACE_MAGIC, 8) != 0 || trace_getword(fp, &eof) != TRACE_VERSION)
+        return -1;
+    hi = trace_getword(fp, &eof);
+    lo = trace_getword(fp, &eof);
+    *clock = (unsigned long)hi << 16 << 16 | lo;
+    trace_reset(ctx);
+
+    return eof ? -1 : 0;
+}
+
+/* decodes the next record, returns -1 at the end of the trace */
+int trace_read(FILE *fp, MIPS_tracectx *ctx, MIPS_traceent *e)
+{
+    int tag = getc(fp);
+    int eof = 0;
+    unsigned int slot;
+    int i;
+
+    if (tag == EOF)
+        return -1;
+
+    e->pc = tag & TRACE_PC ? trace_getword(fp, &eof) : ctx->pc;
+    slot = (e->pc >> 2) & (TRACE_INSNS - 1);
+    e->instruction = tag & TRACE_INSN ? trace_getword(fp, &eof) : ctx->insns[slot];
+    e->flags = tag & (TRACE_LOAD | TRACE_STORE);
+    e->nregs = (tag & TRACE_REGS) >> TRACE_REGS_SHIFT;
+    if (e->flags)
+    {
+        unsigned int delta = trace_getvarint(fp, &eof);
+
+        e->address = ctx->address + (delta & 1 ? ~(delta >> 1) : delta >> 1);
+        e->data = trace_getvarint(fp, &eof);
+        ctx->address = e->address;
+    }
+    for (i = 0; i < e->nregs; i++)
+    {
+        int reg = getc(fp);
+
+        if (reg == EOF)
+            eof = 1;
+        e->reg[i] = reg;
+        e->value[i] = trace_getvarint(fp, &eof);
+    }
+
+    ctx->pc = e->pc + 4;
+    ctx->pcs[slot] = e->pc;
+    ctx->insns[slot] = e->instruction;
+
+    return eof ? -1 : 0;
+}
+
+#endif
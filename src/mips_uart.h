@@ -0,0 +1,228 @@
+/* MIPS Emulator - 8250/16550 style UART */
+/* Copyright 2024 Daniil Dunaef */
+
+#ifndef MIPS_UART
+#define MIPS_UART
+
+#include <string.h>
+#include "mips.h"
+
+/* @note Registers are bytes at base + 0..7 like on a 16550: RBR/THR, IER,
+    IIR/FCR, LCR, MCR, LSR, MSR and SCR, DLL/DLM while LCR bit 7 is set.
+    The host side never blocks the guest. Transmitted bytes collect in a
+    host buffer that goes out through mem->io.write in one call when it is
+    full and every UART_POLL instructions. The same event pulls as much
+    input as fits into the 16 byte receive FIFO through mem->io.poll,
+    which must not wait. With IER bit 0 set, arriving data raises
+    interrupt line UART_LINE once until the guest has emptied the FIFO.
+    MCR bit 4 loops transmitted bytes back into the receive FIFO.
+    uart_start() schedules the poll event, call it again after anything
+    that clears the event queue (machine_reset(), snapshot_restore()).
+    A guest that reads an empty receiver UART_SPIN times between two polls
+    without transmitting is spinning on it and asks for a STOP_WAIT stop,
+    the host can wait for input then instead of burning cycles on the loop.
+*/
+
+#define UART_FIFO 16
+#define UART_HOST 4096 /* transmitted bytes per host write */
+#define UART_POLL 1024 /* instructions between host polls */
+#define UART_SPIN 16 /* reads of an empty receiver in one poll interval that wait for input */
+#define UART_LINE 3
+
+#define UART_LSR_DR 0x01
+#define UART_LSR_OE 0x02
+#define UART_LSR_THRE 0x20
+#define UART_LSR_TEMT 0x40
+
+typedef struct _MIPS_uart
+{
+    MIPS_state *state;
+    MIPS_mem *mem;
+    unsigned int base;
+    unsigned char rx[UART_FIFO];
+    unsigned int rxhead;
+    unsigned int rxlen;
+    char tx[UART_HOST];
+    unsigned int txlen;
+    unsigned char ier, lcr, mcr, fcr, scr, dll, dlm;
+    unsigned char lsr; /* error bits only, the rest follows from the FIFOs */
+    int raised; /* receive interrupt delivered, not serviced yet */
+    unsigned int empty; /* reads of the empty receiver since the last poll */
+} MIPS_uart;
+
+void uart_flush(MIPS_uart *u)
+{
+    if (u->txlen > 0 && u->mem->io.write != NULL)
+        u->mem->io.write(u->mem->io.user, u->tx, u->txlen);
+    u->txlen = 0;
+}
+
+void uart_receive(MIPS_uart *u, unsigned char c)
+{
+    if (u->rxlen == UART_FIFO)
+    {
+        u->lsr |= UART_LSR_OE;
+        return;
+    }
+    u->rx[(u->rxhead + u->rxlen++) % UART_FIFO] = c;
+}
+
+void uart_interrupt(MIPS_uart *u)
+{
+    if (!(u->ier & 0x01) || u->rxlen == 0 || u->raised)
+        return;
+    /* a masked interrupt is lost, try again next poll */
+    if (u->state->interrupts[UART_LINE - 1] == 0xff)
+        return;
+    u->raised = 1;
+    interrupt_handler(u->state, UART_LINE, 0);
+}
+
+void uart_poll(MIPS_state *state, void *user)
+{
+    MIPS_uart *u = (MIPS_uart *)user;
+
+    uart_flush(u);
+
+    if (u->rxlen < UART_FIFO && u->mem->io.poll != NULL)
+    {
+        char buf[UART_FIFO];
+        int n = u->mem->io.poll(u->mem->io.user, buf, UART_FIFO - u->rxlen);
+        int i;
+
+        for (i = 0; i < n; i++)
+            uart_receive(u, buf[i]);
+    }
+
+    uart_interrupt(u);
+    u->empty = 0;
+    event_schedule(state, UART_POLL, uart_poll, u);
+}
+
+/* the guest looked at an empty receiver */
+void uart_empty(MIPS_uart *u)
+{
+    if (++u->empty == UART_SPIN)
+        stop_request(u->state, STOP_WAIT);
+}
+
+void uart_start(MIPS_uart *u)
+{
+    event_cancel(u->state, uart_poll, u);
+    event_schedule(u->state, UART_POLL, uart_poll, u);
+}
+
+unsigned int uart_read(void *user, unsigned int address, int size)
+{
+    MIPS_uart *u = (MIPS_uart *)user;
+    unsigned int value;
+
+    switch (address - u->base)
+    {
+        case 0:
+            if (u->lcr & 0x80)
+                return u->dll;
+            if (u->rxlen == 0)
+            {
+                uart_empty(u);
+                return 0;
+            }
+            value = u->rx[u->rxhead];
+            u->rxhead = (u->rxhead + 1) % UART_FIFO;
+            if (--u->rxlen == 0)
+                u->raised = 0;
+            return value;
+        case 1:
+            return u->lcr & 0x80 ? u->dlm : u->ier;
+        case 2:
+            value = u->fcr & 0x01 ? 0xc0 : 0x00;
+            if (u->ier & 0x01 && u->rxlen > 0)
+                return value | 0x04;
+            if (u->ier & 0x02)
+                return value | 0x02; /* THR is always empty */
+            return value | 0x01;
+        case 3:
+            return u->lcr;
+        case 4:
+            return u->mcr;
+        case 5:
+            value = u->lsr | UART_LSR_THRE | UART_LSR_TEMT | (u->rxlen > 0 ? UART_LSR_DR : 0);
+            u->lsr = 0;
+            if (u->rxlen == 0)
+                uart_empty(u);
+            return value;
+        case 6:
+            return 0xb0; /* DCD, DSR, CTS */
+        case 7:
+            return u->scr;
+    }
+    return 0;
+}
+
+void uart_write(void *user, unsigned int address, int size, unsigned int value)
+{
+    MIPS_uart *u = (MIPS_uart *)user;
+
+    value &= 0xff;
+    switch (address - u->base)
+    {
+        case 0:
+            /* polling for room to transmit is not waiting for input */
+            u->empty = 0;
+            if (u->lcr & 0x80)
+                u->dll = value;
+            else if (u->mcr & 0x10)
+                uart_receive(u, value);
+            else
+            {
+                u->tx[u->txlen++] = value;
+                if (u->txlen == UART_HOST)
+                    uart_flush(u);
+            }
+        break;
+        case 1:
+            if (u->lcr & 0x80)
+                u->dlm = value;
+            else
+            {
+                u->ier = value & 0x0f;
+                if (!(u->ier & 0x01))
+                    u->raised = 0;
+            }
+        break;
+        case 2:
+            u->fcr = value & 0xc9;
+            if (value & 0x02)
+            {
+                u->rxlen = 0;
+                u->raised = 0;
+            }
+        break;
+        case 3:
+            u->lcr = value;
+        break;
+        case 4:
+            u->mcr = value & 0x1f;
+        break;
+        case 7:
+            u->scr = value;
+        break;
+    }
+}
+
+/* maps the UART at base, returns -1 if the device table is full */
+int uart_init(MIPS_uart *u, MIPS_state *state, MIPS_mem *mem, unsigned int base)
+{
+    memset(u, 0, sizeof(MIPS_uart));
+    u->state = state;
+    u->mem = mem;
+    u->base = base;
+
+    if (mem_map(mem, base, 8, uart_read, uart_write, u) != 0)
+        return -1;
+    uart_start(u);
+
+    return 0;
+}
+
+#endif
@@ -0,0 +1,57 @@
+/* MIPS Emulator - prints binary execution traces as text */
+/* Copyright 2024 Daniil Dunaef */
+
+#include <stdio.h>
+
+#include "../src/mips.h"
+#include "../src/mips_trace.h"
+#include "../src/mips_profile.h"
+
+/* one line per instruction:
+   retired pc: instruction mnemonic [register writes] [memory access] */
+
+const char tracereg[34][5] = {"zero", "at", "v0", "v1", "a0", "a1", "a2", "a3", "t0", "t1", "t2", "t3", "t4", "t5", "t6", "t7", "s0", "s1", "s2", "s3", "s4", "s5", "s6", "s7", "t8", "t9", "k0", "k1", "gp", "sp", "fp", "ra", "hi", "lo"};
+
+const char *mnemonic(unsigned int instruction)
+{
+    const char *name = instruction >> 26 == 0 ? profile_functnames[instruction & 0x3f] : profile_opnames[instruction >> 26];
+
+    return name != NULL ? name : "?";
+}
+
+int main(int argc, char *argv[])
+{
+    MIPS_tracectx ctx;
+    MIPS_traceent e;
+    unsigned long clock;
+    FILE *fp;
+    int i;
+
+    if (argc != 2)
+    {
+        printf("Usage: %s <trace>\n", argv[0]);
+        return 1;
+    }
+
+    fp = fopen(argv[1], "rb");
+    if (fp == NULL || trace_begin(fp, &ctx, &clock) != 0)
+    {
+        printf("Not a trace: %s\n", argv[1]);
+        return 1;
+    }
+
+    while (trace_read(fp, &ctx, &e) == 0)
+    {
+        printf("%10lu 0x%08x: %08x %-9s", clock++, e.pc, e.instruction, mnemonic(e.instruction));
+        for (i = 0; i < e.nregs; i++)
+            printf(" $%s=0x%x", e.reg[i] < 34 ? tracereg[e.reg[i]] : "?", e.value[i]);
+        if (e.flags & TRACE_LOAD)
+            printf(" [0x%08x] -> 0x%x", e.address, e.data);
+        if (e.flags & TRACE_STORE)
+            printf(" [0x%08x] <- 0x%x", e.address, e.data);
+        printf("\n");
+    }
+
+    fclose(fp);
+    return 0;
+}